@@ -0,0 +1,339 @@
+/*
+ *   fs/cifsd/cache.c
+ *
+ *   Copyright (C) 2015 Samsung Electronics Co., Ltd.
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/version.h>
+
+#include "glob.h"
+#include "cache.h"
+
+/*
+ * Common part of the inode derived caches (xattr name index, SMB
+ * metadata, directory name index, negative lookups, directory
+ * snapshots): an inode keyed hash table, an LRU list bounded by a total
+ * cost and a shrinker giving entries back under memory pressure.
+ */
+
+static bool cifsd_icache_valid(struct cifsd_icache *cache,
+		struct cifsd_icache_ent *ent, struct inode *inode)
+{
+	if (ent->ino != inode->i_ino || ent->generation != inode->i_generation)
+		return false;
+	if ((cache->flags & CIFSD_ICACHE_MTIME) &&
+			!timespec_equal(&ent->mtime, &inode->i_mtime))
+		return false;
+	if ((cache->flags & CIFSD_ICACHE_CTIME) &&
+			!timespec_equal(&ent->ctime, &inode->i_ctime)) {
+		/* a write sets both times, other changes only the ctime */
+		if (!(cache->flags & CIFSD_ICACHE_WRITES) ||
+				timespec_equal(&ent->mtime, &inode->i_mtime) ||
+				!timespec_equal(&inode->i_mtime, &inode->i_ctime))
+			return false;
+	}
+	return true;
+}
+
+/* evict from the LRU head until the cache is within its budget */
+static void __cifsd_icache_trim(struct cifsd_icache *cache)
+{
+	while (cache->cost > cache->max_cost &&
+			!list_empty(&cache->lru) &&
+			!list_is_singular(&cache->lru))
+		__cifsd_icache_del(cache, list_first_entry(&cache->lru,
+					struct cifsd_icache_ent, lru));
+}
+
+/**
+ * cifsd_icache_time_settled() - check if an inode timestamp can be trusted
+ * @inode:	inode the timestamp was read from
+ * @ts:		timestamp
+ *
+ * Timestamps come from the same coarse clock, truncated to the filesystem
+ * granularity. Only one older than the current tick is sure to change
+ * with the next update of the inode.
+ *
+ * Return:	true if @ts is older than the current time of @inode's fs
+ */
+bool cifsd_icache_time_settled(struct inode *inode, struct timespec *ts)
+{
+	struct timespec now;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	now = current_time(inode);
+#else
+	now = current_fs_time(inode->i_sb);
+#endif
+	return timespec_compare(ts, &now) < 0;
+}
+
+/**
+ * cifsd_icache_ent_init() - sample the inode state an entry is built from
+ * @ent:	entry to initialize
+ * @inode:	inode the entry describes
+ *
+ * Called before reading what is cached, so that a change during the read
+ * makes the entry stale.
+ */
+void cifsd_icache_ent_init(struct cifsd_icache_ent *ent, struct inode *inode)
+{
+	INIT_HLIST_NODE(&ent->node);
+	ent->inode = inode;
+	ent->ino = inode->i_ino;
+	ent->generation = inode->i_generation;
+	ent->mtime = inode->i_mtime;
+	ent->ctime = inode->i_ctime;
+	ent->cost = 1;
+
+	ent->unsettled = 0;
+	if (!cifsd_icache_time_settled(inode, &ent->mtime))
+		ent->unsettled |= CIFSD_ICACHE_MTIME;
+	if (!cifsd_icache_time_settled(inode, &ent->ctime))
+		ent->unsettled |= CIFSD_ICACHE_CTIME;
+}
+
+void cifsd_icache_lock(struct cifsd_icache *cache)
+{
+	spin_lock(&cache->lock);
+}
+
+/**
+ * cifsd_icache_unlock() - drop the cache lock and free unhashed entries
+ * @cache:	cache locked by cifsd_icache_lock()
+ */
+void cifsd_icache_unlock(struct cifsd_icache *cache)
+{
+	struct cifsd_icache_ent *ent, *tmp;
+	LIST_HEAD(dispose);
+
+	list_splice_init(&cache->dispose, &dispose);
+	spin_unlock(&cache->lock);
+
+	list_for_each_entry_safe(ent, tmp, &dispose, lru)
+		cache->free(ent);
+}
+
+/**
+ * __cifsd_icache_find() - look up the valid entry of an inode
+ * @cache:	locked cache
+ * @inode:	inode to look up
+ *
+ * A stale entry is unhashed and freed at unlock.
+ *
+ * Return:	entry, moved to the LRU tail, or NULL
+ */
+struct cifsd_icache_ent *__cifsd_icache_find(struct cifsd_icache *cache,
+		struct inode *inode)
+{
+	struct cifsd_icache_ent *ent;
+
+	hash_for_each_possible(cache->table, ent, node,
+			(unsigned long)inode) {
+		if (ent->inode != inode)
+			continue;
+		if (cifsd_icache_valid(cache, ent, inode)) {
+			list_move_tail(&ent->lru, &cache->lru);
+			return ent;
+		}
+		__cifsd_icache_del(cache, ent);
+		break;
+	}
+	return NULL;
+}
+
+/**
+ * __cifsd_icache_add() - hash a new entry unless the inode has one
+ * @cache:	locked cache
+ * @ent:	entry set up with cifsd_icache_ent_init()
+ *
+ * If another builder raced in first, @ent is freed at unlock. So is an
+ * entry sampled in the tick its timestamps were set in; it is returned
+ * to the builder for this one use, but never hashed.
+ *
+ * Return:	entry of the inode now in the cache, @ent or the old one
+ */
+struct cifsd_icache_ent *__cifsd_icache_add(struct cifsd_icache *cache,
+		struct cifsd_icache_ent *ent)
+{
+	struct cifsd_icache_ent *old;
+
+	if (ent->unsettled & cache->flags) {
+		list_add(&ent->lru, &cache->dispose);
+		return ent;
+	}
+
+	old = __cifsd_icache_find(cache, ent->inode);
+	if (old) {
+		list_add(&ent->lru, &cache->dispose);
+		return old;
+	}
+
+	hash_add(cache->table, &ent->node, (unsigned long)ent->inode);
+	list_add_tail(&ent->lru, &cache->lru);
+	cache->cost += ent->cost;
+	__cifsd_icache_trim(cache);
+	return ent;
+}
+
+/**
+ * __cifsd_icache_del() - unhash an entry, it is freed at unlock
+ * @cache:	locked cache
+ * @ent:	hashed entry
+ */
+void __cifsd_icache_del(struct cifsd_icache *cache,
+		struct cifsd_icache_ent *ent)
+{
+	hash_del(&ent->node);
+	list_move(&ent->lru, &cache->dispose);
+	cache->cost -= ent->cost;
+}
+
+/**
+ * __cifsd_icache_charge() - account a size change of an entry
+ * @cache:	locked cache
+ * @ent:	entry returned by __cifsd_icache_find() or __cifsd_icache_add()
+ * @cost:	cost added, negative if released
+ */
+void __cifsd_icache_charge(struct cifsd_icache *cache,
+		struct cifsd_icache_ent *ent, long cost)
+{
+	ent->cost += cost;
+	if (hlist_unhashed(&ent->node))
+		return;
+	cache->cost += cost;
+	__cifsd_icache_trim(cache);
+}
+
+/**
+ * cifsd_icache_invalidate() - drop the entry of an inode
+ * @cache:	cache
+ * @inode:	inode whose cached state is being changed
+ */
+void cifsd_icache_invalidate(struct cifsd_icache *cache, struct inode *inode)
+{
+	struct cifsd_icache_ent *ent;
+
+	cifsd_icache_lock(cache);
+	hash_for_each_possible(cache->table, ent, node,
+			(unsigned long)inode) {
+		if (ent->inode == inode) {
+			__cifsd_icache_del(cache, ent);
+			break;
+		}
+	}
+	cifsd_icache_unlock(cache);
+}
+
+/**
+ * cifsd_icache_shrink() - free least recently used entries
+ * @cache:	cache
+ * @nr:		number of shrinker objects to free
+ *
+ * Return:	number of shrinker objects freed
+ */
+static unsigned long cifsd_icache_shrink(struct cifsd_icache *cache,
+		unsigned long nr)
+{
+	struct cifsd_icache_ent *ent;
+	unsigned long freed = 0;
+
+	cifsd_icache_lock(cache);
+	while (freed < nr && !list_empty(&cache->lru)) {
+		ent = list_first_entry(&cache->lru, struct cifsd_icache_ent,
+				lru);
+		freed += max_t(unsigned long, ent->cost >> cache->cost_shift,
+				1);
+		__cifsd_icache_del(cache, ent);
+	}
+	cifsd_icache_unlock(cache);
+	return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+static unsigned long cifsd_icache_count_objects(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct cifsd_icache *cache = container_of(shrink, struct cifsd_icache,
+			shrinker);
+
+	return cache->cost >> cache->cost_shift;
+}
+
+static unsigned long cifsd_icache_scan_objects(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct cifsd_icache *cache = container_of(shrink, struct cifsd_icache,
+			shrinker);
+
+	return cifsd_icache_shrink(cache, sc->nr_to_scan);
+}
+#else
+static int cifsd_icache_shrink_old(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct cifsd_icache *cache = container_of(shrink, struct cifsd_icache,
+			shrinker);
+
+	if (sc->nr_to_scan)
+		cifsd_icache_shrink(cache, sc->nr_to_scan);
+	return min_t(unsigned long, cache->cost >> cache->cost_shift,
+			INT_MAX);
+}
+#endif
+
+/**
+ * cifsd_icache_init() - set up a cache and register its shrinker
+ * @cache:	cache to set up
+ * @flags:	CIFSD_ICACHE_MTIME and/or CIFSD_ICACHE_CTIME
+ * @max_cost:	budget over which least recently used entries are evicted
+ * @cost_shift:	log2 of the cost units counted as one shrinker object
+ * @free:	frees an unhashed entry, called without the lock held
+ */
+void cifsd_icache_init(struct cifsd_icache *cache, unsigned int flags,
+		unsigned long max_cost, unsigned int cost_shift,
+		void (*free)(struct cifsd_icache_ent *ent))
+{
+	hash_init(cache->table);
+	INIT_LIST_HEAD(&cache->lru);
+	INIT_LIST_HEAD(&cache->dispose);
+	spin_lock_init(&cache->lock);
+	cache->flags = flags;
+	cache->cost = 0;
+	cache->max_cost = max_cost;
+	cache->cost_shift = cost_shift;
+	cache->free = free;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+	cache->shrinker.count_objects = cifsd_icache_count_objects;
+	cache->shrinker.scan_objects = cifsd_icache_scan_objects;
+#else
+	cache->shrinker.shrink = cifsd_icache_shrink_old;
+#endif
+	cache->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&cache->shrinker);
+}
+
+/**
+ * cifsd_icache_exit() - unregister the shrinker and free all entries
+ * @cache:	cache set up by cifsd_icache_init()
+ */
+void cifsd_icache_exit(struct cifsd_icache *cache)
+{
+	unregister_shrinker(&cache->shrinker);
+	cifsd_icache_shrink(cache, ULONG_MAX);
+}
@@ -0,0 +1,91 @@
+/*
+ *   fs/cifsd/cache.h
+ *
+ *   Copyright (C) 2015 Samsung Electronics Co., Ltd.
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_CACHE_H
+#define __CIFSD_CACHE_H
+
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+
+/* inode timestamps an entry is validated against */
+#define CIFSD_ICACHE_MTIME	0x1
+#define CIFSD_ICACHE_CTIME	0x2
+/* with CTIME: a ctime moved by a data write, along with mtime, is kept */
+#define CIFSD_ICACHE_WRITES	0x4
+
+/*
+ * Header of a cached object derived from an inode. The owner embeds it
+ * and fills in the rest; inode number and generation catch an inode that
+ * was freed and reused, the sampled timestamps a change behind our back.
+ * A timestamp still in the current clock tick when sampled could be
+ * reused by a later change, such an entry is never hashed.
+ */
+struct cifsd_icache_ent {
+	struct hlist_node node;
+	struct list_head lru;		/* LRU, or dispose list once unhashed */
+	struct inode *inode;
+	unsigned long ino;
+	__u32 generation;
+	struct timespec mtime;
+	struct timespec ctime;
+	unsigned int unsettled;		/* CIFSD_ICACHE_* sampled in this tick */
+	unsigned long cost;
+};
+
+/*
+ * Per-inode cache with LRU eviction over a total cost and a shrinker.
+ * Entries that are unhashed while the lock is held are freed through
+ * @free after cifsd_icache_unlock(), so @free may sleep.
+ */
+struct cifsd_icache {
+	DECLARE_HASHTABLE(table, 8);
+	struct list_head lru;
+	struct list_head dispose;
+	spinlock_t lock;
+	unsigned int flags;
+	unsigned long cost;
+	unsigned long max_cost;
+	unsigned int cost_shift;	/* cost units per shrinker object */
+	void (*free)(struct cifsd_icache_ent *ent);
+	struct shrinker shrinker;
+};
+
+void cifsd_icache_init(struct cifsd_icache *cache, unsigned int flags,
+	unsigned long max_cost, unsigned int cost_shift,
+	void (*free)(struct cifsd_icache_ent *ent));
+void cifsd_icache_exit(struct cifsd_icache *cache);
+bool cifsd_icache_time_settled(struct inode *inode, struct timespec *ts);
+void cifsd_icache_ent_init(struct cifsd_icache_ent *ent, struct inode *inode);
+void cifsd_icache_lock(struct cifsd_icache *cache);
+void cifsd_icache_unlock(struct cifsd_icache *cache);
+struct cifsd_icache_ent *__cifsd_icache_find(struct cifsd_icache *cache,
+	struct inode *inode);
+struct cifsd_icache_ent *__cifsd_icache_add(struct cifsd_icache *cache,
+	struct cifsd_icache_ent *ent);
+void __cifsd_icache_del(struct cifsd_icache *cache,
+	struct cifsd_icache_ent *ent);
+void __cifsd_icache_charge(struct cifsd_icache *cache,
+	struct cifsd_icache_ent *ent, long cost);
+void cifsd_icache_invalidate(struct cifsd_icache *cache, struct inode *inode);
+
+#endif /* __CIFSD_CACHE_H */
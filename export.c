@@ -181,6 +181,7 @@ static void init_params(struct cifsd_share *share)
 	set_attr_readonly(&share->config.attr);
 	set_attr_writeok(&share->config.attr);
 	share->config.max_connections = 0;
+	share->config.drop_behind = DISABLE;
 }
 
 /**
@@ -966,6 +967,8 @@ enum {
 	Opt_hostallow,
 	Opt_hostdeny,
 	Opt_store_dos_attr,
+	Opt_drop_behind,
+	Opt_stream_files,
 
 	Opt_share_err
 };
@@ -992,6 +995,8 @@ static const match_table_t cifsd_share_tokens = {
 	{ Opt_hostallow, "hosts allow = %s" },
 	{ Opt_hostdeny, "hosts deny = %s" },
 	{ Opt_store_dos_attr, "store dos attributes = %s" },
+	{ Opt_drop_behind, "cache drop behind = %s" },
+	{ Opt_stream_files, "streams in files = %s" },
 
 	{ Opt_share_err, NULL }
 };
@@ -1322,6 +1327,20 @@ static int cifsd_parse_share_options(const char *configdata)
 			else
 				clear_attr_store_dos(&share->config.attr);
 			break;
+		case Opt_stream_files:
+			if (!share || cifsd_get_config_val(args, &val))
+				goto config_err;
+			if (val == 1)
+				set_attr_stream_files(&share->config.attr);
+			else
+				clear_attr_stream_files(&share->config.attr);
+			break;
+		case Opt_drop_behind:
+			if (!share || cifsd_get_config_val(args,
+						&share->config.drop_behind) ||
+					share->config.drop_behind == MANDATORY)
+				goto config_err;
+			break;
 		default:
 			cifsd_err("[%s] not supported\n", data);
 			break;
@@ -1566,6 +1585,7 @@ static ssize_t show_server_stat(char *buf)
 {
 	struct cifsd_share *share;
 	struct list_head *tmp;
+	unsigned long hits, misses;
 	int count = 0, cum = 0, ret = 0, limit = PAGE_SIZE;
 
 	ret = snprintf(buf+cum, limit - cum,
@@ -1587,6 +1607,14 @@ static ssize_t show_server_stat(char *buf)
 		return cum;
 	cum += ret;
 
+	smb_inode_meta_stats(&hits, &misses);
+	ret = snprintf(buf+cum, limit - cum,
+			"Inode metadata cache hits = %lu, misses = %lu\n",
+			hits, misses);
+	if (ret < 0)
+		return cum;
+	cum += ret;
+
 	return cum;
 }
 
@@ -106,7 +106,6 @@ struct cifsd_sess {
 	struct list_head cifsd_ses_list;
 	struct list_head cifsd_ses_global_list;
 	struct list_head tcon_list;
-	struct hlist_head notify_table[64];
 	int tcon_count;
 	int valid;
 	unsigned int sequence_number;
@@ -123,6 +122,8 @@ struct cifsd_sess {
 	struct cifsd_pipe *pipe_desc[MAX_PIPE];
 	wait_queue_head_t pipe_q;
 	int ev_state;
+	/* bytes written by this session not yet pushed to writeback */
+	atomic_long_t dirty_bytes;
 };
 
 enum share_attrs {
@@ -134,7 +135,8 @@ enum share_attrs {
 	SH_WRITEABLE,
 	SH_READONLY,
 	SH_WRITEOK,
-	SH_STORE_DOS
+	SH_STORE_DOS,
+	SH_STREAM_FILES
 };
 
 #define SHARE_ATTR(bit, name)					\
@@ -163,6 +165,7 @@ SHARE_ATTR(SH_OPLOCKS, oplocks)		/* default: enabled */
 SHARE_ATTR(SH_READONLY, readonly)	/* default: enabled */
 SHARE_ATTR(SH_WRITEOK, writeok)		/* default: enabled */
 SHARE_ATTR(SH_STORE_DOS, store_dos)	/* default: disable */
+SHARE_ATTR(SH_STREAM_FILES, stream_files)	/* default: disable */
 
 struct share_config {
 	char *comment;
@@ -174,6 +177,7 @@ struct share_config {
 	char *valid_users;
 	unsigned long attr;
 	unsigned int max_connections;
+	unsigned int drop_behind;	/* DISABLE, ENABLE or AUTO */
 };
 
 struct cifsd_share {
@@ -186,6 +190,8 @@ struct cifsd_share {
 	/* global list of shares */
 	struct list_head list;
 	int writeable;
+	/* bytes written on this share not yet pushed to writeback */
+	atomic_long_t dirty_bytes;
 };
 
 /* cifsd_tcon is coupled with cifsd_share */
@@ -198,6 +204,14 @@ struct cifsd_tcon {
 	int maximal_access;
 };
 
+/* share root holding the sidecar stream store, NULL if streams are off */
+static inline struct path *cifsd_tcon_stream_root(struct cifsd_tcon *tcon)
+{
+	if (!get_attr_stream_files(&tcon->share->config.attr))
+		return NULL;
+	return &tcon->share_path;
+}
+
 /*
  * Relation between tcp session, cifsd session and cifsd tree conn:
  * 1 TCP session per client. Each TCP session is represented by 1
@@ -250,6 +264,7 @@ extern struct cifsd_tcon *get_cifsd_tcon(struct cifsd_sess *sess,
 struct cifsd_usr *get_smb_session_user(struct cifsd_sess *sess);
 #ifdef CONFIG_CIFS_SMB2_SERVER
 int cifsd_durable_reconnect(struct cifsd_sess *curr_sess,
+		uint64_t persistent_id,
 		struct cifsd_durable_state *durable_state,
 		struct file **filp);
 #endif
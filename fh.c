@@ -23,199 +23,203 @@
 #include "export.h"
 #include "smb1pdu.h"
 #include "oplock.h"
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+#include "notify.h"
+#endif
+#include "cache.h"
 
 #include <linux/xattr.h>
+#include <linux/interval_tree_generic.h>
 
-/**
- * alloc_fid_mem() - alloc memory for fid management
- * @size:	mem allocation request size
- *
- * Return:      ptr to allocated memory or NULL
- */
-static void *alloc_fid_mem(size_t size)
-{
-	if (size <= (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)) {
-		return kzalloc(size, GFP_KERNEL|
-				__GFP_NOWARN|__GFP_NORETRY);
-	}
-	return vzalloc(size);
-}
+/* Byte-range lock index */
 
-/**
- * free_fid_mem() - free memory allocated for fid management
- * @ptr:	ptr to memory to be freed
- */
-static void free_fid_mem(void *ptr)
-{
-	is_vmalloc_addr(ptr) ? vfree(ptr) : kfree(ptr);
-}
+#define LOCK_START(lock)	((lock)->start)
+#define LOCK_LAST(lock)		((lock)->end)
 
-/**
- * free_fidtable() - free memory allocated for fid table
- * @ftab:	fid table ptr to be freed
- */
-void free_fidtable(struct fidtable *ftab)
+INTERVAL_TREE_DEFINE(struct cifsd_lock, rb, loff_t, __subtree_last,
+		LOCK_START, LOCK_LAST, static, cifsd_lock_it)
+
+static DEFINE_HASHTABLE(lock_tree_table, 8);
+static DEFINE_SPINLOCK(lock_tree_lock);
+
+static struct cifsd_lock_tree *__lookup_lock_tree(struct inode *inode)
 {
-	free_fid_mem(ftab->fileid);
-	free_fid_mem(ftab->cifsd_bitmap);
-	kfree(ftab);
+	struct cifsd_lock_tree *tree;
+
+	hash_for_each_possible_rcu(lock_tree_table, tree, node,
+			(unsigned long)inode)
+		if (tree->inode == inode)
+			return tree;
+	return NULL;
 }
 
 /**
- * alloc_fidtable() - alloc fid table
- * @num:	alloc number of entries in fid table
+ * cifsd_lock_index_add() - add a lock to the index of its inode
+ * @lock:	lock to be added, ->fl must point to the locked file
  *
- * Return:      ptr to allocated fid table or NULL
+ * Return:      0 on success, otherwise -ENOMEM
  */
-static struct fidtable *alloc_fidtable(unsigned int num)
+int cifsd_lock_index_add(struct cifsd_lock *lock)
 {
-	struct fidtable *ftab;
-	void *tmp;
-
-	ftab = kmalloc(sizeof(struct fidtable), GFP_KERNEL);
-	if (!ftab) {
-		cifsd_err("kmalloc for fidtable failed!\n");
-		goto out;
-	}
-
-	ftab->max_fids = num;
-
-	tmp = alloc_fid_mem(num * sizeof(void *));
-	if (!tmp) {
-		cifsd_err("alloc_fid_mem failed!\n");
-		goto out_ftab;
-	}
+	struct inode *inode = file_inode(lock->fl->fl_file);
+	struct cifsd_lock_tree *tree, *new;
 
-	ftab->fileid = tmp;
+	new = kzalloc(sizeof(struct cifsd_lock_tree), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
 
-	tmp = alloc_fid_mem(num / BITS_PER_BYTE);
-	if (!tmp) {
-		cifsd_err("alloc_fid_mem failed!\n");
-		goto out_fileid;
+	spin_lock(&lock_tree_lock);
+	tree = __lookup_lock_tree(inode);
+	if (!tree) {
+		tree = new;
+		new = NULL;
+		tree->inode = inode;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+		tree->root = RB_ROOT_CACHED;
+#else
+		tree->root = RB_ROOT;
+#endif
+		spin_lock_init(&tree->lock);
+		hash_add_rcu(lock_tree_table, &tree->node,
+				(unsigned long)inode);
 	}
 
-	ftab->cifsd_bitmap = tmp;
-
-	return ftab;
+	spin_lock(&tree->lock);
+	cifsd_lock_it_insert(lock, &tree->root);
+	lock->tree = tree;
+	tree->count++;
+	spin_unlock(&tree->lock);
+	spin_unlock(&lock_tree_lock);
 
-out_fileid:
-	free_fid_mem(ftab->fileid);
-out_ftab:
-	kfree(ftab);
-out:
-	return NULL;
+	kfree(new);
+	return 0;
 }
 
 /**
- * copy_fidtable() - copy a fid table
- * @nftab:	destination fid table ptr
- * @oftab:	src fid table ptr
+ * cifsd_lock_index_del() - remove a lock from the index of its inode
+ * @lock:	lock to be removed
+ *
+ * The per-inode tree is freed with its last lock.
  */
-static void copy_fidtable(struct fidtable *nftab, struct fidtable *oftab)
+void cifsd_lock_index_del(struct cifsd_lock *lock)
 {
-	unsigned int cpy, set;
-
-	BUG_ON(nftab->max_fids < oftab->max_fids);
+	struct cifsd_lock_tree *tree = lock->tree;
 
-	cpy = oftab->max_fids * sizeof(void *);
-	set = (nftab->max_fids - oftab->max_fids) *
-		sizeof(void *);
-	memcpy(nftab->fileid, oftab->fileid, cpy);
-	memset((char *)(nftab->fileid) + cpy, 0, set);
+	if (!tree)
+		return;
 
-	cpy = oftab->max_fids / BITS_PER_BYTE;
-	set = (nftab->max_fids - oftab->max_fids) / BITS_PER_BYTE;
-	memcpy(nftab->cifsd_bitmap, oftab->cifsd_bitmap, cpy);
-	memset((char *)(nftab->cifsd_bitmap) + cpy, 0, set);
+	spin_lock(&lock_tree_lock);
+	spin_lock(&tree->lock);
+	cifsd_lock_it_remove(lock, &tree->root);
+	lock->tree = NULL;
+	if (--tree->count) {
+		spin_unlock(&tree->lock);
+		spin_unlock(&lock_tree_lock);
+		return;
+	}
+	hash_del_rcu(&tree->node);
+	spin_unlock(&tree->lock);
+	spin_unlock(&lock_tree_lock);
+	kfree_rcu(tree, rcu);
 }
 
 /**
- * grow_fidtable() - grow fid table
- * @num:	requested number of entries in fid table
+ * cifsd_lock_tree_get() - find and lock the lock index of an inode
+ * @inode:	inode
+ *
+ * The tree stays locked until cifsd_lock_tree_put(); callers must not
+ * sleep or add/remove locks of the same inode in between. The lookup
+ * runs under RCU, inodes without locks cost no lock at all.
  *
- * Return:      1 if success, otherwise error number
+ * Return:      locked tree, or NULL if the inode has no byte-range locks
  */
-static int grow_fidtable(struct fidtable_desc *ftab_desc, int num)
+struct cifsd_lock_tree *cifsd_lock_tree_get(struct inode *inode)
 {
-	struct fidtable *new_ftab, *cur_ftab;
-	int old_num = num;
-
-	num /= (1024 / sizeof(struct cifsd_file *));
-	num = roundup_pow_of_two(num + 1);
-	num *= (1024 / sizeof(struct cifsd_file *));
-
-	if (num >= CIFSD_BITMAP_SIZE + 1)
-		return -EMFILE;
-
-	new_ftab = alloc_fidtable(num);
-	spin_lock(&ftab_desc->fidtable_lock);
-	if (!new_ftab) {
-		spin_unlock(&ftab_desc->fidtable_lock);
-		return -ENOMEM;
+	struct cifsd_lock_tree *tree;
+
+	rcu_read_lock();
+	tree = __lookup_lock_tree(inode);
+	if (tree) {
+		spin_lock(&tree->lock);
+		/* lost the race with the removal of the last lock */
+		if (!tree->count) {
+			spin_unlock(&tree->lock);
+			tree = NULL;
+		}
 	}
+	rcu_read_unlock();
+	return tree;
+}
 
-	if (unlikely(new_ftab->max_fids <= old_num)) {
-		spin_unlock(&ftab_desc->fidtable_lock);
-		free_fidtable(new_ftab);
-		return -EMFILE;
-	}
+void cifsd_lock_tree_put(struct cifsd_lock_tree *tree)
+{
+	spin_unlock(&tree->lock);
+}
 
-	cur_ftab = ftab_desc->ftab;
-	if (num >= cur_ftab->max_fids) {
-		copy_fidtable(new_ftab, cur_ftab);
-		ftab_desc->ftab = new_ftab;
-		ftab_desc->ftab->start_pos = cur_ftab->start_pos;
-		free_fidtable(cur_ftab);
-	} else {
-		free_fidtable(new_ftab);
-	}
+/**
+ * cifsd_lock_first() - first lock overlapping a byte range
+ * @tree:	locked lock index
+ * @start:	first byte of the range
+ * @end:	last byte of the range
+ *
+ * Return:      lock overlapping [start, end], or NULL
+ */
+struct cifsd_lock *cifsd_lock_first(struct cifsd_lock_tree *tree,
+		loff_t start, loff_t end)
+{
+	return cifsd_lock_it_iter_first(&tree->root, start, end);
+}
 
-	spin_unlock(&ftab_desc->fidtable_lock);
-	return 1;
+/**
+ * cifsd_lock_next() - next lock overlapping a byte range
+ * @lock:	lock returned by cifsd_lock_first() or cifsd_lock_next()
+ * @start:	first byte of the range
+ * @end:	last byte of the range
+ *
+ * Return:      next lock overlapping [start, end], or NULL
+ */
+struct cifsd_lock *cifsd_lock_next(struct cifsd_lock *lock,
+		loff_t start, loff_t end)
+{
+	return cifsd_lock_it_iter_next(lock, start, end);
 }
 
 /**
- * cifsd_get_unused_id() - get unused fid entry
+ * cifsd_get_unused_id() - reserve an unused fid
  * @ftab_desc:	fid table from where fid should be allocated
  *
- * Return:      id if success, otherwise error number
+ * The fid is reserved with an empty slot, lookups do not find it until
+ * insert_id_in_fidtable() publishes a file for it. Without generations
+ * fids are handed out cyclically so that a just closed fid is not reused
+ * right away. With generations the lowest free index is reused, which
+ * keeps the radix tree dense however many files are open.
+ *
+ * Return:      index if success, otherwise error number
  */
 int cifsd_get_unused_id(struct fidtable_desc *ftab_desc)
 {
-	void *bitmap;
-	int id = -EMFILE;
-	int err;
-	struct fidtable *fidtable;
+	int id;
 
-repeat:
+	idr_preload(GFP_KERNEL);
 	spin_lock(&ftab_desc->fidtable_lock);
-	fidtable = ftab_desc->ftab;
-	bitmap = fidtable->cifsd_bitmap;
-	id = cifsd_find_next_zero_bit(bitmap,
-			fidtable->max_fids, fidtable->start_pos);
-	if (id > fidtable->max_fids - 1) {
-		spin_unlock(&ftab_desc->fidtable_lock);
-		goto grow;
-	}
-
-	cifsd_set_bit(id, bitmap);
-	fidtable->start_pos = id + 1;
+	if (ftab_desc->use_gen)
+		id = idr_alloc(&ftab_desc->idr, NULL, CIFSD_START_FID,
+				ftab_desc->max_id, GFP_NOWAIT);
+	else
+		id = idr_alloc_cyclic(&ftab_desc->idr, NULL, CIFSD_START_FID,
+				ftab_desc->max_id, GFP_NOWAIT);
 	spin_unlock(&ftab_desc->fidtable_lock);
+	idr_preload_end();
 
+	if (id == -ENOSPC)
+		return -EMFILE;
 	return id;
-
-grow:
-	err = grow_fidtable(ftab_desc, id);
-	if (err == 1)
-		goto repeat;
-
-	return err;
 }
 
 /**
- * cifsd_close_id() - mark fid entry as free in fid table bitmap
+ * cifsd_close_id() - release a fid in fid table
  * @ftab_desc:	fid table from where fid was allocated
- * @id:		fid entry to be marked as free in fid table bitmap
+ * @id:		fid to be released, only its index is used
  *
  * If caller of cifsd_close_id() has already checked for
  * invalid value of ID, return value is not checked in that
@@ -225,53 +229,85 @@ grow:
  *
  * Return:      0 if success, otherwise -EINVAL
  */
-int cifsd_close_id(struct fidtable_desc *ftab_desc, int id)
+int cifsd_close_id(struct fidtable_desc *ftab_desc, uint64_t id)
 {
-	void *bitmap;
+	unsigned int index = CIFSD_FID_INDEX(id);
 
-	if (id >= ftab_desc->ftab->max_fids - 1) {
-		cifsd_debug("Invalid id passed to clear in bitmap\n");
+	if (index < CIFSD_START_FID || index >= ftab_desc->max_id) {
+		cifsd_debug("Invalid id passed to release\n");
 		return -EINVAL;
 	}
 
 	spin_lock(&ftab_desc->fidtable_lock);
-	bitmap = ftab_desc->ftab->cifsd_bitmap;
-	cifsd_clear_bit(id, bitmap);
-	if (id < ftab_desc->ftab->start_pos)
-		ftab_desc->ftab->start_pos = id;
+	idr_remove(&ftab_desc->idr, index);
 	spin_unlock(&ftab_desc->fidtable_lock);
 	return 0;
 }
 
 /**
  * init_fidtable() - initialize fid table
- * @ftab_desc:	fid table for which bitmap should be allocated and initialized
+ * @ftab_desc:	fid table to be initialized
+ * @max_id:	upper bound of the fid indexes
+ * @use_gen:	tag fids with a generation in their upper 32 bits
+ *
+ * The table grows one radix tree node at a time as fids are allocated.
  *
- * Return:      0 if success, otherwise -ENOMEM
+ * Return:      0
  */
-int init_fidtable(struct fidtable_desc *ftab_desc)
+int init_fidtable(struct fidtable_desc *ftab_desc, unsigned int max_id,
+		bool use_gen)
 {
-	ftab_desc->ftab = alloc_fidtable(CIFSD_NR_OPEN_DEFAULT);
-	if (!ftab_desc->ftab) {
-		cifsd_err("Failed to allocate fid table\n");
-		return -ENOMEM;
-	}
-	ftab_desc->ftab->max_fids = CIFSD_NR_OPEN_DEFAULT;
-	ftab_desc->ftab->start_pos = 1;
+	idr_init(&ftab_desc->idr);
 	spin_lock_init(&ftab_desc->fidtable_lock);
+	ftab_desc->max_id = max_id;
+	ftab_desc->use_gen = use_gen;
+	ftab_desc->gen = 0;
 	return 0;
 }
 
 /* Volatile ID operations */
 
+static void cifsd_fp_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(cifsd_filp_cache,
+			container_of(head, struct cifsd_file, rcu));
+}
+
+/**
+ * cifsd_fp_free() - free a cifsd file pointer
+ * @fp:		cifsd file pointer no longer reachable through the fid table
+ *
+ * The structure itself is freed after a grace period, a lockless lookup
+ * in get_id_from_fidtable() may still be looking at it.
+ */
+static void cifsd_fp_free(struct cifsd_file *fp)
+{
+	if (fp->stream_filp)
+		fput(fp->stream_filp);
+	if (fp->stream_root.dentry)
+		path_put(&fp->stream_root);
+	if (fp->is_stream)
+		kfree(fp->stream_name);
+	smb_vfs_readdir_buf_free(&fp->readdir_data);
+	kfree(fp->srch_pattern);
+	if (fp->dir_snap)
+		smb_dir_snap_put(fp->dir_snap);
+	kfree(fp->srch_scratch);
+	call_rcu(&fp->rcu, cifsd_fp_free_rcu);
+}
+
 /**
  * insert_id_in_fidtable() - insert a fid in fid table
- * @server:	TCP server instance of connection
- * @id:		fid to be inserted into fid table
+ * @sess:	session the fid belongs to
+ * @sess_id:	session id
+ * @tree_id:	tree id of the open
+ * @id:		fid index reserved by cifsd_get_unused_id()
  * @filp:	associate this filp with fid
  *
- * allocate a cifsd file node, associate given filp with id
- * add insert this fid in fid table by marking it in fid bitmap
+ * allocate a cifsd file node, associate given filp with id and publish
+ * it in the fid table. The fid table owns the initial reference, it is
+ * dropped by close_id(). The fid handed to the client, including its
+ * generation, is fp->volatile_id.
  *
  * Return:      cifsd file pointer if success, otherwise NULL
  */
@@ -279,8 +315,7 @@ struct cifsd_file *
 insert_id_in_fidtable(struct cifsd_sess *sess, uint64_t sess_id,
 		uint32_t tree_id, unsigned int id, struct file *filp)
 {
-	struct cifsd_file *fp = NULL;
-	struct fidtable *ftab;
+	struct cifsd_file *fp = NULL, *old;
 
 	fp = kmem_cache_zalloc(cifsd_filp_cache, GFP_NOFS);
 	if (!fp) {
@@ -293,65 +328,159 @@ insert_id_in_fidtable(struct cifsd_sess *sess, uint64_t sess_id,
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	fp->sess_id = sess_id;
 #endif
+	fp->sess = sess;
+	atomic_set(&fp->refcount, 1);
+	spin_lock_init(&fp->wb_lock);
 
 	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-	BUG_ON(ftab->fileid[id] != NULL);
-	ftab->fileid[id] = fp;
+	fp->volatile_id = id;
+	if (sess->fidtable.use_gen)
+		fp->volatile_id |= (uint64_t)sess->fidtable.gen++ <<
+			CIFSD_FID_GEN_SHIFT;
+	old = idr_replace(&sess->fidtable.idr, fp, id);
 	spin_unlock(&sess->fidtable.fidtable_lock);
+	BUG_ON(old != NULL);
 
-	return ftab->fileid[id];
+	return fp;
 }
 
 /**
  * get_id_from_fidtable() - get cifsd file pointer for a fid
- * @server:	TCP server instance of connection
+ * @sess:	session the fid belongs to
  * @id:		fid to be looked into fid table
  *
- * lookup a fid in fid table and return associated cifsd file pointer
+ * lookup a fid in fid table and return associated cifsd file pointer.
+ * The lookup runs under RCU and takes a reference on the file, it does
+ * not touch the table lock. A fid whose generation does not match the
+ * open at its index is stale and not found. Drop the reference with
+ * cifsd_fp_put().
  *
  * Return:      cifsd file pointer if success, otherwise NULL
  */
 struct cifsd_file *
 get_id_from_fidtable(struct cifsd_sess *sess, uint64_t id)
 {
-	struct cifsd_file *file;
-	struct fidtable *ftab;
+	struct cifsd_file *fp;
+	unsigned int index = CIFSD_FID_INDEX(id);
 
-	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-	if ((id < CIFSD_START_FID) || (id > ftab->max_fids - 1)) {
-		spin_unlock(&sess->fidtable.fidtable_lock);
+	if (index < CIFSD_START_FID || index >= sess->fidtable.max_id) {
 		cifsd_debug("invalid fileid (%llu)\n", id);
 		return NULL;
 	}
 
-	file = ftab->fileid[id];
-	spin_unlock(&sess->fidtable.fidtable_lock);
-	return file;
+	rcu_read_lock();
+	fp = idr_find(&sess->fidtable.idr, index);
+	if (fp && (fp->volatile_id != id ||
+			!atomic_inc_not_zero(&fp->refcount)))
+		fp = NULL;
+	rcu_read_unlock();
+	return fp;
+}
+
+/**
+ * cifsd_fp_release() - close the file of a fid after its last reference
+ * @fp:		cifsd file pointer, already unpublished by close_id()
+ */
+static void cifsd_fp_release(struct cifsd_file *fp)
+{
+	struct cifsd_sess *sess = fp->sess;
+	struct file *filp = fp->islink ? fp->lfilp : fp->filp;
+
+	smb_vfs_release_write_behind(fp);
+	if (!fp->handed_over)
+		filp_close(filp, (struct files_struct *)filp);
+	cifsd_close_id(&sess->fidtable, fp->volatile_id);
+	cifsd_fp_free(fp);
+}
+
+/**
+ * cifsd_fp_put() - drop a reference on a cifsd file pointer
+ * @fp:		cifsd file pointer, may be NULL
+ *
+ * The file is closed and freed with the last reference.
+ */
+void cifsd_fp_put(struct cifsd_file *fp)
+{
+	if (!fp || !atomic_dec_and_test(&fp->refcount))
+		return;
+
+	cifsd_fp_release(fp);
 }
 
 /**
  * delete_id_from_fidtable() - delete a fid from fid table
- * @server:	TCP server instance of connection
+ * @sess:	session the fid belongs to
  * @id:		fid to be deleted from fid table
  *
- * delete a fid from fid table and free associated cifsd file pointer
+ * Unpublish a fid of a failed create whose file the caller has already
+ * closed, and drop the table reference. A concurrent lookup may still hold
+ * a reference, the fid is released and the file pointer freed with the
+ * last one.
  */
-void delete_id_from_fidtable(struct cifsd_sess *sess, unsigned int id)
+void delete_id_from_fidtable(struct cifsd_sess *sess, uint64_t id)
 {
 	struct cifsd_file *fp;
-	struct fidtable *ftab;
 
 	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-	BUG_ON(!ftab->fileid[id]);
-	fp = ftab->fileid[id];
-	if (fp->is_stream)
-		kfree(fp->stream_name);
-	kmem_cache_free(cifsd_filp_cache, fp);
-	ftab->fileid[id] = NULL;
+	fp = idr_replace(&sess->fidtable.idr, NULL, CIFSD_FID_INDEX(id));
+	BUG_ON(IS_ERR_OR_NULL(fp));
+	fp->handed_over = true;
+	spin_unlock(&sess->fidtable.fidtable_lock);
+
+	hash_del(&fp->node);
+	cifsd_fp_put(fp);
+}
+
+/**
+ * cifsd_fp_handover() - unpublish a durable fid whose file is reopened
+ * @sess:	session the fid belongs to
+ * @fp:		cifsd file pointer, referenced by the caller
+ *
+ * Used when a durable handle is reconnected on another session. The fid
+ * is unpublished and the table reference dropped like close_id() does,
+ * but the file stays open for the new session when the last reference to
+ * @fp goes away. Concurrent holders of @fp keep a valid file pointer.
+ *
+ * Return:	0 on success, -EINVAL if the fid was closed meanwhile
+ */
+int cifsd_fp_handover(struct cifsd_sess *sess, struct cifsd_file *fp)
+{
+	unsigned int index = CIFSD_FID_INDEX(fp->volatile_id);
+
+	spin_lock(&sess->fidtable.fidtable_lock);
+	if (idr_find(&sess->fidtable.idr, index) != fp) {
+		spin_unlock(&sess->fidtable.fidtable_lock);
+		return -EINVAL;
+	}
+	idr_replace(&sess->fidtable.idr, NULL, index);
+	fp->handed_over = true;
 	spin_unlock(&sess->fidtable.fidtable_lock);
+
+	cifsd_fp_put(fp);
+	return 0;
+}
+
+/**
+ * cifsd_next_fp() - next open file of a session
+ * @sess:	session
+ * @id:		fid index to start the search at, set to the index found
+ *
+ * Used to walk a fid table that close_id() modifies underneath.
+ *
+ * Return:      cifsd file pointer with a reference, or NULL at the end
+ */
+static struct cifsd_file *cifsd_next_fp(struct cifsd_sess *sess, int *id)
+{
+	struct cifsd_file *fp;
+
+	rcu_read_lock();
+	while ((fp = idr_get_next(&sess->fidtable.idr, id))) {
+		if (atomic_inc_not_zero(&fp->refcount))
+			break;
+		(*id)++;
+	}
+	rcu_read_unlock();
+	return fp;
 }
 
 /**
@@ -359,9 +488,9 @@ void delete_id_from_fidtable(struct cifsd_sess *sess, unsigned int id)
  * @server:	TCP server instance of connection
  * @id:		fid to be deleted from fid table
  *
- * lookup fid from fid table, release oplock info and close associated filp.
- * delete fid, free associated cifsd file pointer and clear fid bitmap entry
- * in fid table.
+ * lookup fid from fid table and unpublish it, release oplock info, byte
+ * range locks and change notify state, and handle delete on close. The
+ * filp is closed and the fid released with the last reference to the file.
  *
  * Return:      0 on success, otherwise error number
  */
@@ -370,7 +499,9 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 	struct cifsd_file *fp;
 	struct file *filp;
 	struct dentry *dir, *dentry;
+	struct inode *inode;
 	struct cifsd_lock *lock, *tmp;
+	unsigned int index = CIFSD_FID_INDEX(id);
 	int err;
 
 	fp = get_id_from_fidtable(sess, id);
@@ -382,9 +513,20 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 	if (fp->is_durable && fp->persistent_id != p_id) {
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, p_id);
+		cifsd_fp_put(fp);
 		return -ENOENT;
 	}
 
+	/* racing closes of the same fid fail here */
+	spin_lock(&sess->fidtable.fidtable_lock);
+	if (idr_find(&sess->fidtable.idr, index) != fp) {
+		spin_unlock(&sess->fidtable.fidtable_lock);
+		cifsd_fp_put(fp);
+		return -EINVAL;
+	}
+	idr_replace(&sess->fidtable.idr, NULL, index);
+	spin_unlock(&sess->fidtable.fidtable_lock);
+
 	close_id_del_oplock(sess->server, fp, id);
 
 	if (fp->islink)
@@ -402,6 +544,7 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 			struct smb_work *async_work = lock->work;
 
 			async_work->async->async_status = ASYNC_CLOSE;
+			smb_async_io_kick(async_work);
 		} else {
 			flock = smb_flock_init(filp);
 			flock->fl_type = F_UNLCK;
@@ -411,7 +554,7 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 			if (err)
 				cifsd_err("unlock fail : %d\n", err);
 			list_del(&lock->llist);
-			list_del(&lock->glist);
+			cifsd_lock_index_del(lock);
 			list_del(&lock->flist);
 			locks_free_lock(lock->fl);
 			locks_free_lock(flock);
@@ -419,19 +562,35 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 		}
 	}
 
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+	cifsd_notify_close(fp);
+#endif
+
 	if (fp->delete_on_close) {
 		dentry = filp->f_path.dentry;
 		dir = dentry->d_parent;
 
+		if (fp->stream_filp && !fp->delete_pending) {
+			err = smb_vfs_stream_unlink(&fp->stream_root,
+				dentry->d_inode,
+				&fp->stream_name[XATTR_NAME_STREAM_LEN]);
+			if (err)
+				cifsd_err("remove stream failed : %s\n",
+					fp->stream_name);
+			goto out_close;
+		}
+
 		if (fp->is_stream && !fp->delete_pending) {
 			err = vfs_removexattr(dentry, fp->stream_name);
 			if (err)
 				cifsd_err("remove xattr failed : %s\n",
 					fp->stream_name);
-			goto out2;
+			smb_xattr_index_invalidate(dentry->d_inode);
+			goto out_close;
 		}
 
 		dget(dentry);
+		inode = dentry->d_inode;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
 		inode_lock(dir->d_inode);
 #else
@@ -450,6 +609,8 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 #else
 		err = vfs_unlink(dir->d_inode, dentry);
 #endif
+		if (!err)
+			smb_dir_cache_invalidate(dir->d_inode);
 
 out:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
@@ -460,45 +621,42 @@ out:
 		dput(dentry);
 		if (err)
 			cifsd_debug("failed to delete, err %d\n", err);
+		else if (fp->stream_root.dentry && inode && !inode->i_nlink)
+			smb_vfs_stream_purge(&fp->stream_root, inode);
 	}
 
-	filp_close(filp, (struct files_struct *)filp);
-	delete_id_from_fidtable(sess, id);
-	cifsd_close_id(&sess->fidtable, id);
-out2:
+out_close:
+	/* the lookup reference and the one of the fid table */
+	cifsd_fp_put(fp);
+	cifsd_fp_put(fp);
 	return 0;
 }
 
 /**
  * close_opens_from_fibtable() - close all opens from a fid table
  * @sess:	TCP server session
+ * @tree_id:	tree id the opens belong to
  *
- * lookup fid from fid table, release oplock info and close associated filp.
- * delete fid, free associated cifsd file pointer and clear fid bitmap entry
- * in fid table.
+ * close every fid of the tree with close_id().
  */
 void close_opens_from_fibtable(struct cifsd_sess *sess, uint32_t tree_id)
 {
 	struct cifsd_file *file;
-	struct fidtable *ftab;
-	int id;
-
-	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-	spin_unlock(&sess->fidtable.fidtable_lock);
+	int id = 0;
 
-	for (id = 0; id < ftab->max_fids; id++) {
-		file = ftab->fileid[id];
-		if (file && file->tid == tree_id) {
+	while ((file = cifsd_next_fp(sess, &id))) {
+		if (file->tid == tree_id) {
 #ifdef CONFIG_CIFS_SMB2_SERVER
 			if (file->is_durable)
 				close_persistent_id(file->persistent_id);
 #endif
-			if (!close_id(sess, id, file->persistent_id) &&
+			if (!close_id(sess, file->volatile_id,
+					file->persistent_id) &&
 				sess->server->stats.open_files_count > 0)
 				sess->server->stats.open_files_count--;
-
 		}
+		cifsd_fp_put(file);
+		id++;
 	}
 }
 
@@ -506,35 +664,26 @@ void close_opens_from_fibtable(struct cifsd_sess *sess, uint32_t tree_id)
  * destroy_fidtable() - destroy a fid table for given cifsd thread
  * @sess:	TCP server session
  *
- * lookup fid from fid table, release oplock info and close associated filp.
- * delete fid, free associated cifsd file pointer and clear fid bitmap entry
- * in fid table.
+ * close every fid of the table with close_id().
  */
 void destroy_fidtable(struct cifsd_sess *sess)
 {
 	struct cifsd_file *file;
-	struct fidtable *ftab;
-	int id;
+	int id = 0;
 
-	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-	spin_unlock(&sess->fidtable.fidtable_lock);
-
-	for (id = 0; id < ftab->max_fids; id++) {
-		file = ftab->fileid[id];
-		if (file) {
+	while ((file = cifsd_next_fp(sess, &id))) {
 #ifdef CONFIG_CIFS_SMB2_SERVER
-			if (file->is_durable)
-				close_persistent_id(file->persistent_id);
+		if (file->is_durable)
+			close_persistent_id(file->persistent_id);
 #endif
 
-			if (!close_id(sess, id, file->persistent_id) &&
-				sess->server->stats.open_files_count > 0)
-				sess->server->stats.open_files_count--;
-		}
+		if (!close_id(sess, file->volatile_id, file->persistent_id) &&
+			sess->server->stats.open_files_count > 0)
+			sess->server->stats.open_files_count--;
+		cifsd_fp_put(file);
+		id++;
 	}
-	sess->fidtable.ftab = NULL;
-	free_fidtable(ftab);
+	idr_destroy(&sess->fidtable.idr);
 }
 
 /* End of Volatile-ID operations */
@@ -542,6 +691,53 @@ void destroy_fidtable(struct cifsd_sess *sess)
 /* Persistent-ID operations */
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
+/*
+ * Persistent ids are spread over CIFSD_PID_SHARDS fid tables so that
+ * opens on different cpus do not serialize on one table lock. The shard
+ * is encoded in the low bits of the id, the index within the shard above.
+ */
+#define CIFSD_PID_SHARD_BITS	6
+#define CIFSD_PID_SHARDS	(1 << CIFSD_PID_SHARD_BITS)
+#define CIFSD_PID_SHARD_MASK	(CIFSD_PID_SHARDS - 1)
+
+static struct fidtable_desc global_fidtable[CIFSD_PID_SHARDS];
+
+/**
+ * cifsd_pid_table() - persistent id shard of a persistent id
+ * @id:		persistent id
+ * @index:	set to the index of @id within its shard
+ *
+ * Return:      fid table of the shard, or NULL if @id is invalid
+ */
+static struct fidtable_desc *cifsd_pid_table(uint64_t id,
+		unsigned int *index)
+{
+	struct fidtable_desc *ftab;
+
+	ftab = &global_fidtable[id & CIFSD_PID_SHARD_MASK];
+	id >>= CIFSD_PID_SHARD_BITS;
+	if (id < CIFSD_START_FID || id >= ftab->max_id)
+		return NULL;
+
+	*index = id;
+	return ftab;
+}
+
+/**
+ * init_global_fidtable() - initialize persistent id shards at module init
+ *
+ * Return:      0
+ */
+int init_global_fidtable(void)
+{
+	int i;
+
+	for (i = 0; i < CIFSD_PID_SHARDS; i++)
+		init_fidtable(&global_fidtable[i],
+			CIFSD_MAX_FID_SMB2 >> CIFSD_PID_SHARD_BITS, false);
+	return 0;
+}
+
 /**
  * cifsd_insert_in_global_table() - insert a fid in global fid table
  *					for persistent id
@@ -553,22 +749,26 @@ void destroy_fidtable(struct cifsd_sess *sess)
  * Return:      persistent_id on success, otherwise error number
  */
 int cifsd_insert_in_global_table(struct cifsd_sess *sess,
-				   int volatile_id, struct file *filp,
+				   uint64_t volatile_id, struct file *filp,
 				   int durable_open)
 {
 	int rc;
-	int persistent_id;
-	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
+	int persistent_id, index;
+	struct fidtable_desc *ftab;
+	struct cifsd_durable_state *durable_state, *old;
 
-	persistent_id = cifsd_get_unused_id(&global_fidtable);
+	/* allocate from the shard of the current cpu */
+	persistent_id = raw_smp_processor_id() & CIFSD_PID_SHARD_MASK;
+	ftab = &global_fidtable[persistent_id];
+	index = cifsd_get_unused_id(ftab);
 
-	if (persistent_id < 0) {
+	if (index < 0) {
 		cifsd_err("failed to get unused persistent_id for file\n");
-		rc = persistent_id;
+		rc = index;
 		return rc;
 	}
 
+	persistent_id |= index << CIFSD_PID_SHARD_BITS;
 	cifsd_debug("persistent_id allocated %d", persistent_id);
 
 	/* If not durable open just return the ID.
@@ -581,7 +781,7 @@ int cifsd_insert_in_global_table(struct cifsd_sess *sess,
 
 	if (durable_state == NULL) {
 		cifsd_err("persistent_id insert failed\n");
-		cifsd_close_id(&global_fidtable, persistent_id);
+		cifsd_close_id(ftab, index);
 		rc = -ENOMEM;
 		return rc;
 	}
@@ -593,11 +793,10 @@ int cifsd_insert_in_global_table(struct cifsd_sess *sess,
 
 	cifsd_debug("filp stored = 0x%p sess = 0x%p\n", filp, sess);
 
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
-	BUG_ON(ftab->fileid[persistent_id] != NULL);
-	ftab->fileid[persistent_id] = (void *)durable_state;
-	spin_unlock(&global_fidtable.fidtable_lock);
+	spin_lock(&ftab->fidtable_lock);
+	old = idr_replace(&ftab->idr, durable_state, index);
+	spin_unlock(&ftab->fidtable_lock);
+	BUG_ON(old != NULL);
 
 	return persistent_id;
 }
@@ -612,18 +811,18 @@ struct cifsd_durable_state *
 cifsd_get_durable_state(uint64_t id)
 {
 	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
+	struct fidtable_desc *ftab;
+	unsigned int index;
 
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
-	if ((id < CIFSD_START_FID) || (id > ftab->max_fids - 1)) {
+	ftab = cifsd_pid_table(id, &index);
+	if (!ftab) {
 		cifsd_err("invalid persistentID (%llu)\n", id);
-		spin_unlock(&global_fidtable.fidtable_lock);
 		return NULL;
 	}
 
-	durable_state = (struct cifsd_durable_state *)ftab->fileid[id];
-	spin_unlock(&global_fidtable.fidtable_lock);
+	spin_lock(&ftab->fidtable_lock);
+	durable_state = idr_find(&ftab->idr, index);
+	spin_unlock(&ftab->fidtable_lock);
 	return durable_state;
 }
 
@@ -636,22 +835,22 @@ cifsd_get_durable_state(uint64_t id)
  */
 void cifsd_update_durable_state(struct cifsd_sess *sess,
 			     unsigned int persistent_id,
-			     unsigned int volatile_id, struct file *filp)
+			     uint64_t volatile_id, struct file *filp)
 {
 	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
+	struct fidtable_desc *ftab;
+	unsigned int index;
 
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
-
-	durable_state =
-		(struct cifsd_durable_state *)ftab->fileid[persistent_id];
+	ftab = cifsd_pid_table(persistent_id, &index);
+	BUG_ON(ftab == NULL);
+	spin_lock(&ftab->fidtable_lock);
+	durable_state = idr_find(&ftab->idr, index);
 
 	durable_state->sess = sess;
 	durable_state->volatile_id = volatile_id;
 	generic_fillattr(filp->f_path.dentry->d_inode, &durable_state->stat);
 	durable_state->refcount++;
-	spin_unlock(&global_fidtable.fidtable_lock);
+	spin_unlock(&ftab->fidtable_lock);
 	cifsd_debug("durable state updated persistentID (%u)\n",
 		      persistent_id);
 }
@@ -666,16 +865,16 @@ void cifsd_durable_disconnect(struct tcp_server_info *server,
 			   unsigned int persistent_id, struct file *filp)
 {
 	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
-
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
+	struct fidtable_desc *ftab;
+	unsigned int index;
 
-	durable_state =
-		(struct cifsd_durable_state *)ftab->fileid[persistent_id];
+	ftab = cifsd_pid_table(persistent_id, &index);
+	BUG_ON(ftab == NULL);
+	spin_lock(&ftab->fidtable_lock);
+	durable_state = idr_find(&ftab->idr, index);
 	BUG_ON(durable_state == NULL);
 	generic_fillattr(filp->f_path.dentry->d_inode, &durable_state->stat);
-	spin_unlock(&global_fidtable.fidtable_lock);
+	spin_unlock(&ftab->fidtable_lock);
 	cifsd_debug("durable state disconnect persistentID (%u)\n",
 		    persistent_id);
 }
@@ -689,22 +888,23 @@ void cifsd_durable_disconnect(struct tcp_server_info *server,
 int cifsd_delete_durable_state(uint64_t id)
 {
 	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
+	struct fidtable_desc *ftab;
+	unsigned int index;
 
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
-	if (id >= ftab->max_fids - 1) {
+	ftab = cifsd_pid_table(id, &index);
+	if (!ftab) {
 		cifsd_err("Invalid id %llu\n", id);
-		spin_unlock(&global_fidtable.fidtable_lock);
 		return -EINVAL;
 	}
-	durable_state = (struct cifsd_durable_state *)ftab->fileid[id];
+
+	spin_lock(&ftab->fidtable_lock);
+	durable_state = idr_find(&ftab->idr, index);
 
 	/* If refcount > 1 return 1 to avoid deletion of persistent-id
 	   from the global_fidtable bitmap */
 	if (durable_state && durable_state->refcount > 1) {
 		--durable_state->refcount;
-		spin_unlock(&global_fidtable.fidtable_lock);
+		spin_unlock(&ftab->fidtable_lock);
 		return 1;
 	}
 
@@ -716,10 +916,9 @@ int cifsd_delete_durable_state(uint64_t id)
 		cifsd_debug("durable state delete persistentID (%llu) refcount = %d\n",
 			    id, durable_state->refcount);
 		kfree(durable_state);
+		idr_replace(&ftab->idr, NULL, index);
 	}
-
-	ftab->fileid[id] = NULL;
-	spin_unlock(&global_fidtable.fidtable_lock);
+	spin_unlock(&ftab->fidtable_lock);
 	return 0;
 }
 
@@ -731,6 +930,8 @@ int cifsd_delete_durable_state(uint64_t id)
  */
 int close_persistent_id(uint64_t id)
 {
+	struct fidtable_desc *ftab;
+	unsigned int index;
 	int rc = 0;
 
 	rc = cifsd_delete_durable_state(id);
@@ -739,7 +940,8 @@ int close_persistent_id(uint64_t id)
 	else if (rc > 0)
 		return 0;
 
-	rc = cifsd_close_id(&global_fidtable, id);
+	ftab = cifsd_pid_table(id, &index);
+	rc = cifsd_close_id(ftab, index);
 	return rc;
 }
 
@@ -749,20 +951,13 @@ int close_persistent_id(uint64_t id)
 void destroy_global_fidtable(void)
 {
 	struct cifsd_durable_state *durable_state;
-	struct fidtable *ftab;
-	int i;
+	int i, id;
 
-	spin_lock(&global_fidtable.fidtable_lock);
-	ftab = global_fidtable.ftab;
-	global_fidtable.ftab = NULL;
-	spin_unlock(&global_fidtable.fidtable_lock);
-
-	for (i = 0; i < ftab->max_fids; i++) {
-		durable_state = (struct cifsd_durable_state *)ftab->fileid[i];
+	for (i = 0; i < CIFSD_PID_SHARDS; i++) {
+		idr_for_each_entry(&global_fidtable[i].idr, durable_state, id)
 			kfree(durable_state);
-			ftab->fileid[i] = NULL;
+		idr_destroy(&global_fidtable[i].idr);
 	}
-	free_fidtable(ftab);
 }
 #endif
 
@@ -859,19 +1054,48 @@ int cifsd_check_stat_info(struct kstat *durable_stat,
 /**
  * cifsd_durable_reconnect() - verify durable state on reconnect
  * @curr_server:	TCP server instance of connection
+ * @persistent_id:	persistent id of the durable open
  * @durable_stat:	durable state of filp
  * @filp:		current inode stat
  *
  * Return:		0 if no mismatch, otherwise error
  */
 int cifsd_durable_reconnect(struct cifsd_sess *curr_sess,
+			  uint64_t persistent_id,
 			  struct cifsd_durable_state *durable_state,
 			  struct file **filp)
 {
-	struct kstat stat;
+	struct fidtable_desc *ftab;
+	struct cifsd_file *fp;
+	struct kstat stat, durable_stat;
 	struct path *path;
+	unsigned int index;
 	int rc = 0;
 
+	ftab = cifsd_pid_table(persistent_id, &index);
+	if (!ftab)
+		return -EINVAL;
+
+	/*
+	 * A client normally reconnects before the old connection has noticed
+	 * it is gone, so the state still holds the stat taken at open. While
+	 * the old handle is open, changes to its file were allowed; take the
+	 * stat of the still open file as the disconnect would have done.
+	 */
+	fp = get_id_from_fidtable(durable_state->sess,
+			durable_state->volatile_id);
+	spin_lock(&ftab->fidtable_lock);
+	if (idr_find(&ftab->idr, index) != durable_state) {
+		spin_unlock(&ftab->fidtable_lock);
+		cifsd_fp_put(fp);
+		return -EINVAL;
+	}
+	if (fp)
+		generic_fillattr(GET_FP_INODE(fp), &durable_state->stat);
+	durable_stat = durable_state->stat;
+	spin_unlock(&ftab->fidtable_lock);
+	cifsd_fp_put(fp);
+
 	rc = cifsd_durable_verify_and_del_oplock(curr_sess,
 						   durable_state->sess,
 						   durable_state->volatile_id,
@@ -891,7 +1115,7 @@ int cifsd_durable_reconnect(struct cifsd_sess *curr_sess,
 	path = &((*filp)->f_path);
 	generic_fillattr(path->dentry->d_inode, &stat);
 
-	if (!cifsd_check_stat_info(&durable_state->stat, &stat)) {
+	if (!cifsd_check_stat_info(&durable_stat, &stat)) {
 		cifsd_err("Stat info mismatch file state changed\n");
 		fput(*filp);
 		rc = -EINVAL;
@@ -903,42 +1127,27 @@ int cifsd_durable_reconnect(struct cifsd_sess *curr_sess,
 /**
  * cifsd_update_durable_stat_info() - update durable state of all
  *		persistent fid of a server thread
- * @server:	TCP server instance of connection
+ * @sess:	session whose connection is going away
+ *
+ * Called once at disconnect rather than after every response, so the
+ * walk over the open files is not paid on the request path.
  */
 void cifsd_update_durable_stat_info(struct cifsd_sess *sess)
 {
 	struct cifsd_file *fp;
-	struct fidtable *ftab;
-	int id;
-	struct cifsd_durable_state *durable_state;
-	struct fidtable *gtab;
-	struct file *filp;
-	uint64_t p_id;
+	int id = 0;
 
 	if (durable_enable == false || !sess)
 		return;
 
-	spin_lock(&sess->fidtable.fidtable_lock);
-	ftab = sess->fidtable.ftab;
-
-	for (id = 0; id < ftab->max_fids; id++) {
-		fp = ftab->fileid[id];
-		if (fp && fp->is_durable) {
-			/* Mainly for updating kstat info */
-			filp = fp->filp;
-			p_id = fp->persistent_id;
-			spin_lock(&global_fidtable.fidtable_lock);
-
-			gtab = global_fidtable.ftab;
-			durable_state =
-			  (struct cifsd_durable_state *)gtab->fileid[p_id];
-			BUG_ON(durable_state == NULL);
-			generic_fillattr(filp->f_path.dentry->d_inode,
-					 &durable_state->stat);
-			spin_unlock(&global_fidtable.fidtable_lock);
-		}
+	while ((fp = cifsd_next_fp(sess, &id))) {
+		/* Mainly for updating kstat info */
+		if (fp->is_durable)
+			cifsd_durable_disconnect(sess->server,
+					fp->persistent_id, fp->filp);
+		cifsd_fp_put(fp);
+		id++;
 	}
-	spin_unlock(&sess->fidtable.fidtable_lock);
 }
 #endif
 
@@ -1002,6 +1211,7 @@ int smb_dentry_open(struct smb_work *work, const struct path *path,
 	}
 
 	INIT_LIST_HEAD(&fp->lock_list);
+	smb_vfs_init_cache_mode(fp, work->tcon);
 
 	if (!oplocks_enable || S_ISDIR(file_inode(filp)->i_mode))
 		*oplock = OPLOCK_NONE;
@@ -1037,6 +1247,7 @@ bool is_dir_empty(struct cifsd_file *fp)
 		.ctx.actor = smb_filldir,
 #endif
 		.dirent = (void *)__get_free_page(GFP_KERNEL),
+		.size = PAGE_SIZE,
 		.dirent_count = 0
 	};
 
@@ -1090,85 +1301,1004 @@ int smb_kern_path(char *name, unsigned int flags, struct path *path,
 }
 
 /**
- * smb_search_dir() - lookup a file in a directory
- * @dirname:	directory name
- * @filename:	filename to lookup
+ * smb_share_rel_name() - get the part of an absolute name below the share
+ * @tcon:	tree connection the name was built for
+ * @name:	absolute name from convert_to_unix_name()
  *
- * Return:	0 on success, otherwise error
+ * Return:	name relative to the share root, NULL if @name is not below it
  */
-int smb_search_dir(char *dirname, char *filename)
+static char *smb_share_rel_name(struct cifsd_tcon *tcon, char *name)
 {
-	struct path dir_path;
-	int ret;
-	struct file *dfilp;
-	int flags = O_RDONLY|O_LARGEFILE;
-	int used_count, reclen;
-	int iter;
-	struct smb_dirent *buf_p;
-	int namelen = strlen(filename);
-	int dirnamelen = strlen(dirname);
-	bool match_found = false;
-	struct smb_readdir_data readdir_data = {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
-		.ctx.actor = smb_filldir,
-#endif
-		.dirent = (void *)__get_free_page(GFP_KERNEL)
-	};
+	int len = strlen(tcon->share->path);
 
-	if (!readdir_data.dirent) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	/* share path configured with a trailing '/' */
+	while (len > 0 && tcon->share->path[len - 1] == '/')
+		len--;
 
-	ret = smb_kern_path(dirname, 0, &dir_path, true);
-	if (ret)
-		goto out;
+	if (strncmp(name, tcon->share->path, len) ||
+		(name[len] != '/' && name[len] != '\0'))
+		return NULL;
 
-	dfilp = dentry_open(&dir_path, flags, current_cred());
-	if (IS_ERR(dfilp)) {
-		cifsd_err("cannot open directory %s\n", dirname);
-		ret = -EINVAL;
-		goto out2;
-	}
+	name += len;
+	while (*name == '/')
+		name++;
+	return name;
+}
 
-	while (!ret && !match_found) {
-		readdir_data.used = 0;
-		readdir_data.full = 0;
-		ret = smb_vfs_readdir(dfilp, smb_filldir, &readdir_data);
-		used_count = readdir_data.used;
-		if (ret || !used_count)
-			break;
+/**
+ * smb_check_rel_name() - sanity check a share relative name
+ * @rel:	name relative to the share root
+ *
+ * SMB clients never send ".." components, so reject them rather than let
+ * the walk climb above the share root, and bound the component count.
+ *
+ * Return:	0 on success, -EXDEV for a ".." component, -ENAMETOOLONG if
+ *		too deep
+ */
+static int smb_check_rel_name(const char *rel)
+{
+	const char *p = rel;
+	int depth = 0;
 
-		buf_p = (struct smb_dirent *)readdir_data.dirent;
-		for (iter = 0; iter < used_count; iter += reclen,
-		     buf_p = (struct smb_dirent *)((char *)buf_p + reclen)) {
-			int length;
+	while (*p) {
+		const char *end = strchrnul(p, '/');
 
-			reclen = ALIGN(sizeof(struct smb_dirent) +
-				       buf_p->namelen, sizeof(__le64));
-			length = buf_p->namelen;
-#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
-			if (length != namelen ||
-				strncasecmp(filename, buf_p->name, namelen))
-#else
-			if (length != namelen ||
-				strnicmp(filename, buf_p->name, namelen))
-#endif
-				continue;
-			/* got match, make absolute name */
-			memcpy(dirname + dirnamelen + 1, buf_p->name, namelen);
-			match_found = true;
-			break;
-		}
+		if (end - p == 2 && p[0] == '.' && p[1] == '.')
+			return -EXDEV;
+		if (end != p && ++depth > CIFSD_MAX_LOOKUP_DEPTH)
+			return -ENAMETOOLONG;
+		p = *end ? end + 1 : end;
 	}
+	return 0;
+}
 
-	free_page((unsigned long)(readdir_data.dirent));
-	fput(dfilp);
-out2:
-	path_put(&dir_path);
-out:
-	dirname[dirnamelen] = '/';
-	return ret;
+static int smb_share_kern_path_caseless(struct cifsd_tcon *tcon, char *name,
+		char *rel, unsigned int flags, struct path *path);
+
+/**
+ * smb_share_kern_path() - lookup a file relative to the share root
+ * @tcon:	tree connection the name was built for
+ * @name:	absolute name from convert_to_unix_name()
+ * @flags:	lookup flags
+ * @path:	if lookup succeed, return path info
+ * @caseless:	caseless filename lookup
+ *
+ * The walk starts at the share root held by the tree connection instead
+ * of at "/", so the share path prefix is not walked again for every
+ * request. Names outside the share fall back to smb_kern_path(), and so
+ * do caseless lookups that miss.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_share_kern_path(struct cifsd_tcon *tcon, char *name,
+		unsigned int flags, struct path *path, bool caseless)
+{
+	char *rel;
+	int err;
+
+	rel = smb_share_rel_name(tcon, name);
+	if (!rel)
+		return smb_kern_path(name, flags, path, caseless);
+
+	err = smb_check_rel_name(rel);
+	if (err)
+		return err;
+
+	if (!*rel) {
+		*path = tcon->share_path;
+		path_get(path);
+		return 0;
+	}
+
+	err = vfs_path_lookup(tcon->share_path.dentry, tcon->share_path.mnt,
+			rel, flags, path);
+	if (err == -ENOENT && caseless)
+		err = smb_share_kern_path_caseless(tcon, name, rel, flags,
+				path);
+	return err;
+}
+
+/*
+ * Case-insensitive name index for caseless lookups. The first caseless
+ * miss in a directory reads it once and indexes its entries by a case
+ * folded hash, later misses in the same directory are a hash probe. An
+ * index is valid as long as the directory mtime, which every create,
+ * unlink and rename in it updates, did not change. Indexes are kept in
+ * LRU order and given back under memory pressure by a shrinker.
+ */
+#define CIFSD_NAME_INDEX_MAX_ENTRIES	(1 << 20)
+
+struct cifsd_name_ent {
+	struct hlist_node node;
+	unsigned int hash;
+	unsigned int len;
+	char name[];
+};
+
+struct cifsd_name_index {
+	struct cifsd_icache_ent ent;
+	unsigned int count;
+	unsigned int bits;
+	struct hlist_head *heads;
+};
+
+static struct cifsd_icache name_index_cache;
+
+static unsigned int smb_name_hash(const char *name, int len)
+{
+	unsigned long hash = 0;
+
+	while (len--)
+		hash = partial_name_hash(tolower(*name++), hash);
+	return hash_long(hash, 32);
+}
+
+static void smb_name_index_free(struct cifsd_icache_ent *ent)
+{
+	struct cifsd_name_index *ni;
+	struct cifsd_name_ent *ne;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	ni = container_of(ent, struct cifsd_name_index, ent);
+	for (i = 0; i < (1U << ni->bits); i++)
+		hlist_for_each_entry_safe(ne, tmp, &ni->heads[i], node)
+			kfree(ne);
+	free_fid_mem(ni->heads);
+	kfree(ni);
+}
+
+/**
+ * smb_name_index_match() - caseless match of a name in a name index
+ * @ni:		name index
+ * @name:	name to look up, replaced by the on-disk name on success
+ * @len:	name length
+ *
+ * Return:	0 if found, -ENOENT if not
+ */
+static int smb_name_index_match(struct cifsd_name_index *ni, char *name,
+		int len)
+{
+	struct cifsd_name_ent *ne;
+	unsigned int hash = smb_name_hash(name, len);
+
+	hlist_for_each_entry(ne, &ni->heads[hash_32(hash, ni->bits)], node) {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		if (ne->hash != hash || ne->len != len ||
+			strncasecmp(ne->name, name, len))
+#else
+		if (ne->hash != hash || ne->len != len ||
+			strnicmp(ne->name, name, len))
+#endif
+			continue;
+		memcpy(name, ne->name, len);
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/**
+ * smb_name_index_lookup() - caseless lookup in a directory's name index
+ * @dir:	directory inode
+ * @name:	name to look up, replaced by the on-disk name on success
+ * @len:	name length
+ *
+ * Return:	0 if found, -ENOENT if not, -EAGAIN if not indexed
+ */
+static int smb_name_index_lookup(struct inode *dir, char *name, int len)
+{
+	struct cifsd_icache_ent *ent;
+	int err = -EAGAIN;
+
+	cifsd_icache_lock(&name_index_cache);
+	ent = __cifsd_icache_find(&name_index_cache, dir);
+	if (ent)
+		err = smb_name_index_match(container_of(ent,
+					struct cifsd_name_index, ent),
+				name, len);
+	cifsd_icache_unlock(&name_index_cache);
+	return err;
+}
+
+/**
+ * smb_name_index_build() - read a directory, index and look up a name
+ * @dfilp:	opened directory
+ * @name:	name to look up, replaced by the on-disk name on success
+ * @len:	name length
+ *
+ * The lookup is done on the new index before it is published, since an
+ * index of a directory changed in the current clock tick is not cached.
+ *
+ * Return:	0 if found, -ENOENT if not, otherwise error
+ */
+static int smb_name_index_build(struct file *dfilp, char *name, int len)
+{
+	struct inode *inode = file_inode(dfilp);
+	struct cifsd_name_index *ni;
+	struct cifsd_name_ent *ne;
+	struct hlist_head pending = HLIST_HEAD_INIT;
+	struct hlist_node *tmp;
+	struct smb_dirent *de;
+	struct smb_readdir_data r_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+		.dirent = (void *)__get_free_page(GFP_KERNEL),
+		.size = PAGE_SIZE
+	};
+	int i, err = 0;
+
+	if (!r_data.dirent)
+		return -ENOMEM;
+
+	ni = kzalloc(sizeof(struct cifsd_name_index), GFP_KERNEL);
+	if (!ni) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* sample before reading, a change during the read makes it stale */
+	cifsd_icache_ent_init(&ni->ent, inode);
+
+	do {
+		r_data.used = 0;
+		r_data.full = 0;
+		r_data.dirent_count = 0;
+		err = smb_vfs_readdir(dfilp, smb_filldir, &r_data);
+		if (err)
+			break;
+
+		de = (struct smb_dirent *)r_data.dirent;
+		for (i = 0; i < r_data.dirent_count; i++) {
+			ne = kmalloc(sizeof(struct cifsd_name_ent) +
+					de->namelen, GFP_KERNEL);
+			if (!ne) {
+				err = -ENOMEM;
+				break;
+			}
+			ne->hash = smb_name_hash(de->name, de->namelen);
+			ne->len = de->namelen;
+			memcpy(ne->name, de->name, de->namelen);
+			hlist_add_head(&ne->node, &pending);
+			ni->count++;
+
+			de = (struct smb_dirent *)((char *)de +
+				ALIGN(sizeof(struct smb_dirent) + de->namelen,
+					sizeof(__le64)));
+		}
+	} while (!err && r_data.full);
+
+	if (!err) {
+		ni->bits = ilog2(roundup_pow_of_two(max_t(unsigned int,
+						ni->count, 16)));
+		ni->heads = alloc_fid_mem(sizeof(struct hlist_head) <<
+				ni->bits);
+		if (!ni->heads)
+			err = -ENOMEM;
+	}
+
+	if (err) {
+		hlist_for_each_entry_safe(ne, tmp, &pending, node)
+			kfree(ne);
+		kfree(ni);
+		goto out;
+	}
+
+	hlist_for_each_entry_safe(ne, tmp, &pending, node) {
+		hlist_del(&ne->node);
+		hlist_add_head(&ne->node,
+				&ni->heads[hash_32(ne->hash, ni->bits)]);
+	}
+	ni->ent.cost = max_t(unsigned int, ni->count, 1);
+	err = smb_name_index_match(ni, name, len);
+
+	cifsd_icache_lock(&name_index_cache);
+	__cifsd_icache_add(&name_index_cache, &ni->ent);
+	cifsd_icache_unlock(&name_index_cache);
+out:
+	free_page((unsigned long)r_data.dirent);
+	return err;
+}
+
+/*
+ * Shared directory snapshots: the entry names of a directory together
+ * with their UTF-16 encoding, read once and then enumerated by every
+ * search handle on that directory without iterate_dir() or a charset
+ * conversion per entry. A snapshot is keyed by the directory inode and
+ * valid while its mtime and ctime, the change cookie, are unchanged;
+ * cifsd also drops it whenever it adds or removes a name itself.
+ * A write to a child does not touch the directory, so each entry keeps
+ * its own attributes, as the fixed part of the last information class
+ * record encoded for it, checked against the child inode ctime and atime.
+ * Handles keep a reference on the snapshot they enumerate until its end,
+ * the cache holds one more while the snapshot is hashed. Snapshots only
+ * held by handles are counted as pinned, and no new one is built while
+ * that exceeds the cache budget. Directories over
+ * CIFSD_DIR_SNAP_MAX_BYTES are remembered as oversize and enumerated
+ * the old way.
+ */
+#define CIFSD_DIR_SNAP_MAX_BYTES	(4 << 20)
+#define CIFSD_DIR_SNAP_TOTAL_BYTES	(64 << 20)
+
+struct cifsd_dir_snap {
+	struct cifsd_icache_ent ent;
+	atomic_t refcount;
+	bool pinned;		/* unhashed, cost counted in dir_snap_pinned */
+	spinlock_t attr_lock;
+	const struct nls_table *nls;
+	bool oversize;
+	unsigned int size;
+	unsigned int used;
+	char *buf;
+};
+
+static struct cifsd_icache dir_snap_cache;
+static atomic_long_t dir_snap_pinned = ATOMIC_LONG_INIT(0);
+
+/**
+ * smb_dir_snap_put() - drop a reference on a directory snapshot
+ * @snap:	snapshot from smb_dir_snap_get()
+ */
+void smb_dir_snap_put(struct cifsd_dir_snap *snap)
+{
+	if (!atomic_dec_and_test(&snap->refcount))
+		return;
+	if (snap->pinned)
+		atomic_long_sub(snap->ent.cost, &dir_snap_pinned);
+	kvfree(snap->buf);
+	kfree(snap);
+}
+
+/*
+ * Drops the cache reference of an unhashed snapshot. What handles still
+ * enumerate leaves the cache cost, it is counted as pinned until freed.
+ */
+static void smb_dir_snap_release(struct cifsd_icache_ent *ent)
+{
+	struct cifsd_dir_snap *snap = container_of(ent, struct cifsd_dir_snap,
+			ent);
+
+	if (atomic_read(&snap->refcount) > 1) {
+		atomic_long_add(snap->ent.cost, &dir_snap_pinned);
+		snap->pinned = true;
+	}
+	smb_dir_snap_put(snap);
+}
+
+/* make room for @len more bytes, or mark the snapshot oversize */
+static int smb_dir_snap_reserve(struct cifsd_dir_snap *snap, unsigned int len)
+{
+	unsigned int size;
+	char *buf;
+
+	if (snap->used + len <= snap->size)
+		return 0;
+
+	size = max_t(unsigned int, snap->size * 2, PAGE_SIZE);
+	while (size < snap->used + len)
+		size *= 2;
+	if (size > CIFSD_DIR_SNAP_MAX_BYTES) {
+		snap->oversize = true;
+		return -E2BIG;
+	}
+
+	buf = alloc_data_mem(size);
+	if (!buf)
+		return -ENOMEM;
+	if (snap->buf)
+		memcpy(buf, snap->buf, snap->used);
+	kvfree(snap->buf);
+	snap->buf = buf;
+	snap->size = size;
+	return 0;
+}
+
+/**
+ * smb_dir_snap_build() - read a directory into a new snapshot
+ * @dirp:	open directory
+ * @nls:	charset the names are encoded from
+ *
+ * Return:	snapshot on success, otherwise error pointer
+ */
+static struct cifsd_dir_snap *smb_dir_snap_build(struct file *dirp,
+		const struct nls_table *nls)
+{
+	struct inode *inode = file_inode(dirp);
+	struct cifsd_dir_snap *snap;
+	struct cifsd_snap_ent *ent;
+	struct smb_dirent *de;
+	struct file *dfilp;
+	struct smb_readdir_data r_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+		.dirent = (void *)__get_free_page(GFP_KERNEL),
+		.size = PAGE_SIZE
+	};
+	unsigned int reclen;
+	int i, err = 0;
+
+	if (!r_data.dirent)
+		return ERR_PTR(-ENOMEM);
+
+	snap = kzalloc(sizeof(struct cifsd_dir_snap), GFP_KERNEL);
+	if (!snap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* sample before reading, a change during the read makes it stale */
+	atomic_set(&snap->refcount, 1);
+	spin_lock_init(&snap->attr_lock);
+	cifsd_icache_ent_init(&snap->ent, inode);
+	snap->nls = nls;
+
+	/* a private open keeps the position of @dirp untouched */
+	dfilp = dentry_open(&dirp->f_path, O_RDONLY|O_LARGEFILE,
+			current_cred());
+	if (IS_ERR(dfilp)) {
+		err = PTR_ERR(dfilp);
+		goto out;
+	}
+
+	do {
+		r_data.used = 0;
+		r_data.full = 0;
+		r_data.dirent_count = 0;
+		err = smb_vfs_readdir(dfilp, smb_filldir, &r_data);
+		if (err)
+			break;
+
+		de = (struct smb_dirent *)r_data.dirent;
+		for (i = 0; i < r_data.dirent_count; i++) {
+			/* UTF-16 takes at most one unit per source byte */
+			reclen = ALIGN(sizeof(struct cifsd_snap_ent) +
+					ALIGN(de->namelen + 1, 2) +
+					(de->namelen + 1) * 2, sizeof(u64));
+			err = smb_dir_snap_reserve(snap, reclen);
+			if (err)
+				break;
+
+			ent = (struct cifsd_snap_ent *)(snap->buf + snap->used);
+			ent->ino = de->ino;
+			ent->d_type = de->d_type;
+			ent->attr.info_level = 0;
+			ent->namelen = de->namelen;
+			memcpy(ent->name, de->name, de->namelen);
+			ent->name[de->namelen] = '\0';
+			ent->uni_len = smbConvertToUTF16(SNAP_ENT_UNI(ent),
+					ent->name, ent->namelen, nls, 0) * 2;
+			snap->used += ALIGN(sizeof(struct cifsd_snap_ent) +
+					ALIGN(ent->namelen + 1, 2) +
+					ent->uni_len + 2, sizeof(u64));
+
+			de = (struct smb_dirent *)((char *)de +
+				ALIGN(sizeof(struct smb_dirent) + de->namelen,
+					sizeof(__le64)));
+		}
+	} while (!err && r_data.full);
+	fput(dfilp);
+
+	if (err == -E2BIG) {
+		kvfree(snap->buf);
+		snap->buf = NULL;
+		snap->size = snap->used = 0;
+		err = 0;
+	}
+	snap->ent.cost = sizeof(struct cifsd_dir_snap) + snap->size;
+out:
+	free_page((unsigned long)r_data.dirent);
+	if (err) {
+		if (snap)
+			smb_dir_snap_put(snap);
+		return ERR_PTR(err);
+	}
+	return snap;
+}
+
+/**
+ * smb_dir_snap_get() - get the shared snapshot of a directory
+ * @dirp:	open directory
+ * @nls:	charset the names are encoded from
+ *
+ * Return:	referenced snapshot, NULL if the directory is not cached
+ */
+struct cifsd_dir_snap *smb_dir_snap_get(struct file *dirp,
+		const struct nls_table *nls)
+{
+	struct inode *inode = file_inode(dirp);
+	struct cifsd_icache_ent *ent;
+	struct cifsd_dir_snap *snap = NULL;
+
+	cifsd_icache_lock(&dir_snap_cache);
+	ent = __cifsd_icache_find(&dir_snap_cache, inode);
+	if (ent) {
+		snap = container_of(ent, struct cifsd_dir_snap, ent);
+		if (snap->nls == nls) {
+			atomic_inc(&snap->refcount);
+		} else {
+			__cifsd_icache_del(&dir_snap_cache, ent);
+			snap = NULL;
+		}
+	}
+	cifsd_icache_unlock(&dir_snap_cache);
+
+	if (!snap) {
+		if (atomic_long_read(&dir_snap_pinned) >=
+				CIFSD_DIR_SNAP_TOTAL_BYTES)
+			return NULL;
+
+		snap = smb_dir_snap_build(dirp, nls);
+		if (IS_ERR(snap))
+			return NULL;
+
+		/*
+		 * The build reference becomes the cache reference, or is
+		 * dropped at unlock if another builder raced in first.
+		 */
+		cifsd_icache_lock(&dir_snap_cache);
+		ent = __cifsd_icache_add(&dir_snap_cache, &snap->ent);
+		snap = container_of(ent, struct cifsd_dir_snap, ent);
+		if (snap->nls == nls)
+			atomic_inc(&snap->refcount);
+		else
+			snap = NULL;
+		cifsd_icache_unlock(&dir_snap_cache);
+		if (!snap)
+			return NULL;
+	}
+
+	if (snap->oversize) {
+		smb_dir_snap_put(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+/**
+ * smb_dir_snap_next() - get the next entry of a directory snapshot
+ * @snap:	snapshot from smb_dir_snap_get()
+ * @pos:	enumeration position, advanced past the returned entry
+ *
+ * Return:	entry at @pos, NULL at the end of the snapshot
+ */
+struct cifsd_snap_ent *smb_dir_snap_next(struct cifsd_dir_snap *snap,
+		unsigned int *pos)
+{
+	struct cifsd_snap_ent *ent;
+
+	if (*pos >= snap->used)
+		return NULL;
+
+	ent = (struct cifsd_snap_ent *)(snap->buf + *pos);
+	*pos += ALIGN(sizeof(struct cifsd_snap_ent) +
+			ALIGN(ent->namelen + 1, 2) + ent->uni_len + 2,
+			sizeof(u64));
+	return ent;
+}
+
+/**
+ * smb_dir_snap_attr_sample() - sample the child state a record is built from
+ * @sample:	sampled state
+ * @inode:	inode of the child, sampled before its attributes are read
+ *
+ * Return:	true if a record built from @inode may be cached, false if
+ *		its ctime or atime may still be reused by a change
+ */
+bool smb_dir_snap_attr_sample(struct cifsd_snap_attr *sample,
+		struct inode *inode)
+{
+	sample->i_ino = inode->i_ino;
+	sample->generation = inode->i_generation;
+	sample->ctime = inode->i_ctime;
+	sample->atime = inode->i_atime;
+	return cifsd_icache_time_settled(inode, &sample->ctime) &&
+		cifsd_icache_time_settled(inode, &sample->atime);
+}
+
+/**
+ * smb_dir_snap_attr_get() - copy the cached record of a snapshot entry
+ * @snap:	snapshot @ent belongs to
+ * @ent:	snapshot entry
+ * @inode:	inode of the child
+ * @info_level:	information class of the record
+ * @rec:	destination of the fixed part of the record
+ * @len:	length of the fixed part
+ *
+ * Return:	true if a record of @info_level built from the current state
+ *		of @inode was copied to @rec
+ */
+bool smb_dir_snap_attr_get(struct cifsd_dir_snap *snap,
+		struct cifsd_snap_ent *ent, struct inode *inode,
+		int info_level, void *rec, int len)
+{
+	struct cifsd_snap_attr *attr = &ent->attr;
+	bool hit;
+
+	if (len > CIFSD_SNAP_REC_MAX)
+		return false;
+
+	spin_lock(&snap->attr_lock);
+	hit = attr->info_level == info_level &&
+		attr->i_ino == inode->i_ino &&
+		attr->generation == inode->i_generation &&
+		timespec_equal(&attr->ctime, &inode->i_ctime) &&
+		timespec_equal(&attr->atime, &inode->i_atime);
+	if (hit)
+		memcpy(rec, attr->rec, len);
+	spin_unlock(&snap->attr_lock);
+	return hit;
+}
+
+/**
+ * smb_dir_snap_attr_set() - cache the record of a snapshot entry
+ * @snap:	snapshot @ent belongs to
+ * @ent:	snapshot entry
+ * @sample:	state from smb_dir_snap_attr_sample()
+ * @info_level:	information class of the record
+ * @rec:	fixed part of the record
+ * @len:	length of the fixed part
+ */
+void smb_dir_snap_attr_set(struct cifsd_dir_snap *snap,
+		struct cifsd_snap_ent *ent, struct cifsd_snap_attr *sample,
+		int info_level, void *rec, int len)
+{
+	struct cifsd_snap_attr *attr = &ent->attr;
+
+	if (len > CIFSD_SNAP_REC_MAX)
+		return;
+
+	spin_lock(&snap->attr_lock);
+	attr->i_ino = sample->i_ino;
+	attr->generation = sample->generation;
+	attr->ctime = sample->ctime;
+	attr->atime = sample->atime;
+	attr->info_level = info_level;
+	memcpy(attr->rec, rec, len);
+	spin_unlock(&snap->attr_lock);
+}
+
+/**
+ * cifsd_dir_snap_init() - set up the directory snapshot cache
+ */
+void cifsd_dir_snap_init(void)
+{
+	cifsd_icache_init(&dir_snap_cache,
+			CIFSD_ICACHE_MTIME | CIFSD_ICACHE_CTIME,
+			CIFSD_DIR_SNAP_TOTAL_BYTES, PAGE_SHIFT,
+			smb_dir_snap_release);
+}
+
+/**
+ * cifsd_dir_snap_exit() - unregister the shrinker and drop all snapshots
+ */
+void cifsd_dir_snap_exit(void)
+{
+	cifsd_icache_exit(&dir_snap_cache);
+}
+
+/*
+ * Negative lookup cache: names a caseless lookup did not find in any case,
+ * so that repeated probes for e.g. desktop.ini or DLLs along a search path
+ * are answered without reading the directory. The names of a directory
+ * hang off one entry that, like the name index, is valid only while the
+ * directory mtime is unchanged; cifsd also drops it whenever it adds a
+ * name to the directory.
+ */
+#define CIFSD_NEG_CACHE_MAX	4096
+#define CIFSD_NEG_DIR_MAX	64
+
+struct cifsd_neg_name {
+	struct list_head list;
+	unsigned int hash;
+	unsigned int len;
+	char name[];
+};
+
+/* the entry cost is the number of names */
+struct cifsd_neg_dir {
+	struct cifsd_icache_ent ent;
+	struct list_head names;		/* most recently used first */
+};
+
+static struct cifsd_icache neg_cache;
+
+static void smb_neg_dir_free(struct cifsd_icache_ent *ent)
+{
+	struct cifsd_neg_dir *nd;
+	struct cifsd_neg_name *nn, *tmp;
+
+	nd = container_of(ent, struct cifsd_neg_dir, ent);
+	list_for_each_entry_safe(nn, tmp, &nd->names, list)
+		kfree(nn);
+	kfree(nd);
+}
+
+/**
+ * smb_neg_lookup() - check if a name is known to be absent from a directory
+ * @dir:	directory inode
+ * @name:	name to look up
+ * @len:	name length
+ *
+ * Return:	true if a caseless lookup of @name is known to miss
+ */
+static bool smb_neg_lookup(struct inode *dir, const char *name, int len)
+{
+	struct cifsd_icache_ent *ent;
+	struct cifsd_neg_dir *nd;
+	struct cifsd_neg_name *nn;
+	unsigned int hash;
+	bool found = false;
+
+	if (!neg_cache.cost)
+		return false;
+
+	hash = smb_name_hash(name, len);
+	cifsd_icache_lock(&neg_cache);
+	ent = __cifsd_icache_find(&neg_cache, dir);
+	if (!ent)
+		goto out;
+
+	nd = container_of(ent, struct cifsd_neg_dir, ent);
+	list_for_each_entry(nn, &nd->names, list) {
+		if (nn->hash != hash || nn->len != len)
+			continue;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		if (strncasecmp(nn->name, name, len))
+#else
+		if (strnicmp(nn->name, name, len))
+#endif
+			continue;
+		list_move(&nn->list, &nd->names);
+		found = true;
+		break;
+	}
+out:
+	cifsd_icache_unlock(&neg_cache);
+	return found;
+}
+
+/**
+ * smb_neg_add() - remember that a name is absent from a directory
+ * @sample:	directory state sampled before the lookup
+ * @name:	name that was not found
+ * @len:	name length
+ */
+static void smb_neg_add(struct cifsd_icache_ent *sample, const char *name,
+		int len)
+{
+	struct cifsd_icache_ent *ent;
+	struct cifsd_neg_dir *nd;
+	struct cifsd_neg_name *nn, *old = NULL;
+
+	nn = kmalloc(sizeof(struct cifsd_neg_name) + len, GFP_KERNEL);
+	if (!nn)
+		return;
+	nn->hash = smb_name_hash(name, len);
+	nn->len = len;
+	memcpy(nn->name, name, len);
+
+	nd = kmalloc(sizeof(struct cifsd_neg_dir), GFP_KERNEL);
+	if (nd) {
+		nd->ent = *sample;
+		nd->ent.cost = 0;
+		INIT_LIST_HEAD(&nd->names);
+	}
+
+	cifsd_icache_lock(&neg_cache);
+	if (nd)
+		ent = __cifsd_icache_add(&neg_cache, &nd->ent);
+	else
+		ent = __cifsd_icache_find(&neg_cache, sample->inode);
+	if (!ent || !timespec_equal(&ent->mtime, &sample->mtime) ||
+			hlist_unhashed(&ent->node)) {
+		/* the directory changed since the lookup, or still may */
+		old = nn;
+		goto out;
+	}
+
+	nd = container_of(ent, struct cifsd_neg_dir, ent);
+	if (ent->cost >= CIFSD_NEG_DIR_MAX) {
+		old = list_entry(nd->names.prev, struct cifsd_neg_name,
+				list);
+		list_del(&old->list);
+		__cifsd_icache_charge(&neg_cache, ent, -1);
+	}
+	list_add(&nn->list, &nd->names);
+	__cifsd_icache_charge(&neg_cache, ent, 1);
+out:
+	cifsd_icache_unlock(&neg_cache);
+	kfree(old);
+}
+
+/**
+ * smb_dir_cache_invalidate() - drop lookup caches of a directory
+ * @dir:	directory a name is being added to or removed from
+ *
+ * Directory mtime updates already invalidate these caches, this closes
+ * the window where an entry and the change share a timestamp tick.
+ */
+void smb_dir_cache_invalidate(struct inode *dir)
+{
+	cifsd_icache_invalidate(&dir_snap_cache, dir);
+	cifsd_icache_invalidate(&name_index_cache, dir);
+	if (neg_cache.cost)
+		cifsd_icache_invalidate(&neg_cache, dir);
+}
+
+/**
+ * cifsd_name_index_init() - set up the name index and negative cache
+ */
+void cifsd_name_index_init(void)
+{
+	cifsd_icache_init(&name_index_cache, CIFSD_ICACHE_MTIME,
+			CIFSD_NAME_INDEX_MAX_ENTRIES, 0, smb_name_index_free);
+	cifsd_icache_init(&neg_cache, CIFSD_ICACHE_MTIME,
+			CIFSD_NEG_CACHE_MAX, 0, smb_neg_dir_free);
+}
+
+/**
+ * cifsd_name_index_exit() - unregister the shrinkers and free all indexes
+ */
+void cifsd_name_index_exit(void)
+{
+	cifsd_icache_exit(&name_index_cache);
+	cifsd_icache_exit(&neg_cache);
+}
+
+/**
+ * smb_search_dir_at() - caseless lookup of a name in a directory
+ * @dir_path:	path of the directory
+ * @filename:	name to look up, replaced by the on-disk name on success
+ * @namelen:	name length
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_search_dir_at(struct path *dir_path, char *filename, int namelen)
+{
+	struct inode *dir = dir_path->dentry->d_inode;
+	struct cifsd_icache_ent sample;
+	struct file *dfilp;
+	int ret;
+
+	/* sample before the lookup, a change during it makes the miss stale */
+	cifsd_icache_ent_init(&sample, dir);
+
+	if (smb_neg_lookup(dir, filename, namelen))
+		return -ENOENT;
+
+	ret = smb_name_index_lookup(dir, filename, namelen);
+	if (ret == -EAGAIN) {
+		dfilp = dentry_open(dir_path, O_RDONLY|O_LARGEFILE,
+				current_cred());
+		if (IS_ERR(dfilp))
+			return -EINVAL;
+
+		ret = smb_name_index_build(dfilp, filename, namelen);
+		fput(dfilp);
+	}
+
+	if (ret == -ENOENT)
+		smb_neg_add(&sample, filename, namelen);
+	return ret;
+}
+
+/**
+ * smb_search_dir() - lookup a file in a directory
+ * @dirname:	directory name
+ * @filename:	filename to lookup
+ *
+ * The caseless match goes through the directory's name index, which is
+ * built on first use. On a match @filename is replaced in place by the
+ * on-disk name.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_search_dir(char *dirname, char *filename)
+{
+	struct path dir_path;
+	int dirnamelen = strlen(dirname);
+	int ret;
+
+	ret = smb_kern_path(dirname, 0, &dir_path, true);
+	if (ret)
+		goto out;
+
+	ret = smb_search_dir_at(&dir_path, filename, strlen(filename));
+	path_put(&dir_path);
+out:
+	dirname[dirnamelen] = '/';
+	return ret;
+}
+
+/**
+ * smb_srch_scratch() - get the scratch area of a search handle
+ * @fp:		directory handle
+ *
+ * Allocated on the first search and reused by every later one, so that
+ * encoding directory entries does not allocate per entry.
+ *
+ * Return:	CIFSD_SRCH_SCRATCH_SIZE bytes on success, otherwise NULL
+ */
+char *smb_srch_scratch(struct cifsd_file *fp)
+{
+	if (!fp->srch_scratch)
+		fp->srch_scratch = kmalloc(CIFSD_SRCH_SCRATCH_SIZE,
+				GFP_KERNEL);
+	return fp->srch_scratch;
+}
+
+/**
+ * smb_dir_lookup() - look up one child of an open directory
+ * @dirp:	open directory
+ * @name:	child name, replaced by the on-disk name on a caseless match
+ * @caseless:	retry a miss caselessly
+ * @stat:	stat of the child
+ * @store_dos:	the share keeps creation times in xattrs
+ * @create_time:	creation time of the child, may be NULL
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_dir_lookup(struct file *dirp, char *name, bool caseless,
+		struct kstat *stat, bool store_dos, __u64 *create_time)
+{
+	int len = strlen(name);
+	int ret;
+
+	ret = smb_vfs_child_stat(dirp, name, len, stat, store_dos,
+			create_time);
+	if (ret == -ENOENT && caseless) {
+		ret = smb_search_dir_at(&dirp->f_path, name, len);
+		if (!ret)
+			ret = smb_vfs_child_stat(dirp, name, len, stat,
+					store_dos, create_time);
+	}
+	return ret;
+}
+
+/**
+ * smb_share_kern_path_caseless() - caseless retry of a share relative lookup
+ * @tcon:	tree connection the name was built for
+ * @name:	absolute name
+ * @rel:	part of @name relative to the share root
+ * @flags:	lookup flags
+ * @path:	if lookup succeed, return path info
+ *
+ * The parent is resolved relative to the share root and only the last
+ * component is matched caselessly, going through the negative cache and
+ * the directory name index. If the parent itself differs in case, fall
+ * back to the component by component smb_kern_path().
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb_share_kern_path_caseless(struct cifsd_tcon *tcon, char *name,
+		char *rel, unsigned int flags, struct path *path)
+{
+	struct path parent;
+	char *last;
+	int err;
+
+	last = strrchr(rel, '/');
+	if (last) {
+		*last = '\0';
+		err = vfs_path_lookup(tcon->share_path.dentry,
+				tcon->share_path.mnt, rel,
+				LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &parent);
+		*last++ = '/';
+		if (err)
+			return smb_kern_path(name, flags, path, true);
+	} else {
+		last = rel;
+		parent = tcon->share_path;
+		path_get(&parent);
+	}
+
+	err = smb_search_dir_at(&parent, last, strlen(last));
+	if (!err)
+		err = vfs_path_lookup(parent.dentry, parent.mnt, last, flags,
+				path);
+	path_put(&parent);
+	return err;
 }
 
 /**
@@ -25,6 +25,8 @@
 #include <linux/file.h>
 #include <linux/fdtable.h>
 #include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/idr.h>
 
 #include "glob.h"
 #include "netlink.h"
@@ -35,17 +37,19 @@
 #define	FILE_GENERIC_WRITE	0x120116
 #define	FILE_GENERIC_EXECUTE	0X1200a0
 
-/* Max id limit is 0xFFFF, so create bitmap with only this size*/
-#define CIFSD_BITMAP_SIZE        0xFFFF
+/* fids are allocated below CIFSD_MAX_FID, 0xFFFF is the invalid fid */
+#define CIFSD_MAX_FID		 0xFFFF
+/* SMB2 fid tables are only bounded by the 31 bit idr index */
+#define CIFSD_MAX_FID_SMB2	 INT_MAX
 #define CIFSD_START_FID		 1
 
-#define cifsd_set_bit			__set_bit_le
-#define cifsd_test_and_set_bit	__test_and_set_bit_le
-#define cifsd_test_bit		test_bit_le
-#define cifsd_clear_bit		__clear_bit_le
-#define cifsd_test_and_clear_bit	__test_and_clear_bit_le
-#define cifsd_find_next_zero_bit	find_next_zero_bit_le
-#define cifsd_find_next_bit		find_next_bit_le
+/*
+ * SMB2 volatile ids are 64 bit: the fid table index in the low 32 bits
+ * and a generation in the high 32 bits, so that a stale handle does not
+ * match a later open that reused its index.
+ */
+#define CIFSD_FID_GEN_SHIFT	 32
+#define CIFSD_FID_INDEX(id)	 ((unsigned int)((id) & 0xFFFFFFFF))
 
 #define GET_FILENAME_FILP(file)	file->filp->f_path.dentry->d_name.name
 #define GET_FP_INODE(file)	file->filp->f_path.dentry->d_inode
@@ -59,11 +63,67 @@ struct smb_readdir_data {
 	struct dir_context ctx;
 #endif
 	char           *dirent;
+	unsigned int   size;
 	unsigned int   used;
 	unsigned int   full;
 	unsigned int   dirent_count;
+	/* listing of a share root, leave out the sidecar stream store */
+	bool           hide_stream_dir;
+};
+
+/* search pattern of a directory handle, compiled by smb_srch_compile() */
+enum {
+	CIFSD_SRCH_ALL,		/* "*" */
+	CIFSD_SRCH_EXACT,	/* no wildcards */
+	CIFSD_SRCH_PREFIX,	/* literal followed by a single trailing '*' */
+	CIFSD_SRCH_SUFFIX,	/* single leading '*' followed by a literal */
+	CIFSD_SRCH_WILD,	/* anything else, including the DOS wildcards */
+};
+
+struct cifsd_srch_pattern {
+	int		type;
+	/* length of the literal part, or of the whole pattern for WILD */
+	int		len;
+	/* literal part, or the whole pattern for WILD */
+	char		pat[];
+};
+
+/* fixed part of the largest directory information class record */
+#define CIFSD_SNAP_REC_MAX	104
+
+/*
+ * attributes of a snapshot entry, kept as the fixed part of the last
+ * information class record encoded for it; valid while the child inode
+ * number, generation, ctime and atime are the sampled ones
+ */
+struct cifsd_snap_attr {
+	unsigned long	i_ino;
+	__u32		generation;
+	struct timespec	ctime;
+	struct timespec	atime;
+	int		info_level;	/* 0 if no record is cached */
+	__u8		rec[CIFSD_SNAP_REC_MAX];
+};
+
+/*
+ * entry of a shared directory snapshot: the name, nul terminated, then
+ * its UTF-16 encoding starting at the next 2 byte boundary
+ */
+struct cifsd_snap_ent {
+	__u64		ino;
+	__u16		namelen;
+	__u16		uni_len;	/* bytes, without the terminator */
+	__u8		d_type;
+	struct cifsd_snap_attr attr;	/* under the snapshot attr_lock */
+	char		name[];
 };
 
+#define SNAP_ENT_UNI(ent)	\
+	((__le16 *)((ent)->name + ALIGN((ent)->namelen + 1, 2)))
+
+struct cifsd_dir_snap;
+struct cifsd_notify_handle;
+
 struct smb_dirent {
 	__le64         ino;
 	__le64          offset;
@@ -72,15 +132,19 @@ struct smb_dirent {
 	char            name[];
 };
 
+/* SMB2 change notify request parked on a notify handle */
 struct notification {
-	unsigned int mode;
 	struct list_head queuelist;
 	struct smb_work *work;
+	struct cifsd_notify_handle *nh;	/* NULL once the handle is closed */
 };
 
 struct cifsd_lock {
 	struct file_lock *fl;
-	struct list_head glist;
+	/* per-inode lock index, see cifsd_lock_index_add() */
+	struct rb_node rb;
+	loff_t __subtree_last;
+	struct cifsd_lock_tree *tree;
 	struct list_head llist;
 	struct list_head flist;
 	unsigned int flags;
@@ -88,9 +152,24 @@ struct cifsd_lock {
 	int zero_len;
 	loff_t start;
 	loff_t end;
+	/* set while the lock is waiting to be granted */
 	struct smb_work *work;
 };
 
+/* interval tree of the SMB byte-range locks held or waited on an inode */
+struct cifsd_lock_tree {
+	struct hlist_node node;
+	struct inode *inode;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	struct rb_root_cached root;
+#else
+	struct rb_root root;
+#endif
+	spinlock_t lock;
+	unsigned int count;
+	struct rcu_head rcu;
+};
+
 struct cifsd_file {
 	struct file *filp;
 	/* Will be used for in case of symlink */
@@ -100,6 +179,14 @@ struct cifsd_file {
 	/* if ls is happening on directory, below is valid*/
 	struct smb_readdir_data	readdir_data;
 	int		dirent_offset;
+	struct cifsd_srch_pattern *srch_pattern;
+	/* an exact name search was answered by a direct lookup */
+	bool		srch_done;
+	/* shared listing the handle enumerates instead of its filp */
+	struct cifsd_dir_snap *dir_snap;
+	unsigned int	snap_pos;
+	/* name and UTF-16 scratch of the enumeration, see smb_srch_scratch() */
+	char		*srch_scratch;
 	/* oplock info */
 	struct ofile_info *ofile;
 	bool delete_on_close;
@@ -108,6 +195,8 @@ struct cifsd_file {
 	bool lease_granted;
 	char LeaseKey[16];
 	bool is_durable;
+	/* filp closed by its owner or handed over to a durable reopen */
+	bool handed_over;
 	uint64_t persistent_id;
 	uint64_t sess_id;
 	uint32_t tid;
@@ -121,16 +210,34 @@ struct cifsd_file {
 	bool is_stream;
 	char *stream_name;
 	ssize_t ssize;
+	/* sidecar file backing a named stream on "streams in files" shares */
+	struct file *stream_filp;
+	struct path stream_root;
+	/* drop-behind state for streaming readers */
+	unsigned int drop_behind;
+	loff_t seq_start;
+	loff_t seq_next;
+	loff_t drop_pos;
+	/* write-behind state, charged to the budgets of sess and share */
+	struct cifsd_share *share;
+	spinlock_t wb_lock;
+	loff_t wb_start;
+	loff_t wb_next;
 	struct hlist_node node;
-	struct hlist_node notify_node;
-	struct list_head queue;
+	/* change notify state, see cifsd_notify_attach() */
+	struct cifsd_notify_handle *notify;
 	struct list_head lock_list;
+	/* fid table linkage, see get_id_from_fidtable() */
+	struct cifsd_sess *sess;
+	uint64_t volatile_id;
+	atomic_t refcount;
+	struct rcu_head rcu;
 };
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 struct cifsd_durable_state {
 	struct cifsd_sess *sess;
-	int volatile_id;
+	uint64_t volatile_id;
 	struct kstat stat;
 	int refcount;
 };
@@ -163,44 +270,54 @@ struct cifsd_pipe {
 	char *rsp_buf;
 };
 
-#define CIFSD_NR_OPEN_DEFAULT BITS_PER_LONG
-
-/* fidtable structure */
-struct fidtable {
-	unsigned int max_fids;
-	void **fileid;
-	unsigned int start_pos;
-	unsigned long *cifsd_bitmap;
-};
-
+/*
+ * fid table: lookups are lockless under RCU, the lock serializes
+ * allocation and removal of fids.
+ */
 struct fidtable_desc {
 	spinlock_t fidtable_lock;
-	struct fidtable *ftab;
+	struct idr idr;
+	unsigned int max_id;
+	/* tag fids with a generation, see CIFSD_FID_GEN_SHIFT */
+	bool use_gen;
+	unsigned int gen;
 };
 
-int init_fidtable(struct fidtable_desc *ftab_desc);
+int init_fidtable(struct fidtable_desc *ftab_desc, unsigned int max_id,
+		bool use_gen);
 void close_opens_from_fibtable(struct cifsd_sess *sess, uint32_t tree_id);
 void destroy_fidtable(struct cifsd_sess *sess);
-void free_fidtable(struct fidtable *ftab);
 struct cifsd_file *
 get_id_from_fidtable(struct cifsd_sess *sess, uint64_t id);
+void cifsd_fp_put(struct cifsd_file *fp);
 int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id);
+
+/* byte-range lock index */
+int cifsd_lock_index_add(struct cifsd_lock *lock);
+void cifsd_lock_index_del(struct cifsd_lock *lock);
+struct cifsd_lock_tree *cifsd_lock_tree_get(struct inode *inode);
+void cifsd_lock_tree_put(struct cifsd_lock_tree *tree);
+struct cifsd_lock *cifsd_lock_first(struct cifsd_lock_tree *tree,
+		loff_t start, loff_t end);
+struct cifsd_lock *cifsd_lock_next(struct cifsd_lock *lock,
+		loff_t start, loff_t end);
 bool is_dir_empty(struct cifsd_file *fp);
 unsigned int get_pipe_type(char *pipename);
 int cifsd_get_unused_id(struct fidtable_desc *ftab_desc);
-int cifsd_close_id(struct fidtable_desc *ftab_desc, int id);
+int cifsd_close_id(struct fidtable_desc *ftab_desc, uint64_t id);
 struct cifsd_file *
 insert_id_in_fidtable(struct cifsd_sess *sess, uint64_t sess_id,
 		uint32_t tree_id, unsigned int id, struct file *filp);
-void delete_id_from_fidtable(struct cifsd_sess *sess,
-		unsigned int id);
+void delete_id_from_fidtable(struct cifsd_sess *sess, uint64_t id);
+int cifsd_fp_handover(struct cifsd_sess *sess, struct cifsd_file *fp);
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 /* Persistent-ID operations */
 int cifsd_insert_in_global_table(struct cifsd_sess *sess,
-				   int volatile_id, struct file *filp,
+				   uint64_t volatile_id, struct file *filp,
 				   int durable_open);
 int close_persistent_id(uint64_t id);
+int init_global_fidtable(void);
 void destroy_global_fidtable(void);
 
 /* Durable handle functions */
@@ -209,7 +326,7 @@ struct cifsd_durable_state *
 void
 cifsd_update_durable_state(struct cifsd_sess *sess,
 				unsigned int persistent_id,
-				unsigned int volatile_id,
+				uint64_t volatile_id,
 				struct file *filp);
 
 int cifsd_delete_durable_state(uint64_t persistent_id);
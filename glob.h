@@ -82,14 +82,12 @@ extern bool durable_enable;
 extern bool multi_channel_enable;
 extern unsigned int alloc_roundup_size;
 extern unsigned long server_start_time;
-extern struct fidtable_desc global_fidtable;
 extern char *netbios_name;
 extern char NEGOTIATE_GSS_HEADER[74];
 
 extern bool global_signing;
 
 extern struct hlist_head global_name_table[1024];
-extern struct list_head global_lock_list;
 
 /* cifsd's Specific ERRNO */
 #define ESHARE 50000
@@ -224,6 +222,23 @@ extern struct list_head global_lock_list;
 #define XATTR_NAME_STREAM	(XATTR_USER_PREFIX STREAM_PREFIX)
 #define XATTR_NAME_STREAM_LEN	(sizeof(XATTR_NAME_STREAM) - 1)
 
+/* hidden directory under the share root holding sidecar stream files */
+#define CIFSD_STREAM_DIR	".cifsd-streams"
+#define CIFSD_STREAM_DIR_LEN	(sizeof(CIFSD_STREAM_DIR) - 1)
+
+/* maximum number of components in a share relative lookup */
+#define CIFSD_MAX_LOOKUP_DEPTH	256
+
+/*
+ * per search handle scratch area: an entry name, nul terminated, then
+ * room for its UTF-16 encoding
+ */
+#define CIFSD_SRCH_SCRATCH_SIZE	((NAME_MAX + 1) * 3)
+#define SRCH_SCRATCH_UNI(s)	((s) + NAME_MAX + 1)
+
+/* upper bound of a search handle's readdir staging buffer */
+#define CIFSD_READDIR_BUF_MAX	(256 * 1024)
+
 /* MAXIMUM KMEM DATA SIZE ORDER */
 #define PAGE_ALLOC_KMEM_ORDER	2
 
@@ -351,6 +366,8 @@ struct tcp_server_info {
 	struct list_head trans_list;
 	/* How many request are running currently */
 	atomic_t req_running;
+	/* requests handed over to the I/O workqueue, not in req_running */
+	atomic_t async_io_running;
 	/* References which are made for this Server object*/
 	atomic_t r_count;
 	wait_queue_head_t req_running_q;
@@ -406,8 +423,8 @@ struct async_info {
 	__u64 async_id;	/* Async ID */
 	struct	work_struct async_work;
 	enum asyncEnum async_status;
-	int fd;
-	int wd;
+	struct cifsd_lock *blocked_lock;	/* parked SMB2 blocking lock */
+	struct notification *notify;	/* parked SMB2 change notify */
 };
 
 #define SYNC 1
@@ -447,13 +464,25 @@ struct smb_work {
 	bool multiEnd:1;		/* both received */
 	bool send_no_response:1;	/* no response for cancelled request */
 	bool added_in_request_list:1;	/* added in server->requests list */
+	bool async_io:1;		/* response completed by I/O worker */
 
 	struct cifsd_sess *sess;
 	struct cifsd_tcon *tcon;
 
 	struct async_info *async;
+	/*
+	 * Blocking part of a deferred request, runs on cifsd I/O workqueue.
+	 * Returns -EINPROGRESS if the request was parked again.
+	 */
+	int (*async_io_fn)(struct smb_work *smb_work);
+	/* the deferred part is queued once this drops to zero */
+	atomic_t async_io_hold;
+	unsigned long async_flags;
 };
 
+/* smb_work->async_flags */
+#define SMB_WORK_KICKED		0	/* wake-up event already consumed */
+
 struct smb_version_ops {
 	int (*get_cmd_val)(struct smb_work *swork);
 	int (*init_rsp_hdr)(struct smb_work *swork);
@@ -556,6 +585,7 @@ extern int cifsd_stop_tcp_sess(void);
 /* cifsd misc functions */
 extern int check_smb_message(char *buf);
 extern void add_request_to_queue(struct smb_work *smb_work);
+extern int setup_async_work(struct smb_work *smb_work);
 extern void dump_smb_msg(void *buf, int smb_buf_length);
 extern int switch_rsp_buf(struct smb_work *smb_work);
 extern int smb2_get_shortname(struct tcp_server_info *server, char *longname,
@@ -564,9 +594,25 @@ extern void ntstatus_to_dos(__u32 ntstatus, __u8 *eclass, __u16 *ecode);
 extern struct cifsd_sess *validate_sess_handle(struct cifsd_sess *session);
 extern int smb_store_cont_xattr(struct path *path, char *prefix, void *value,
 	ssize_t v_len);
+extern void smb_xattr_index_invalidate(struct inode *inode);
+extern void smb_inode_meta_invalidate(struct inode *inode);
+extern void smb_inode_meta_stats(unsigned long *hits, unsigned long *misses);
+extern int smb_inode_meta_create_time(struct path *path, __u64 *create_time);
+extern int smb_inode_meta_store_create_time(struct path *path,
+	__u64 create_time);
+extern void smb_inode_meta_init_stream(struct path *path);
+extern void smb_init_inode_caches(void);
+extern void smb_free_inode_caches(void);
+extern __u64 smb_get_create_time(struct path *path, struct kstat *stat,
+	bool store_dos, bool created);
 extern ssize_t smb_find_cont_xattr(struct path *path, char *prefix, int p_len,
 	char **value, int flags);
 extern int get_pos_strnstr(const char *s1, const char *s2, size_t len);
+extern bool smb_is_stream_dir_name(const char *name, int len);
+extern bool smb_is_stream_dir_path(struct cifsd_tcon *tcon, const char *name);
+extern struct cifsd_srch_pattern *smb_srch_compile(const char *pattern);
+extern bool smb_srch_match(struct cifsd_srch_pattern *sp, const char *name,
+	int namelen);
 extern int smb_check_shared_mode(struct file *filp,
 	struct cifsd_file *curr_fp);
 extern struct cifsd_file *find_fp_in_hlist_using_inode(struct inode *inode);
@@ -588,12 +634,12 @@ int smb_vfs_fsync(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id);
 int smb_dentry_open(struct smb_work *work, const struct path *path,
 		int flags, __u16 *fid, int *oplock, int option,
 		int fexist);
-int smb_vfs_unlink(char *name);
+int smb_vfs_unlink(char *name, struct path *stream_root);
 int smb_vfs_link(const char *oldname, const char *newname);
 int smb_vfs_symlink(const char *name, const char *symname);
 int smb_vfs_readlink(struct path *path, char *buf, int len);
 int smb_vfs_rename(struct cifsd_sess *sess, char *oldname,
-		char *newname, uint64_t oldfid);
+		char *newname, uint64_t oldfid, struct path *stream_root);
 int smb_vfs_truncate(struct cifsd_sess *sess, const char *name,
 		uint64_t fid, loff_t size);
 ssize_t smb_vfs_listxattr(struct dentry *dentry, char **list, int size);
@@ -603,15 +649,58 @@ int smb_vfs_setxattr(const char *filename, struct path *path, const char *name,
 		const void *value, size_t size, int flags);
 int smb_kern_path(char *name, unsigned int flags, struct path *path,
 		bool caseless);
+int smb_share_kern_path(struct cifsd_tcon *tcon, char *name,
+		unsigned int flags, struct path *path, bool caseless);
 int smb_search_dir(char *dirname, char *filename);
+int smb_search_dir_at(struct path *dir_path, char *filename, int namelen);
+int smb_dir_lookup(struct file *dirp, char *name, bool caseless,
+		struct kstat *stat, bool store_dos, __u64 *create_time);
+char *smb_srch_scratch(struct cifsd_file *fp);
+void cifsd_name_index_init(void);
+void smb_dir_cache_invalidate(struct inode *dir);
+void cifsd_name_index_exit(void);
+struct cifsd_dir_snap *smb_dir_snap_get(struct file *dirp,
+		const struct nls_table *nls);
+struct cifsd_snap_ent *smb_dir_snap_next(struct cifsd_dir_snap *snap,
+		unsigned int *pos);
+bool smb_dir_snap_attr_sample(struct cifsd_snap_attr *sample,
+		struct inode *inode);
+bool smb_dir_snap_attr_get(struct cifsd_dir_snap *snap,
+		struct cifsd_snap_ent *ent, struct inode *inode,
+		int info_level, void *rec, int len);
+void smb_dir_snap_attr_set(struct cifsd_dir_snap *snap,
+		struct cifsd_snap_ent *ent, struct cifsd_snap_attr *sample,
+		int info_level, void *rec, int len);
+void smb_dir_snap_put(struct cifsd_dir_snap *snap);
+void cifsd_dir_snap_init(void);
+void cifsd_dir_snap_exit(void);
+bool smb_vfs_read_cached(struct cifsd_sess *sess, uint64_t fid,
+		loff_t pos, size_t count);
 void smb_vfs_set_fadvise(struct file *filp, int option);
+void smb_vfs_init_cache_mode(struct cifsd_file *fp,
+		struct cifsd_tcon *tcon);
+void smb_vfs_release_write_behind(struct cifsd_file *fp);
 int smb_vfs_lock(struct file *filp, int cmd, struct file_lock *flock);
 int check_lock_range(struct file *filp, loff_t start,
 		loff_t end, unsigned char type);
 int smb_vfs_readdir(struct file *file, filldir_t filler,
 			struct smb_readdir_data *buf);
+int smb_vfs_readdir_buf(struct smb_readdir_data *rdata, unsigned int size);
+void smb_vfs_readdir_buf_free(struct smb_readdir_data *rdata);
+struct dentry *smb_vfs_child_lookup(struct file *dirp, const char *name,
+		int namelen);
+int smb_vfs_child_stat(struct file *dirp, const char *name, int namelen,
+		struct kstat *stat, bool store_dos, __u64 *create_time);
 int smb_vfs_alloc_size(struct file *filp, loff_t len);
 int smb_vfs_truncate_xattr(struct dentry *dentry);
+int smb_vfs_birth_time(struct path *path, __u64 *create_time);
+struct file *smb_vfs_stream_open(struct path *root, struct inode *inode,
+		const char *stream, int flags, bool create, bool *created);
+struct file *smb_vfs_stream_dir_open(struct path *root, struct inode *inode);
+loff_t smb_vfs_stream_size(struct file *dirp, const char *name, int namelen);
+int smb_vfs_stream_unlink(struct path *root, struct inode *inode,
+		const char *stream);
+void smb_vfs_stream_purge(struct path *root, struct inode *inode);
 
 /* smb1ops functions */
 extern void init_smb1_server(struct tcp_server_info *server);
@@ -633,6 +722,9 @@ extern int cifsd_read_from_socket(struct tcp_server_info *server, char *buf,
 		unsigned int to_read);
 
 extern void handle_smb_work(struct work_struct *work);
+extern void smb_async_io_arm(struct smb_work *smb_work, int holds);
+extern bool smb_async_io_disarm(struct smb_work *smb_work);
+extern void smb_async_io_kick(struct smb_work *smb_work);
 extern int SMB_NTencrypt(unsigned char *, unsigned char *, unsigned char *,
 		const struct nls_table *);
 extern int smb_E_md4hash(const unsigned char *passwd, unsigned char *p16,
@@ -660,12 +752,14 @@ int smb_filldir(void *__buf, const char *name, int namlen,
 #endif
 int smb_get_shortname(struct tcp_server_info *server, char *longname,
 		char *shortname);
-char *read_next_entry(struct kstat *kstat, struct smb_dirent *de, char *dpath);
-void *fill_common_info(char **p, struct kstat *kstat);
+char *read_next_entry(struct kstat *kstat, struct smb_dirent *de,
+		struct file *dirp, char *namebuf, bool store_dos,
+		__u64 *create_time);
+void *fill_common_info(char **p, struct kstat *kstat, __u64 create_time);
 char *convname_updatenextoffset(char *namestr, int len, int size,
 		const struct nls_table *local_nls, int *name_len,
 		int *next_entry_offset, int *buf_len, int *data_count,
-		int alignment);
+		int alignment, char *enc_buf);
 
 /* netlink functions */
 int cifsd_net_init(void);
@@ -24,11 +24,13 @@
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 #include <linux/xattr.h>
 #endif
+#include <linux/hashtable.h>
 
 #include "glob.h"
 #include "export.h"
 #include "smb1pdu.h"
 #include "smb2pdu.h"
+#include "cache.h"
 
 /* Async ida to generate async id */
 DEFINE_IDA(async_ida);
@@ -194,6 +196,45 @@ void add_request_to_queue(struct smb_work *smb_work)
 	}
 }
 
+/**
+ * setup_async_work() - turn a queued request into an async request
+ * @smb_work:	smb request work
+ *
+ * Allocate an async id for a request that is going to complete after an
+ * interim response, and move it to the async request list so that it can
+ * be found by SMB2_CANCEL.
+ *
+ * Return:      0 on success, otherwise error
+ */
+int setup_async_work(struct smb_work *smb_work)
+{
+	struct tcp_server_info *server = smb_work->server;
+	struct async_info *async;
+	int id;
+
+	async = kzalloc(sizeof(struct async_info), GFP_KERNEL);
+	if (!async)
+		return -ENOMEM;
+
+	id = ida_simple_get(&async_ida, 1, 0, GFP_KERNEL);
+	if (id < 0) {
+		kfree(async);
+		return id;
+	}
+
+	async->async_id = (__u64)id;
+	async->async_status = ASYNC_WAITING;
+
+	spin_lock(&server->request_lock);
+	smb_work->async = async;
+	smb_work->type = ASYNC;
+	if (smb_work->added_in_request_list)
+		list_move_tail(&smb_work->request_entry,
+				&server->async_requests);
+	spin_unlock(&server->request_lock);
+	return 0;
+}
+
 /**
  * dump_smb_msg() - print smb packet for debugging
  * @buf:		smb packet
@@ -519,6 +560,397 @@ int is_smb2_rsp(struct smb_work *smb_work)
 };
 #endif
 
+/*
+ * Per-inode index of the "user." xattr names, used for case-insensitive
+ * stream and metadata xattr lookups so that they don't need a listxattr
+ * each time. An entry is valid as long as the inode ctime, which every
+ * setxattr/removexattr updates, did not change; cifsd also drops it
+ * explicitly on its own xattr updates.
+ */
+#define CIFSD_XATTR_INDEX_MAX	1024
+
+struct cifsd_xattr_index {
+	struct cifsd_icache_ent ent;
+	ssize_t len;
+	char names[];
+};
+
+static struct cifsd_icache xattr_index_cache;
+
+static void smb_xattr_index_free(struct cifsd_icache_ent *ent)
+{
+	kfree(container_of(ent, struct cifsd_xattr_index, ent));
+}
+
+/**
+ * smb_xattr_index_invalidate() - drop cached xattr names of an inode
+ * @inode:	inode whose xattrs are being changed
+ *
+ * The inode's cached SMB metadata is dropped as well, since it is read
+ * from the same xattrs.
+ */
+void smb_xattr_index_invalidate(struct inode *inode)
+{
+	cifsd_icache_invalidate(&xattr_index_cache, inode);
+	smb_inode_meta_invalidate(inode);
+}
+
+/**
+ * smb_xattr_index_build() - cache the "user." xattr names of an inode
+ * @dentry:	dentry of the file
+ *
+ * Return:      0 on success, otherwise error
+ */
+static int smb_xattr_index_build(struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct cifsd_xattr_index *xi;
+	struct cifsd_icache_ent ent;
+	char *name, *xattr_list = NULL;
+	ssize_t xattr_list_len, len = 0;
+	int err = 0;
+
+	/* sample before listing, a change during the listing makes it stale */
+	cifsd_icache_ent_init(&ent, inode);
+	xattr_list_len = smb_vfs_listxattr(dentry, &xattr_list,
+		XATTR_LIST_MAX);
+	if (xattr_list_len < 0) {
+		err = xattr_list_len;
+		goto out;
+	}
+
+	xi = kmalloc(sizeof(struct cifsd_xattr_index) + xattr_list_len,
+			GFP_KERNEL);
+	if (!xi) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (name = xattr_list; name - xattr_list < xattr_list_len;
+			name += strlen(name) + 1) {
+		if (strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN))
+			continue;
+		memcpy(&xi->names[len], name, strlen(name) + 1);
+		len += strlen(name) + 1;
+	}
+
+	xi->ent = ent;
+	xi->len = len;
+
+	cifsd_icache_lock(&xattr_index_cache);
+	__cifsd_icache_add(&xattr_index_cache, &xi->ent);
+	cifsd_icache_unlock(&xattr_index_cache);
+out:
+	if (xattr_list)
+		vfree(xattr_list);
+	return err;
+}
+
+/**
+ * smb_xattr_index_lookup() - case-insensitive xattr name lookup
+ * @inode:	inode of the file
+ * @prefix:	xattr name prefix to look for
+ * @p_len:	prefix length
+ * @name:	buffer of XATTR_NAME_MAX + 1 bytes for the real name
+ *
+ * Return:      0 if found, -ENOENT if not, -EAGAIN if not indexed
+ */
+static int smb_xattr_index_lookup(struct inode *inode, const char *prefix,
+		int p_len, char *name)
+{
+	struct cifsd_icache_ent *ent;
+	struct cifsd_xattr_index *xi;
+	char *n;
+	int err = -ENOENT;
+
+	cifsd_icache_lock(&xattr_index_cache);
+	ent = __cifsd_icache_find(&xattr_index_cache, inode);
+	if (!ent) {
+		cifsd_icache_unlock(&xattr_index_cache);
+		return -EAGAIN;
+	}
+
+	xi = container_of(ent, struct cifsd_xattr_index, ent);
+	for (n = xi->names; n - xi->names < xi->len; n += strlen(n) + 1) {
+		if (strncasecmp(n, prefix, p_len))
+			continue;
+		strlcpy(name, n, XATTR_NAME_MAX + 1);
+		err = 0;
+		break;
+	}
+	cifsd_icache_unlock(&xattr_index_cache);
+	return err;
+}
+
+/*
+ * Per-inode cache of SMB metadata kept in xattrs: the creation time and
+ * whether the default stream xattr exists. Like the name index it is
+ * tied to the inode ctime, so an xattr changed outside cifsd is seen,
+ * except when a data write follows it within the same clock tick. A
+ * write alone moves the ctime together with the mtime and keeps the
+ * entry, cifsd's own xattr updates drop it explicitly.
+ */
+#define CIFSD_INODE_META_MAX	1024
+
+struct cifsd_inode_meta {
+	struct cifsd_icache_ent ent;
+	bool ct_valid;		/* create_time xattr looked up */
+	bool ct_present;	/* ... and found */
+	__u64 create_time;
+	bool stream_present;	/* default stream xattr exists */
+};
+
+static struct cifsd_icache inode_meta_cache;
+static atomic_long_t inode_meta_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t inode_meta_misses = ATOMIC_LONG_INIT(0);
+
+static void smb_inode_meta_free(struct cifsd_icache_ent *ent)
+{
+	kfree(container_of(ent, struct cifsd_inode_meta, ent));
+}
+
+/**
+ * __inode_meta_get() - find or add the metadata entry of an inode
+ * @inode:	inode of the file
+ * @new:	entry sampled before the xattrs were read, consumed
+ *
+ * Called with the inode_meta_cache lock held.
+ *
+ * Return:	entry of @inode, NULL if it is not cached and @new is NULL
+ */
+static struct cifsd_inode_meta *__inode_meta_get(struct inode *inode,
+		struct cifsd_inode_meta *new)
+{
+	struct cifsd_icache_ent *ent;
+
+	if (!new) {
+		ent = __cifsd_icache_find(&inode_meta_cache, inode);
+		return ent ? container_of(ent, struct cifsd_inode_meta, ent) :
+			NULL;
+	}
+
+	ent = __cifsd_icache_add(&inode_meta_cache, &new->ent);
+	return container_of(ent, struct cifsd_inode_meta, ent);
+}
+
+/**
+ * smb_inode_meta_alloc() - allocate a metadata entry and sample the inode
+ * @inode:	inode of the file
+ * @own:	sampled right after our own xattr update
+ *
+ * The ctime our own update just set is in the current tick, but it is
+ * the one the cached value goes with, so such a sample is hashed anyway.
+ *
+ * Return:	new entry, or NULL
+ */
+static struct cifsd_inode_meta *smb_inode_meta_alloc(struct inode *inode,
+		bool own)
+{
+	struct cifsd_inode_meta *im;
+
+	im = kzalloc(sizeof(struct cifsd_inode_meta), GFP_KERNEL);
+	if (!im)
+		return NULL;
+
+	cifsd_icache_ent_init(&im->ent, inode);
+	if (own)
+		im->ent.unsettled &= ~CIFSD_ICACHE_CTIME;
+	return im;
+}
+
+/**
+ * smb_inode_meta_invalidate() - drop cached SMB metadata of an inode
+ * @inode:	inode whose metadata is being changed
+ */
+void smb_inode_meta_invalidate(struct inode *inode)
+{
+	cifsd_icache_invalidate(&inode_meta_cache, inode);
+}
+
+/**
+ * smb_inode_meta_stats() - lookups served by the metadata cache
+ * @hits:	set to the lookups answered from the cache
+ * @misses:	set to the lookups that read the xattrs
+ */
+void smb_inode_meta_stats(unsigned long *hits, unsigned long *misses)
+{
+	*hits = atomic_long_read(&inode_meta_hits);
+	*misses = atomic_long_read(&inode_meta_misses);
+}
+
+/**
+ * smb_inode_meta_create_time() - get the stored creation time of a file
+ * @path:	path of the file
+ * @create_time:	creation time in NT format, set on success
+ *
+ * Return:	0 on success, -ENOENT if no creation time is stored
+ */
+int smb_inode_meta_create_time(struct path *path, __u64 *create_time)
+{
+	struct inode *inode = path->dentry->d_inode;
+	struct cifsd_inode_meta *im, *new;
+	char *value = NULL;
+	ssize_t len;
+	int err = -ENOENT;
+
+	cifsd_icache_lock(&inode_meta_cache);
+	im = __inode_meta_get(inode, NULL);
+	if (im && im->ct_valid) {
+		if (im->ct_present) {
+			*create_time = im->create_time;
+			err = 0;
+		}
+		cifsd_icache_unlock(&inode_meta_cache);
+		atomic_long_inc(&inode_meta_hits);
+		return err;
+	}
+	cifsd_icache_unlock(&inode_meta_cache);
+	atomic_long_inc(&inode_meta_misses);
+
+	new = smb_inode_meta_alloc(inode, false);
+	len = smb_find_cont_xattr(path, XATTR_NAME_CREATION_TIME,
+			XATTR_NAME_CREATION_TIME_LEN, &value, 1);
+	if (len == CREATIOM_TIME_LEN) {
+		memcpy(create_time, value, CREATIOM_TIME_LEN);
+		err = 0;
+	}
+	kvfree(value);
+
+	cifsd_icache_lock(&inode_meta_cache);
+	im = __inode_meta_get(inode, new);
+	if (im) {
+		im->ct_valid = true;
+		im->ct_present = !err;
+		im->create_time = err ? 0 : *create_time;
+	}
+	cifsd_icache_unlock(&inode_meta_cache);
+	return err;
+}
+
+/**
+ * smb_inode_meta_store_create_time() - store the creation time of a file
+ * @path:	path of the file
+ * @create_time:	creation time in NT format
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_inode_meta_store_create_time(struct path *path, __u64 create_time)
+{
+	struct inode *inode = path->dentry->d_inode;
+	struct cifsd_inode_meta *im;
+	int err;
+
+	err = smb_store_cont_xattr(path, XATTR_NAME_CREATION_TIME,
+			(void *)&create_time, CREATIOM_TIME_LEN);
+	if (err)
+		return err;
+
+	/* the xattr update above dropped the entry and bumped the ctime */
+	cifsd_icache_lock(&inode_meta_cache);
+	im = __inode_meta_get(inode, smb_inode_meta_alloc(inode, true));
+	if (im) {
+		im->ct_valid = true;
+		im->ct_present = true;
+		im->create_time = create_time;
+	}
+	cifsd_icache_unlock(&inode_meta_cache);
+	return 0;
+}
+
+/**
+ * smb_inode_meta_init_stream() - make sure the default stream xattr exists
+ * @path:	path of the file
+ */
+void smb_inode_meta_init_stream(struct path *path)
+{
+	struct inode *inode = path->dentry->d_inode;
+	struct cifsd_inode_meta *im, *new;
+
+	cifsd_icache_lock(&inode_meta_cache);
+	im = __inode_meta_get(inode, NULL);
+	if (im && im->stream_present) {
+		cifsd_icache_unlock(&inode_meta_cache);
+		atomic_long_inc(&inode_meta_hits);
+		return;
+	}
+	cifsd_icache_unlock(&inode_meta_cache);
+	atomic_long_inc(&inode_meta_misses);
+
+	new = smb_inode_meta_alloc(inode, false);
+	if (smb_vfs_getxattr(path->dentry, XATTR_NAME_STREAM, NULL, 0) < 0) {
+		kfree(new);
+		if (smb_store_cont_xattr(path, XATTR_NAME_STREAM, NULL, 0) < 0)
+			return;
+		/* our own update, sample again */
+		new = smb_inode_meta_alloc(inode, true);
+	}
+
+	cifsd_icache_lock(&inode_meta_cache);
+	im = __inode_meta_get(inode, new);
+	if (im)
+		im->stream_present = true;
+	cifsd_icache_unlock(&inode_meta_cache);
+}
+
+/**
+ * smb_get_create_time() - creation time provider
+ * @path:	path of the file
+ * @stat:	stat of the file
+ * @store_dos:	the share keeps creation times in xattrs
+ * @created:	the file was just created
+ *
+ * A creation time a client set, kept in the xattr, wins over the birth
+ * time the filesystem tracks, and the ctime is the last resort. A new
+ * file only gets the xattr when there is no birth time.
+ *
+ * Return:	creation time in NT format
+ */
+__u64 smb_get_create_time(struct path *path, struct kstat *stat,
+		bool store_dos, bool created)
+{
+	__u64 create_time;
+
+	if (created) {
+		if (!smb_vfs_birth_time(path, &create_time))
+			return create_time;
+
+		create_time = cifs_UnixTimeToNT(stat->ctime);
+		if (store_dos &&
+			smb_inode_meta_store_create_time(path, create_time))
+			cifsd_debug("failed to store creation time in EA\n");
+		return create_time;
+	}
+
+	if (store_dos && !smb_inode_meta_create_time(path, &create_time))
+		return create_time;
+
+	if (!smb_vfs_birth_time(path, &create_time))
+		return create_time;
+
+	return cifs_UnixTimeToNT(stat->ctime);
+}
+
+/**
+ * smb_init_inode_caches() - set up the xattr name index and metadata cache
+ */
+void smb_init_inode_caches(void)
+{
+	cifsd_icache_init(&xattr_index_cache, CIFSD_ICACHE_CTIME,
+			CIFSD_XATTR_INDEX_MAX, 0, smb_xattr_index_free);
+	cifsd_icache_init(&inode_meta_cache,
+			CIFSD_ICACHE_CTIME | CIFSD_ICACHE_WRITES,
+			CIFSD_INODE_META_MAX, 0, smb_inode_meta_free);
+}
+
+/**
+ * smb_free_inode_caches() - free the xattr name index and metadata cache
+ */
+void smb_free_inode_caches(void)
+{
+	cifsd_icache_exit(&xattr_index_cache);
+	cifsd_icache_exit(&inode_meta_cache);
+}
+
 int smb_store_cont_xattr(struct path *path, char *prefix, void *value,
 	ssize_t v_len)
 {
@@ -531,49 +963,57 @@ int smb_store_cont_xattr(struct path *path, char *prefix, void *value,
 	return err;
 }
 
+/**
+ * smb_find_cont_xattr() - find an xattr by case-insensitive name prefix
+ * @path:	path of the file
+ * @prefix:	xattr name (prefix) to look for
+ * @p_len:	prefix length
+ * @value:	if @flags is set, allocated buffer with the xattr value
+ * @flags:	read the value as well
+ *
+ * The exact name is tried first with a direct getxattr, which hits in the
+ * common case where the client uses the same case as at creation. Only on
+ * a miss the per-inode name index is consulted.
+ *
+ * Return:      xattr value length on success, otherwise error
+ */
 ssize_t smb_find_cont_xattr(struct path *path, char *prefix, int p_len,
 	char **value, int flags)
 {
-	char *name, *xattr_list = NULL, *tmp_a = NULL, *tmp_b = NULL;
-	ssize_t value_len = -ENOENT, xattr_list_len;
-
-	xattr_list_len = smb_vfs_listxattr(path->dentry, &xattr_list,
-		XATTR_LIST_MAX);
-	if (xattr_list_len < 0) {
-		goto out;
-	} else if (!xattr_list_len) {
-		cifsd_debug("empty xattr in the file\n");
-		goto out;
-	}
+	struct inode *inode = path->dentry->d_inode;
+	char *name;
+	ssize_t value_len;
+	int err;
 
-	tmp_a = kmalloc(p_len, GFP_KERNEL);
-	tmp_b = kmalloc(p_len, GFP_KERNEL);
-	if (!tmp_a || !tmp_b) {
-		xattr_list_len = -ENOMEM;
-		goto out;
+	if (!prefix[p_len]) {
+		value_len = smb_vfs_getxattr(path->dentry, prefix, value,
+				flags);
+		if (value_len >= 0)
+			return value_len;
 	}
 
-	memcpy(tmp_a, prefix, p_len);
-
-	for (name = xattr_list; name - xattr_list < xattr_list_len;
-			name += strlen(name) + 1) {
-		cifsd_debug("%s, len %zd\n", name, strlen(name));
-		memcpy(tmp_b, name, p_len);
+	name = kmalloc(XATTR_NAME_MAX + 1, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
 
-		if (strncasecmp(tmp_a, tmp_b, p_len))
-			continue;
+	err = smb_xattr_index_lookup(inode, prefix, p_len, name);
+	if (err == -EAGAIN) {
+		err = smb_xattr_index_build(path->dentry);
+		if (!err)
+			err = smb_xattr_index_lookup(inode, prefix, p_len,
+					name);
+	}
 
-		value_len = smb_vfs_getxattr(path->dentry, name, value, flags);
-		if (value_len < 0)
-			cifsd_err("failed to get xattr in file\n");
-		break;
+	if (err) {
+		value_len = -ENOENT;
+		goto out;
 	}
 
+	value_len = smb_vfs_getxattr(path->dentry, name, value, flags);
+	if (value_len < 0)
+		cifsd_err("failed to get xattr in file\n");
 out:
-	if (xattr_list)
-		vfree(xattr_list);
-	kfree(tmp_a);
-	kfree(tmp_b);
+	kfree(name);
 	return value_len;
 }
 
@@ -596,6 +1036,227 @@ int get_pos_strnstr(const char *s1, const char *s2, size_t len)
 	return 0;
 }
 
+/**
+ * smb_is_stream_dir_name() - check if a name is the sidecar stream store
+ * @name:	directory entry name
+ * @len:	length of @name
+ *
+ * Compared caselessly, a caseless lookup reaches the store in any case.
+ *
+ * Return:	true if @name is the hidden stream directory
+ */
+bool smb_is_stream_dir_name(const char *name, int len)
+{
+	return len == CIFSD_STREAM_DIR_LEN &&
+		!strncasecmp(name, CIFSD_STREAM_DIR, len);
+}
+
+/**
+ * smb_is_stream_dir_path() - check if a path names the sidecar stream store
+ * @tcon:	tree connection the name was built for
+ * @name:	absolute path name
+ *
+ * The store only exists at the share root.
+ *
+ * Return:	true if @name is the hidden stream directory or below it
+ */
+bool smb_is_stream_dir_path(struct cifsd_tcon *tcon, const char *name)
+{
+	const char *root = tcon->share->path;
+	size_t len = strlen(root);
+	const char *end;
+
+	while (len > 1 && root[len - 1] == '/')
+		len--;
+	if (strncmp(name, root, len) || name[len] != '/')
+		return false;
+
+	name += len;
+	while (*name == '/')
+		name++;
+	end = strchrnul(name, '/');
+	return smb_is_stream_dir_name(name, end - name);
+}
+
+#define SRCH_DOS_STAR	'<'
+#define SRCH_DOS_QM	'>'
+#define SRCH_DOS_DOT	'"'
+
+static bool is_srch_wild(char c)
+{
+	return c == '*' || c == '?' || c == SRCH_DOS_STAR ||
+		c == SRCH_DOS_QM || c == SRCH_DOS_DOT;
+}
+
+/**
+ * smb_srch_compile() - compile a query directory search pattern
+ * @pattern:	search pattern from the client
+ *
+ * Patterns made of a literal and at most one leading or trailing '*' are
+ * reduced to a plain compare, everything else is kept for smb_srch_match().
+ * An empty pattern matches every name.
+ *
+ * Return:	compiled pattern on success, otherwise NULL
+ */
+struct cifsd_srch_pattern *smb_srch_compile(const char *pattern)
+{
+	struct cifsd_srch_pattern *sp;
+	int len = strlen(pattern), nwild = 0, i;
+	const char *lit = pattern;
+
+	for (i = 0; i < len; i++)
+		if (is_srch_wild(pattern[i]))
+			nwild++;
+
+	sp = kmalloc(sizeof(*sp) + len + 1, GFP_KERNEL);
+	if (!sp)
+		return NULL;
+
+	if (!len || (len == 1 && pattern[0] == '*')) {
+		sp->type = CIFSD_SRCH_ALL;
+		len = 0;
+	} else if (!nwild) {
+		sp->type = CIFSD_SRCH_EXACT;
+	} else if (nwild == 1 && pattern[len - 1] == '*') {
+		sp->type = CIFSD_SRCH_PREFIX;
+		len--;
+	} else if (nwild == 1 && pattern[0] == '*') {
+		sp->type = CIFSD_SRCH_SUFFIX;
+		lit++;
+		len--;
+	} else {
+		sp->type = CIFSD_SRCH_WILD;
+	}
+
+	memcpy(sp->pat, lit, len);
+	sp->pat[len] = '\0';
+	sp->len = len;
+	return sp;
+}
+
+/*
+ * Match @name against a WILD pattern with the FsRtlIsNameInExpression()
+ * rules. Each bit of @cur marks a name prefix the pattern consumed so far
+ * can match, so the cost is bounded by pattern length times name length.
+ */
+static bool smb_srch_match_wild(struct cifsd_srch_pattern *sp,
+		const char *name, int namelen)
+{
+	DECLARE_BITMAP(cur, NAME_MAX + 1);
+	DECLARE_BITMAP(next, NAME_MAX + 1);
+	int i, j, lastdot = -1;
+
+	for (j = 0; j < namelen; j++)
+		if (name[j] == '.')
+			lastdot = j;
+
+	bitmap_zero(cur, NAME_MAX + 1);
+	__set_bit(0, cur);
+
+	for (i = 0; i < sp->len; i++) {
+		char c = sp->pat[i];
+		bool any = false;
+
+		bitmap_zero(next, NAME_MAX + 1);
+		for (j = 0; j <= namelen; j++) {
+			int k, end;
+
+			if (c == '*') {
+				/* any run of characters */
+				any |= test_bit(j, cur);
+				if (any)
+					__set_bit(j, next);
+				continue;
+			}
+
+			if (!test_bit(j, cur))
+				continue;
+
+			switch (c) {
+			case SRCH_DOS_STAR:
+				/* any run that does not pass the last dot */
+				end = j <= lastdot ? lastdot : namelen;
+				for (k = j; k <= end; k++)
+					__set_bit(k, next);
+				break;
+			case SRCH_DOS_QM:
+				/* one character, or nothing at a dot or the end */
+				if (j == namelen || name[j] == '.')
+					__set_bit(j, next);
+				else
+					__set_bit(j + 1, next);
+				break;
+			case SRCH_DOS_DOT:
+				/* a dot, or nothing at the end */
+				if (j == namelen)
+					__set_bit(j, next);
+				else if (name[j] == '.')
+					__set_bit(j + 1, next);
+				break;
+			case '?':
+				if (j < namelen)
+					__set_bit(j + 1, next);
+				break;
+			default:
+				if (j < namelen &&
+						tolower(name[j]) == tolower(c))
+					__set_bit(j + 1, next);
+				break;
+			}
+		}
+
+		bitmap_copy(cur, next, NAME_MAX + 1);
+		if (bitmap_empty(cur, NAME_MAX + 1))
+			return false;
+	}
+
+	return test_bit(namelen, cur);
+}
+
+/**
+ * smb_srch_match() - match a directory entry name against a search pattern
+ * @sp:		pattern compiled by smb_srch_compile()
+ * @name:	entry name, not necessarily nul terminated
+ * @namelen:	entry name length
+ *
+ * Matching is case insensitive and works on the raw dirent name, so it
+ * can run before the entry is looked up or stat'ed.
+ *
+ * Return:	true if @name matches @sp
+ */
+bool smb_srch_match(struct cifsd_srch_pattern *sp, const char *name,
+		int namelen)
+{
+	int i;
+
+	switch (sp->type) {
+	case CIFSD_SRCH_ALL:
+		return true;
+	case CIFSD_SRCH_EXACT:
+		if (namelen != sp->len)
+			return false;
+		break;
+	case CIFSD_SRCH_PREFIX:
+		if (namelen < sp->len)
+			return false;
+		break;
+	case CIFSD_SRCH_SUFFIX:
+		if (namelen < sp->len)
+			return false;
+		name += namelen - sp->len;
+		break;
+	default:
+		if (namelen > NAME_MAX)
+			return false;
+		return smb_srch_match_wild(sp, name, namelen);
+	}
+
+	for (i = 0; i < sp->len; i++)
+		if (tolower(name[i]) != tolower(sp->pat[i]))
+			return false;
+	return true;
+}
+
 int smb_check_shared_mode(struct file *filp, struct cifsd_file *curr_fp)
 {
 	int rc = 0;
@@ -0,0 +1,936 @@
+/*
+ *   fs/cifsd/notify.c
+ *
+ *   Copyright (C) 2015 Samsung Electronics Co., Ltd.
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/fsnotify_backend.h>
+
+#include "glob.h"
+#include "export.h"
+#include "smb2pdu.h"
+#include "notify.h"
+
+/*
+ * SMB2 change notify on top of a private fsnotify group.
+ *
+ * Every watched directory inode gets one fsnotify mark, shared by all open
+ * handles that issued CHANGE_NOTIFY on it. The event callback runs in the
+ * context of the task changing the directory: it appends the change to the
+ * buffer of each interested handle and kicks the oldest request parked on
+ * that handle, which then completes on the cifsd I/O workqueue. No thread
+ * sleeps on behalf of a pending request.
+ */
+struct cifsd_notify_watch {
+	struct fsnotify_mark mark;
+	/* directory inode, or mount or superblock of a tree watch */
+	void *object;
+	bool tree;
+	struct hlist_node hlist;
+	/* changed under notify_lock */
+	struct list_head handles;
+	/* union of the handle filters, a hint read without the lock */
+	unsigned int filter;
+	int refcount;			/* protected by notify_mutex */
+};
+
+/*
+ * SMB2_WATCH_TREE handles share one mark per filesystem. Superblock marks
+ * see every change; before they existed a mount mark is used, which only
+ * reports data modifications, so there a tree watch is only offered for
+ * size and last write changes.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define CIFSD_NOTIFY_TREE_SB
+#endif
+
+/* watched dentries collected in one batch of an ancestry walk */
+#define CIFSD_NOTIFY_TREE_BATCH		8
+
+static struct fsnotify_group *notify_group;
+static DEFINE_HASHTABLE(notify_table, 8);
+/* tree handles by watched dentry, changed under notify_lock, read under RCU */
+static DEFINE_HASHTABLE(notify_dentries, 8);
+/* watch table, marks and handle attachment */
+static DEFINE_MUTEX(notify_mutex);
+/* handle event buffers and parked requests */
+static DEFINE_SPINLOCK(notify_lock);
+/* marks not freed by fsnotify yet */
+static atomic_t notify_marks = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(notify_marks_wq);
+
+#define CIFSD_NOTIFY_NAME_EVENTS	(FS_CREATE | FS_DELETE | \
+					 FS_MOVED_FROM | FS_MOVED_TO)
+#define CIFSD_NOTIFY_ATTR_FILTER	(FILE_NOTIFY_CHANGE_ATTRIBUTES | \
+					 FILE_NOTIFY_CHANGE_LAST_WRITE | \
+					 FILE_NOTIFY_CHANGE_LAST_ACCESS | \
+					 FILE_NOTIFY_CHANGE_CREATION | \
+					 FILE_NOTIFY_CHANGE_EA | \
+					 FILE_NOTIFY_CHANGE_SECURITY)
+#define CIFSD_NOTIFY_SIZE_FILTER	(FILE_NOTIFY_CHANGE_SIZE | \
+					 FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+/**
+ * cifsd_notify_mask() - fsnotify events needed for a completion filter
+ * @filter:	FILE_NOTIFY_CHANGE_* flags of the request
+ *
+ * Return:	fsnotify mask for the directory mark
+ */
+static __u32 cifsd_notify_mask(unsigned int filter)
+{
+	__u32 mask = FS_EVENT_ON_CHILD;
+
+	if (filter & FILE_NOTIFY_CHANGE_NAME)
+		mask |= CIFSD_NOTIFY_NAME_EVENTS;
+	if (filter & CIFSD_NOTIFY_SIZE_FILTER)
+		mask |= FS_MODIFY;
+	if (filter & CIFSD_NOTIFY_ATTR_FILTER)
+		mask |= FS_ATTRIB;
+
+	return mask;
+}
+
+/**
+ * cifsd_notify_action() - translate an fsnotify event to a notify action
+ * @mask:	fsnotify event mask
+ * @filter:	set to the FILE_NOTIFY_CHANGE_* flags the event matches
+ *
+ * Return:	FILE_ACTION_* or 0 if the event is not reported
+ */
+static int cifsd_notify_action(__u32 mask, unsigned int *filter)
+{
+	unsigned int name_filter = mask & FS_ISDIR ?
+		FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME;
+
+	*filter = name_filter;
+	if (mask & FS_CREATE)
+		return FILE_ACTION_ADDED;
+	if (mask & FS_DELETE)
+		return FILE_ACTION_REMOVED;
+	if (mask & FS_MOVED_FROM)
+		return FILE_ACTION_RENAMED_OLD_NAME;
+	if (mask & FS_MOVED_TO)
+		return FILE_ACTION_RENAMED_NEW_NAME;
+
+	if (mask & FS_MODIFY) {
+		*filter = CIFSD_NOTIFY_SIZE_FILTER;
+		return FILE_ACTION_MODIFIED;
+	}
+	if (mask & FS_ATTRIB) {
+		*filter = CIFSD_NOTIFY_ATTR_FILTER;
+		return FILE_ACTION_MODIFIED;
+	}
+
+	return 0;
+}
+
+/**
+ * cifsd_notify_append() - add a change record to a handle buffer
+ * @nh:		notify handle
+ * @action:	FILE_ACTION_*
+ * @name:	name of the changed entry
+ * @len:	length of @name
+ *
+ * Repeated modifications of the same entry are coalesced into one record.
+ * If the buffer fills up, the records are dropped and the next request is
+ * answered with STATUS_NOTIFY_ENUM_DIR. Called with notify_lock held.
+ */
+static void cifsd_notify_append(struct cifsd_notify_handle *nh, int action,
+	const char *name, int len)
+{
+	struct FileNotifyInformation *info, *last;
+	unsigned int reclen;
+	int uni_len;
+
+	if (nh->overflow)
+		return;
+
+	/*
+	 * converted name is at most two bytes per source byte, plus the
+	 * UTF-16 terminator the conversion always writes
+	 */
+	reclen = ALIGN(sizeof(struct FileNotifyInformation) + (len + 1) * 2,
+			4);
+	if (nh->len + reclen > nh->size) {
+		nh->overflow = true;
+		nh->len = 0;
+		return;
+	}
+
+	info = (struct FileNotifyInformation *)(nh->buf + nh->len);
+	uni_len = smbConvertToUTF16((__le16 *)info->FileName, name, len,
+			nh->nls, 0) * 2;
+
+	last = (struct FileNotifyInformation *)(nh->buf + nh->last);
+	if (nh->len && action == FILE_ACTION_MODIFIED &&
+			le32_to_cpu(last->Action) == action &&
+			le32_to_cpu(last->FileNameLength) == uni_len &&
+			!memcmp(last->FileName, info->FileName, uni_len))
+		return;
+
+	reclen = ALIGN(sizeof(struct FileNotifyInformation) + uni_len, 4);
+	memset(info->FileName + uni_len, 0,
+		reclen - sizeof(struct FileNotifyInformation) - uni_len);
+	info->NextEntryOffset = 0;
+	info->Action = cpu_to_le32(action);
+	info->FileNameLength = cpu_to_le32(uni_len);
+	if (nh->len)
+		last->NextEntryOffset = cpu_to_le32(nh->len - nh->last);
+	nh->last = nh->len;
+	nh->len += reclen;
+}
+
+/**
+ * cifsd_notify_queue_change() - record a change and wake up a request
+ * @nh:		notify handle
+ * @action:	FILE_ACTION_*
+ * @name:	name of the changed entry, relative to the watched directory
+ * @len:	length of @name
+ *
+ * Called with notify_lock held.
+ */
+static void cifsd_notify_queue_change(struct cifsd_notify_handle *nh,
+	int action, const char *name, int len)
+{
+	struct notification *req;
+
+	cifsd_notify_append(nh, action, name, len);
+	req = list_first_entry_or_null(&nh->requests, struct notification,
+			queuelist);
+	if (req)
+		smb_async_io_kick(req->work);
+}
+
+/**
+ * cifsd_notify_dir_event() - deliver a change to directory watch handles
+ * @w:		directory watch
+ * @mask:	fsnotify event mask
+ * @name:	name of the changed entry, NULL for the directory itself
+ */
+static void cifsd_notify_dir_event(struct cifsd_notify_watch *w, __u32 mask,
+	const unsigned char *name)
+{
+	struct cifsd_notify_handle *nh;
+	unsigned int filter;
+	int action, len;
+
+	/* only changes of directory entries are reported */
+	if (!name)
+		return;
+
+	action = cifsd_notify_action(mask, &filter);
+	if (!action)
+		return;
+
+	len = strlen((const char *)name);
+
+	spin_lock(&notify_lock);
+	list_for_each_entry(nh, &w->handles, wlist) {
+		if (nh->filter & filter)
+			cifsd_notify_queue_change(nh, action,
+				(const char *)name, len);
+	}
+	spin_unlock(&notify_lock);
+}
+
+/**
+ * cifsd_notify_tree_watched() - is a dentry watched by a tree handle
+ * @w:		tree watch
+ * @dentry:	ancestor of the changed entry
+ * @filter:	FILE_NOTIFY_CHANGE_* flags the event matches
+ *
+ * Called under rcu_read_lock().
+ *
+ * Return:	true if a handle of @w watching @dentry wants the event
+ */
+static bool cifsd_notify_tree_watched(struct cifsd_notify_watch *w,
+	struct dentry *dentry, unsigned int filter)
+{
+	struct cifsd_notify_handle *nh;
+
+	hash_for_each_possible_rcu(notify_dentries, nh, dnode,
+			(unsigned long)dentry) {
+		if (nh->dentry == dentry && nh->tree == w &&
+				(nh->filter & filter))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * cifsd_notify_tree_queue() - queue a change on the handles of a dentry
+ * @w:		tree watch
+ * @dentry:	watched ancestor of the changed entry
+ * @filter:	FILE_NOTIFY_CHANGE_* flags the event matches
+ * @action:	FILE_ACTION_*
+ * @name:	backslash separated name relative to @dentry
+ *
+ * Called under rcu_read_lock().
+ */
+static void cifsd_notify_tree_queue(struct cifsd_notify_watch *w,
+	struct dentry *dentry, unsigned int filter, int action,
+	const char *name)
+{
+	struct cifsd_notify_handle *nh;
+	int len = strlen(name);
+
+	hash_for_each_possible_rcu(notify_dentries, nh, dnode,
+			(unsigned long)dentry) {
+		if (nh->dentry != dentry || nh->tree != w ||
+				!(nh->filter & filter))
+			continue;
+
+		spin_lock(&notify_lock);
+		cifsd_notify_queue_change(nh, action, name, len);
+		spin_unlock(&notify_lock);
+	}
+}
+
+/**
+ * cifsd_notify_tree_event() - deliver a change to WATCH_TREE handles
+ * @w:		tree watch
+ * @mask:	fsnotify event mask
+ * @dir:	inode the event was reported on
+ * @data:	fsnotify event data
+ * @data_type:	FSNOTIFY_EVENT_*
+ * @name:	name of the changed entry in @dir, NULL if @dir is the entry
+ *
+ * The mark covers the whole mount or filesystem. Every change on it comes
+ * through here, so events no handle asked for are dropped first. The
+ * dentry ancestry of the changed entry is then walked once under RCU,
+ * building the relative name on the way up, and each ancestor is looked
+ * up in the hash of watched dentries. Matches are queued in batches once
+ * the walk is known not to have raced with a rename.
+ */
+static void cifsd_notify_tree_event(struct cifsd_notify_watch *w,
+	__u32 mask, struct inode *dir, const void *data, int data_type,
+	const unsigned char *name)
+{
+	struct {
+		struct dentry *dentry;
+		char *name;
+	} match[CIFSD_NOTIFY_TREE_BATCH];
+	struct dentry *d, *start, *cur;
+	unsigned int filter, seq;
+	char *buf, *p, *q;
+	int action, len, n, i;
+	bool full;
+
+	/* the changed entry gets the same event itself */
+	if (mask & FS_EVENT_ON_CHILD)
+		return;
+
+	action = cifsd_notify_action(mask, &filter);
+	if (!action || !(w->filter & filter))
+		return;
+
+	if (name)
+		d = d_find_alias(dir);
+	else if (data_type == FSNOTIFY_EVENT_PATH)
+		d = dget(((const struct path *)data)->dentry);
+	else if (data_type == FSNOTIFY_EVENT_INODE)
+		d = d_find_alias((struct inode *)data);
+	else
+		return;
+	if (!d)
+		return;
+
+	buf = __getname();
+	if (!buf)
+		goto out;
+
+	/* @p is the name relative to @start, empty for the entry itself */
+	p = buf + PATH_MAX - 1;
+	*p = '\0';
+	if (name) {
+		len = strlen((const char *)name);
+		if (len >= PATH_MAX)
+			goto out_free;
+		p -= len;
+		memcpy(p, name, len);
+	}
+	start = d;
+
+	rcu_read_lock();
+	do {
+again:
+		seq = read_seqbegin(&rename_lock);
+		cur = start;
+		q = p;
+		n = 0;
+		full = false;
+		for (;;) {
+			if (*q && cifsd_notify_tree_watched(w, cur, filter)) {
+				if (n == CIFSD_NOTIFY_TREE_BATCH) {
+					full = true;
+					break;
+				}
+				match[n].dentry = cur;
+				match[n].name = q;
+				n++;
+			}
+
+			if (IS_ROOT(cur))
+				break;
+			len = cur->d_name.len;
+			if (len + 1 >= q - buf)
+				break;
+			if (*q)
+				*--q = '\\';
+			q -= len;
+			memcpy(q, cur->d_name.name, len);
+			cur = cur->d_parent;
+		}
+		if (read_seqretry(&rename_lock, seq))
+			goto again;
+
+		for (i = 0; i < n; i++)
+			cifsd_notify_tree_queue(w, match[i].dentry, filter,
+					action, match[i].name);
+
+		/* more watched ancestors, go on where the batch stopped */
+		start = cur;
+		p = q;
+	} while (full);
+	rcu_read_unlock();
+
+out_free:
+	__putname(buf);
+out:
+	dput(d);
+}
+
+/**
+ * cifsd_notify_event() - deliver an fsnotify event
+ * @mark:	our mark the event was reported on, may be NULL
+ * @mask:	fsnotify event mask
+ * @inode:	inode the event was reported on
+ * @data:	fsnotify event data
+ * @data_type:	FSNOTIFY_EVENT_*
+ * @name:	name of the changed entry, NULL for @inode itself
+ */
+static void cifsd_notify_event(struct fsnotify_mark *mark, __u32 mask,
+	struct inode *inode, const void *data, int data_type,
+	const unsigned char *name)
+{
+	struct cifsd_notify_watch *w;
+
+	if (!mark)
+		return;
+
+	w = container_of(mark, struct cifsd_notify_watch, mark);
+	if (w->tree)
+		cifsd_notify_tree_event(w, mask, inode, data, data_type, name);
+	else
+		cifsd_notify_dir_event(w, mask, name);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+static bool cifsd_notify_should_send_event(struct fsnotify_group *group,
+	struct inode *inode, struct fsnotify_mark *inode_mark,
+	struct fsnotify_mark *vfsmount_mark, __u32 mask, void *data,
+	int data_type)
+{
+	mask &= ~FS_EVENT_ON_CHILD;
+	return (inode_mark && (inode_mark->mask & mask)) ||
+		(vfsmount_mark && (vfsmount_mark->mask & mask));
+}
+
+static int cifsd_notify_handle_event(struct fsnotify_group *group,
+	struct fsnotify_mark *inode_mark, struct fsnotify_mark *vfsmount_mark,
+	struct fsnotify_event *event)
+{
+	const void *data = event->data_type == FSNOTIFY_EVENT_PATH ?
+		(const void *)&event->path : (const void *)event->inode;
+
+	cifsd_notify_event(inode_mark, event->mask, event->to_tell, data,
+		event->data_type, (const unsigned char *)event->file_name);
+	cifsd_notify_event(vfsmount_mark, event->mask, event->to_tell, data,
+		event->data_type, (const unsigned char *)event->file_name);
+	return 0;
+}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
+static int cifsd_notify_handle_event(struct fsnotify_group *group,
+	struct inode *inode, struct fsnotify_mark *inode_mark,
+	struct fsnotify_mark *vfsmount_mark, u32 mask, void *data,
+	int data_type, const unsigned char *file_name)
+{
+	cifsd_notify_event(inode_mark, mask, inode, data, data_type,
+		file_name);
+	cifsd_notify_event(vfsmount_mark, mask, inode, data, data_type,
+		file_name);
+	return 0;
+}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+static int cifsd_notify_handle_event(struct fsnotify_group *group,
+	struct inode *inode, struct fsnotify_mark *inode_mark,
+	struct fsnotify_mark *vfsmount_mark, u32 mask, void *data,
+	int data_type, const unsigned char *file_name, u32 cookie)
+{
+	cifsd_notify_event(inode_mark, mask, inode, data, data_type,
+		file_name);
+	cifsd_notify_event(vfsmount_mark, mask, inode, data, data_type,
+		file_name);
+	return 0;
+}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+static int cifsd_notify_handle_event(struct fsnotify_group *group,
+	struct inode *inode, struct fsnotify_mark *inode_mark,
+	struct fsnotify_mark *vfsmount_mark, u32 mask, const void *data,
+	int data_type, const unsigned char *file_name, u32 cookie,
+	struct fsnotify_iter_info *iter_info)
+{
+	cifsd_notify_event(inode_mark, mask, inode, data, data_type,
+		file_name);
+	cifsd_notify_event(vfsmount_mark, mask, inode, data, data_type,
+		file_name);
+	return 0;
+}
+#else
+static int cifsd_notify_handle_event(struct fsnotify_group *group,
+	struct inode *inode, u32 mask, const void *data, int data_type,
+	const unsigned char *file_name, u32 cookie,
+	struct fsnotify_iter_info *iter_info)
+{
+	cifsd_notify_event(fsnotify_iter_inode_mark(iter_info), mask, inode,
+		data, data_type, file_name);
+#ifdef CIFSD_NOTIFY_TREE_SB
+	cifsd_notify_event(fsnotify_iter_sb_mark(iter_info), mask, inode,
+		data, data_type, file_name);
+#else
+	cifsd_notify_event(fsnotify_iter_vfsmount_mark(iter_info), mask, inode,
+		data, data_type, file_name);
+#endif
+	return 0;
+}
+#endif
+
+static void cifsd_notify_free_mark(struct fsnotify_mark *mark)
+{
+	kfree(container_of(mark, struct cifsd_notify_watch, mark));
+	if (atomic_dec_and_test(&notify_marks))
+		wake_up(&notify_marks_wq);
+}
+
+static const struct fsnotify_ops cifsd_notify_ops = {
+	.handle_event = cifsd_notify_handle_event,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+	.should_send_event = cifsd_notify_should_send_event,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	.free_mark = cifsd_notify_free_mark,
+#endif
+};
+
+/**
+ * cifsd_notify_set_mask() - widen the event mask of a mark
+ * @w:		watch
+ * @mask:	new fsnotify mask
+ */
+static void cifsd_notify_set_mask(struct cifsd_notify_watch *w, __u32 mask)
+{
+	spin_lock(&w->mark.lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	fsnotify_set_mark_mask_locked(&w->mark, mask);
+#else
+	w->mark.mask = mask;
+#endif
+	spin_unlock(&w->mark.lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	if (w->tree)
+		fsnotify_recalc_vfsmount_mask(w->object);
+	else
+		fsnotify_recalc_inode_mask(w->object);
+#else
+	fsnotify_recalc_mask(w->mark.connector);
+#endif
+}
+
+/**
+ * cifsd_notify_add_mark() - attach the mark of a new watch
+ * @w:		watch
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int cifsd_notify_add_mark(struct cifsd_notify_watch *w)
+{
+	if (!w->tree) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+		return fsnotify_add_mark(&w->mark, notify_group, w->object,
+				NULL, 0);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+		return fsnotify_add_mark(&w->mark, w->object, NULL, 0);
+#else
+		return fsnotify_add_inode_mark(&w->mark, w->object, 0);
+#endif
+	}
+
+#ifdef CIFSD_NOTIFY_TREE_SB
+	return fsnotify_add_mark(&w->mark,
+		&((struct super_block *)w->object)->s_fsnotify_marks,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0)
+		FSNOTIFY_OBJ_TYPE_SB, 0);
+#else
+		FSNOTIFY_OBJ_TYPE_SB, 0, NULL);
+#endif
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	return fsnotify_add_mark(&w->mark, notify_group, NULL, w->object, 0);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+	return fsnotify_add_mark(&w->mark, NULL, w->object, 0);
+#else
+	return fsnotify_add_vfsmount_mark(&w->mark, w->object, 0);
+#endif
+}
+
+/**
+ * cifsd_notify_watch_get() - find or create a watch
+ * @object:	directory inode, or the tree object of a tree watch
+ * @tree:	true for a tree watch
+ * @mask:	fsnotify events needed by the new handle
+ *
+ * Called with notify_mutex held.
+ *
+ * Return:	watch with a reference taken, otherwise ERR_PTR
+ */
+static struct cifsd_notify_watch *cifsd_notify_watch_get(void *object,
+	bool tree, __u32 mask)
+{
+	struct cifsd_notify_watch *w;
+	int err;
+
+	hash_for_each_possible(notify_table, w, hlist, (unsigned long)object) {
+		if (w->object != object || w->tree != tree)
+			continue;
+
+		if ((w->mark.mask & mask) != mask)
+			cifsd_notify_set_mask(w, w->mark.mask | mask);
+		w->refcount++;
+		return w;
+	}
+
+	w = kzalloc(sizeof(struct cifsd_notify_watch), GFP_KERNEL);
+	if (!w)
+		return ERR_PTR(-ENOMEM);
+
+	w->object = object;
+	w->tree = tree;
+	w->refcount = 1;
+	INIT_LIST_HEAD(&w->handles);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	fsnotify_init_mark(&w->mark, cifsd_notify_free_mark);
+#else
+	fsnotify_init_mark(&w->mark, notify_group);
+#endif
+	w->mark.mask = mask;
+	atomic_inc(&notify_marks);
+
+	err = cifsd_notify_add_mark(w);
+	if (err) {
+		fsnotify_put_mark(&w->mark);
+		return ERR_PTR(err);
+	}
+
+	hash_add(notify_table, &w->hlist, (unsigned long)object);
+	return w;
+}
+
+/**
+ * cifsd_notify_watch_put() - drop a watch reference
+ * @w:		watch
+ *
+ * The mark is removed with the last reference. Called with notify_mutex
+ * held, so that a new watch of the same object can't be added while the
+ * old mark is still attached.
+ */
+static void cifsd_notify_watch_put(struct cifsd_notify_watch *w)
+{
+	if (--w->refcount)
+		return;
+
+	hash_del(&w->hlist);
+	fsnotify_destroy_mark(&w->mark, notify_group);
+	fsnotify_put_mark(&w->mark);
+}
+
+/**
+ * cifsd_notify_attach() - start collecting changes for an open directory
+ * @fp:		open directory
+ * @filter:	FILE_NOTIFY_CHANGE_* flags of the first request
+ * @tree:	SMB2_WATCH_TREE was set in the first request
+ * @out_len:	output buffer length of the first request
+ * @nls:	codepage the names are converted from
+ *
+ * Like Windows, the completion filter, scope and buffer size of the first
+ * request stay in effect for the lifetime of the handle. Nothing is done
+ * if the handle is already attached.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_notify_attach(struct cifsd_file *fp, unsigned int filter,
+	bool tree, unsigned int out_len, struct nls_table *nls)
+{
+	struct cifsd_notify_handle *nh;
+	struct cifsd_notify_watch *w = NULL, *tw = NULL;
+	__u32 mask = cifsd_notify_mask(filter);
+	int err = 0;
+
+	mutex_lock(&notify_mutex);
+	if (fp->notify)
+		goto out;
+
+#ifndef CIFSD_NOTIFY_TREE_SB
+	/* name and attribute changes below the directory would be missed */
+	if (tree && (filter & ~CIFSD_NOTIFY_SIZE_FILTER)) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+#endif
+
+	nh = kzalloc(sizeof(struct cifsd_notify_handle), GFP_KERNEL);
+	if (!nh) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	nh->size = min_t(unsigned int, out_len, CIFSD_NOTIFY_BUF_MAX);
+	nh->size = min_t(unsigned int, nh->size, SMBMaxBufSize);
+	if (nh->size) {
+		nh->buf = alloc_data_mem(nh->size);
+		if (!nh->buf) {
+			err = -ENOMEM;
+			goto out_free;
+		}
+	}
+	nh->filter = filter;
+	nh->nls = nls;
+	INIT_LIST_HEAD(&nh->requests);
+
+	/* the tree mark reports the direct children as well */
+	if (!tree) {
+		w = cifsd_notify_watch_get(GET_FP_INODE(fp), false, mask);
+		if (IS_ERR(w)) {
+			err = PTR_ERR(w);
+			goto out_free;
+		}
+	}
+
+	if (tree) {
+#ifdef CIFSD_NOTIFY_TREE_SB
+		tw = cifsd_notify_watch_get(GET_FP_INODE(fp)->i_sb, true,
+				mask & ~FS_EVENT_ON_CHILD);
+#else
+		tw = cifsd_notify_watch_get(fp->filp->f_path.mnt, true,
+				mask & ~FS_EVENT_ON_CHILD);
+#endif
+		if (IS_ERR(tw)) {
+			err = PTR_ERR(tw);
+			goto out_free;
+		}
+		nh->dentry = dget(fp->filp->f_path.dentry);
+	}
+
+	spin_lock(&notify_lock);
+	nh->watch = w;
+	if (w) {
+		list_add_tail(&nh->wlist, &w->handles);
+		w->filter |= filter;
+	}
+	nh->tree = tw;
+	if (tw) {
+		tw->filter |= filter;
+		list_add_tail(&nh->tlist, &tw->handles);
+		hash_add_rcu(notify_dentries, &nh->dnode,
+				(unsigned long)nh->dentry);
+	}
+	fp->notify = nh;
+	spin_unlock(&notify_lock);
+	goto out;
+
+out_free:
+	kvfree(nh->buf);
+	kfree(nh);
+out:
+	mutex_unlock(&notify_mutex);
+	return err;
+}
+
+/**
+ * cifsd_notify_take() - hand the collected changes to a request
+ * @req:	change notify request
+ * @cancel:	the request was cancelled
+ * @out:	response buffer for FILE_NOTIFY_INFORMATION records
+ * @out_len:	output buffer length of the request
+ *
+ * If there is nothing to report yet, the request is parked on the handle
+ * and kicked by the next matching event. Otherwise it is taken off the
+ * handle.
+ *
+ * Return:	length of the records copied to @out, -EINPROGRESS if the
+ *		request is parked, -ECANCELED if it was cancelled, -ENOSPC if
+ *		changes were lost and -EBADF if the handle was closed
+ */
+int cifsd_notify_take(struct notification *req, bool cancel, char *out,
+	unsigned int out_len)
+{
+	struct cifsd_notify_handle *nh;
+	int ret;
+
+	spin_lock(&notify_lock);
+	nh = req->nh;
+	if (!nh) {
+		ret = -EBADF;
+		goto out;
+	}
+
+	if (cancel) {
+		ret = -ECANCELED;
+		goto done;
+	}
+
+	if (nh->overflow || nh->len > out_len) {
+		nh->overflow = false;
+		nh->len = 0;
+		ret = -ENOSPC;
+		goto done;
+	}
+
+	if (!nh->len) {
+		if (list_empty(&req->queuelist))
+			list_add_tail(&req->queuelist, &nh->requests);
+		ret = -EINPROGRESS;
+		goto out;
+	}
+
+	memcpy(out, nh->buf, nh->len);
+	ret = nh->len;
+	nh->len = 0;
+done:
+	list_del_init(&req->queuelist);
+out:
+	spin_unlock(&notify_lock);
+	return ret;
+}
+
+/**
+ * cifsd_notify_recalc_filter() - recompute the filter union of a watch
+ * @w:		watch a handle was removed from
+ * @tree:	@w is a tree watch
+ *
+ * Called with notify_lock held.
+ */
+static void cifsd_notify_recalc_filter(struct cifsd_notify_watch *w,
+	bool tree)
+{
+	struct cifsd_notify_handle *nh;
+	unsigned int filter = 0;
+
+	if (tree) {
+		list_for_each_entry(nh, &w->handles, tlist)
+			filter |= nh->filter;
+	} else {
+		list_for_each_entry(nh, &w->handles, wlist)
+			filter |= nh->filter;
+	}
+	w->filter = filter;
+}
+
+/**
+ * cifsd_notify_close() - stop collecting changes for a closed directory
+ * @fp:		directory being closed
+ *
+ * Parked requests are kicked with ASYNC_CLOSE and complete with
+ * STATUS_NOTIFY_CLEANUP.
+ */
+void cifsd_notify_close(struct cifsd_file *fp)
+{
+	struct cifsd_notify_handle *nh = fp->notify;
+	struct notification *req, *tmp;
+	struct smb_work *work;
+
+	if (!nh)
+		return;
+
+	spin_lock(&notify_lock);
+	list_for_each_entry_safe(req, tmp, &nh->requests, queuelist) {
+		work = req->work;
+		list_del_init(&req->queuelist);
+		req->nh = NULL;
+
+		spin_lock(&work->server->request_lock);
+		work->async->async_status = ASYNC_CLOSE;
+		spin_unlock(&work->server->request_lock);
+		smb_async_io_kick(work);
+	}
+	if (nh->watch) {
+		list_del(&nh->wlist);
+		cifsd_notify_recalc_filter(nh->watch, false);
+	}
+	if (nh->tree) {
+		list_del(&nh->tlist);
+		hash_del_rcu(&nh->dnode);
+		cifsd_notify_recalc_filter(nh->tree, true);
+	}
+	fp->notify = NULL;
+	spin_unlock(&notify_lock);
+
+	/* tree events look up the handles without notify_lock */
+	if (nh->tree)
+		synchronize_rcu();
+
+	mutex_lock(&notify_mutex);
+	if (nh->watch)
+		cifsd_notify_watch_put(nh->watch);
+	if (nh->tree)
+		cifsd_notify_watch_put(nh->tree);
+	mutex_unlock(&notify_mutex);
+
+	if (nh->dentry)
+		dput(nh->dentry);
+	kvfree(nh->buf);
+	kfree(nh);
+}
+
+/**
+ * cifsd_notify_init() - create the change notify fsnotify group
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_notify_init(void)
+{
+	notify_group = fsnotify_alloc_group(&cifsd_notify_ops);
+	if (IS_ERR(notify_group)) {
+		int err = PTR_ERR(notify_group);
+
+		notify_group = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * cifsd_notify_exit() - destroy the change notify fsnotify group
+ *
+ * All handles are closed by now. Wait for fsnotify to free the marks, the
+ * free callback lives in this module.
+ */
+void cifsd_notify_exit(void)
+{
+	fsnotify_destroy_group(notify_group);
+	wait_event(notify_marks_wq, !atomic_read(&notify_marks));
+}
@@ -0,0 +1,61 @@
+/*
+ *   fs/cifsd/notify.h
+ *
+ *   Copyright (C) 2015 Samsung Electronics Co., Ltd.
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_NOTIFY_H
+#define __CIFSD_NOTIFY_H
+
+/* upper limit of the changes collected for one handle */
+#define CIFSD_NOTIFY_BUF_MAX		(64 * 1024)
+
+struct cifsd_notify_watch;
+
+/*
+ * Change notify state of one open directory. Events are accumulated in
+ * @buf as FILE_NOTIFY_INFORMATION records between CHANGE_NOTIFY requests
+ * and handed out to the oldest parked request.
+ */
+struct cifsd_notify_handle {
+	struct cifsd_notify_watch *watch;
+	struct list_head wlist;		/* entry in watch->handles */
+	/* SMB2_WATCH_TREE: filesystem wide watch and the watched dentry */
+	struct cifsd_notify_watch *tree;
+	struct list_head tlist;		/* entry in tree->handles */
+	struct hlist_node dnode;	/* RCU entry in the watched dentry hash */
+	struct dentry *dentry;
+	struct list_head requests;	/* parked struct notification */
+	struct nls_table *nls;
+	unsigned int filter;		/* FILE_NOTIFY_CHANGE_* */
+	char *buf;
+	unsigned int size;
+	unsigned int len;
+	unsigned int last;		/* offset of the last record in buf */
+	bool overflow;
+};
+
+int cifsd_notify_init(void);
+void cifsd_notify_exit(void);
+int cifsd_notify_attach(struct cifsd_file *fp, unsigned int filter,
+		bool tree, unsigned int out_len, struct nls_table *nls);
+int cifsd_notify_take(struct notification *req, bool cancel, char *out,
+		unsigned int out_len);
+void cifsd_notify_close(struct cifsd_file *fp);
+
+#endif /* __CIFSD_NOTIFY_H */
@@ -39,6 +39,7 @@ extern const struct nt_err_code_struct nt_errs[];
 #define NT_ERROR_INVALID_PARAMETER     0x0057
 #define NT_ERROR_INSUFFICIENT_BUFFER   0x007a
 #define NT_STATUS_1804                 0x070c
+#define NT_STATUS_NOTIFY_CLEANUP       0x010b
 #define NT_STATUS_NOTIFY_ENUM_DIR      0x010c
 #define NT_STATUS_INVALID_LOCK_RANGE   (0xC0000000 | 0x01a1)
 /*
@@ -142,7 +142,7 @@ struct ofile_info *get_new_ofile(struct inode *inode)
  * Return:      allocated opinfo object on success, otherwise NULL
  */
 static struct oplock_info *get_new_opinfo(struct cifsd_sess *sess,
-		int id, __u16 Tid, struct lease_ctx_info *lctx)
+		__u64 id, __u16 Tid, struct lease_ctx_info *lctx)
 {
 	struct oplock_info *opinfo;
 #ifdef CONFIG_CIFS_SMB2_SERVER
@@ -224,7 +224,7 @@ static struct oplock_info *get_read_oplock(struct ofile_info *ofile)
  * Return:      opinfo if found matching opinfo, otherwise NULL
  */
 struct oplock_info *get_matching_opinfo(struct tcp_server_info *server,
-		struct ofile_info *ofile, int fid, int fhclose)
+		struct ofile_info *ofile, __u64 fid, int fhclose)
 {
 	struct oplock_info *opinfo;
 
@@ -418,7 +418,7 @@ int lease_read_to_write(struct ofile_info *ofile, struct oplock_info *opinfo)
  * @id:		fid of open file
  */
 static void close_id_del_lease(struct tcp_server_info *server,
-		struct cifsd_file *fp, unsigned int id)
+		struct cifsd_file *fp, __u64 id)
 {
 	struct ofile_info *ofile = NULL;
 	struct oplock_info *opinfo = NULL;
@@ -472,7 +472,7 @@ out:
  * @id:		fid of open file
  */
 void close_id_del_oplock(struct tcp_server_info *server,
-		struct cifsd_file *fp, unsigned int id)
+		struct cifsd_file *fp, __u64 id)
 {
 	struct ofile_info *ofile;
 	struct oplock_info *opinfo;
@@ -993,7 +993,7 @@ static int smb_send_oplock_break_notification(struct ofile_info *ofile,
 	int is_smb2 = IS_SMB2(brk_opinfo->server);
 
 	/* Need to break exclusive/batch oplock, write lease or overwrite_if */
-	cifsd_debug("id old = %d(%d) was oplocked\n",
+	cifsd_debug("id old = %llu(%d) was oplocked\n",
 			brk_opinfo->fid, brk_opinfo->lock_type);
 
 	cifsd_debug("oplock break for inode %lu\n", ofile->inode->i_ino);
@@ -1059,7 +1059,7 @@ static int smb_send_oplock_break_notification(struct ofile_info *ofile,
  * Return:      0 on success, otherwise error
  */
 int smb_grant_oplock(struct cifsd_sess *sess, int *oplock,
-		int id, struct cifsd_file *fp, __u16 Tid,
+		__u64 id, struct cifsd_file *fp, __u16 Tid,
 		struct lease_ctx_info *lctx)
 {
 	int err = 0;
@@ -1483,6 +1483,7 @@ void smb2_send_oplock_break(struct work_struct *work)
 		return;
 	}
 	persistent_id = fp->persistent_id;
+	cifsd_fp_put(fp);
 
 	if (server->ops->allocate_rsp_buf(smb_work)) {
 		cifsd_err("smb2_allocate_rsp_buf failed! ");
@@ -1765,7 +1766,7 @@ void create_disk_id_rsp_buf(char *cc, __u64 file_id, __u64 vol_id)
  */
 struct oplock_info *get_matching_opinfo_lease(struct tcp_server_info *server,
 		struct ofile_info **ofile, char *LeaseKey,
-		struct lease_fidinfo **fidinfo, int id)
+		struct lease_fidinfo **fidinfo, __u64 id)
 {
 	struct ofile_info *ofile_tmp = NULL;
 	struct oplock_info *opinfo = NULL;
@@ -1903,10 +1904,10 @@ int smb_break_write_lease(struct ofile_info *ofile,
  */
 int cifsd_durable_verify_and_del_oplock(struct cifsd_sess *curr_sess,
 					  struct cifsd_sess *prev_sess,
-					  int fid, struct file **filp,
+					  __u64 fid, struct file **filp,
 					  uint64_t sess_id)
 {
-	struct cifsd_file *fp, *fp_curr;
+	struct cifsd_file *fp = NULL, *fp_curr;
 	struct ofile_info *ofile;
 	struct oplock_info *opinfo;
 	int lock_type;
@@ -1967,10 +1968,15 @@ int cifsd_durable_verify_and_del_oplock(struct cifsd_sess *curr_sess,
 
 	/* Remove the oplock associated with previous server thread */
 	close_id_del_oplock(prev_sess->server, fp, fid);
-	delete_id_from_fidtable(prev_sess, fid);
-	cifsd_close_id(&prev_sess->fidtable, fid);
+
+	/* the file is reopened on this session, keep it open */
+	rc = cifsd_fp_handover(prev_sess, fp);
+	if (rc)
+		cifsd_err("durable fid %llu closed meanwhile\n", fid);
 
 out:
+	cifsd_fp_put(fp);
+	cifsd_fp_put(fp_curr);
 	return rc;
 }
 #endif
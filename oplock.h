@@ -57,7 +57,7 @@ struct lease_ctx_info {
 };
 
 struct lease_fidinfo {
-	__u32                   fid;
+	__u64                   fid;
 	struct list_head        fid_entry;
 };
 
@@ -66,7 +66,7 @@ struct oplock_info {
 	struct cifsd_sess	*sess;
 	int                     lock_type;
 	int                     state;
-	int                     fid;
+	__u64                   fid;
 	__u16                   Tid;
 	struct list_head        op_list;
 
@@ -95,7 +95,7 @@ struct ofile_info {
 };
 
 extern int smb_grant_oplock(struct cifsd_sess *sess, int *oplock,
-		int id, struct cifsd_file *fp, __u16 Tid,
+		__u64 id, struct cifsd_file *fp, __u16 Tid,
 		struct lease_ctx_info *lctx);
 extern void smb1_send_oplock_break(struct work_struct *work);
 #ifdef CONFIG_CIFS_SMB2_SERVER
@@ -105,7 +105,7 @@ extern void smb_breakII_oplock(struct tcp_server_info *server,
 		struct cifsd_file *fp, struct ofile_info *ofile);
 
 struct oplock_info *get_matching_opinfo(struct tcp_server_info *server,
-		struct ofile_info *ofile, int fid, int fhclose);
+		struct ofile_info *ofile, __u64 fid, int fhclose);
 int opinfo_write_to_read(struct ofile_info *ofile,
 		struct oplock_info *opinfo, __le32 lease_state);
 int opinfo_write_to_none(struct ofile_info *ofile,
@@ -113,7 +113,7 @@ int opinfo_write_to_none(struct ofile_info *ofile,
 int opinfo_read_to_none(struct ofile_info *ofile,
 		struct oplock_info *opinfo);
 void close_id_del_oplock(struct tcp_server_info *server,
-		struct cifsd_file *fp, unsigned int id);
+		struct cifsd_file *fp, __u64 id);
 void dispose_ofile_list(void);
 void smb_break_all_oplock(struct tcp_server_info *server,
 		struct cifsd_file *fp, struct inode *inode);
@@ -124,7 +124,7 @@ void create_lease_buf(u8 *rbuf, struct lease_ctx_info *lreq);
 __u8 parse_lease_state(void *open_req, struct lease_ctx_info *lreq);
 struct oplock_info *get_matching_opinfo_lease(struct tcp_server_info *server,
 		struct ofile_info **ofile, char *LeaseKey,
-		struct lease_fidinfo **fidinfo, int id);
+		struct lease_fidinfo **fidinfo, __u64 id);
 int smb_break_write_lease(struct ofile_info *ofile,
 		struct oplock_info *opinfo);
 int lease_read_to_write(struct ofile_info *ofile, struct oplock_info *opinfo);
@@ -137,7 +137,7 @@ void create_disk_id_rsp_buf(char *cc, __u64 file_id, __u64 vol_id);
 struct create_context *smb2_find_context_vals(void *open_req, char *str);
 int cifsd_durable_verify_and_del_oplock(struct cifsd_sess *curr_sess,
 					  struct cifsd_sess *prev_sess,
-					  int fid, struct file **filp,
+					  __u64 fid, struct file **filp,
 					  uint64_t sess_id);
 #endif
 
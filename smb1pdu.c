@@ -745,7 +745,8 @@ int smb_rename(struct smb_work *smb_work)
 	}
 
 	cifsd_debug("rename %s -> %s\n", abs_oldname, abs_newname);
-	rc = smb_vfs_rename(smb_work->sess, abs_oldname, abs_newname, 0);
+	rc = smb_vfs_rename(smb_work->sess, abs_oldname, abs_newname, 0,
+			cifsd_tcon_stream_root(smb_work->tcon));
 	if (rc) {
 		rsp->hdr.Status.CifsError = NT_STATUS_NO_MEMORY;
 		goto out;
@@ -955,7 +956,7 @@ no_password_check:
 
 	sess->usr->ucount++;
 	server->sess_count++;
-	rc = init_fidtable(&sess->fidtable);
+	rc = init_fidtable(&sess->fidtable, CIFSD_MAX_FID, false);
 	if (rc < 0)
 		goto out_err;
 
@@ -1212,7 +1213,9 @@ int smb_locking_andx(struct smb_work *smb_work)
 		return -EINVAL;
 	}
 
+	/* ofile_list_lock keeps the oplock state alive */
 	ofile = fp->ofile;
+	cifsd_fp_put(fp);
 	if (ofile == NULL) {
 		cifsd_err("unexpected null ofile_info\n");
 		mutex_unlock(&ofile_list_lock);
@@ -1630,7 +1633,7 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 	char *root = NULL;
 	bool is_unicode;
 	bool is_relative_root = false;
-	struct cifsd_file *fp;
+	struct cifsd_file *fp = NULL;
 
 
 	rsp->hdr.Status.CifsError = NT_STATUS_UNSUCCESSFUL;
@@ -1684,6 +1687,7 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 		rsp->hdr.Status.CifsError =
 			NT_STATUS_NO_MEMORY;
 
+		cifsd_fp_put(fp);
 		return -ENOMEM;
 	}
 
@@ -1718,6 +1722,7 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 			rsp->hdr.Status.CifsError =
 				NT_STATUS_OBJECT_NAME_INVALID;
 
+		cifsd_fp_put(fp);
 		return PTR_ERR(name);
 	}
 
@@ -1731,6 +1736,7 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 		if (!full_name) {
 			kfree(name);
 			rsp->hdr.Status.CifsError = NT_STATUS_NO_MEMORY;
+			cifsd_fp_put(fp);
 			return -ENOMEM;
 		}
 
@@ -1738,6 +1744,8 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 		strncat(full_name, name, org_len);
 		kfree(name);
 		name = full_name;
+		cifsd_fp_put(fp);
+		fp = NULL;
 	}
 
 	root = strrchr(name, '\\');
@@ -1947,13 +1955,9 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 		rsp->CreateAction = cpu_to_le32(file_info);
 
 
-	create_time = min3(cifs_UnixTimeToNT(stat.ctime),
-			cifs_UnixTimeToNT(stat.mtime),
-			cifs_UnixTimeToNT(stat.atime));
-
-	if (!create_time)
-		create_time = min(cifs_UnixTimeToNT(stat.ctime),
-				cifs_UnixTimeToNT(stat.mtime));
+	create_time = smb_get_create_time(&path, &stat,
+			get_attr_store_dos(&smb_work->tcon->share->config.attr),
+			file_info == F_CREATED);
 
 	rsp->CreationTime = cpu_to_le64(create_time);
 	rsp->LastAccessTime = cpu_to_le64(cifs_UnixTimeToNT(stat.atime));
@@ -1997,6 +2001,7 @@ int smb_nt_create_andx(struct smb_work *smb_work)
 free_path:
 	path_put(&path);
 out:
+	cifsd_fp_put(fp);
 	switch (err) {
 	case 0:
 		server->stats.open_files_count++;
@@ -3356,6 +3361,8 @@ int query_path_info(struct smb_work *smb_work)
 	char *name;
 	struct path path;
 	struct kstat st;
+	struct timespec ts;
+	__u64 create_time;
 	int rc;
 	FILE_ALL_INFO *ainfo;
 	FILE_UNIX_BASIC_INFO *unix_info;
@@ -3391,6 +3398,9 @@ int query_path_info(struct smb_work *smb_work)
 		cifsd_err("cannot get stat information\n");
 		goto err_out;
 	}
+	create_time = smb_get_create_time(&path, &st,
+			get_attr_store_dos(&smb_work->tcon->share->config.attr),
+			false);
 
 	if (req_hdr->WordCount != 15) {
 		cifsd_err("word count mismatch: expected 15 got %d\n",
@@ -3405,7 +3415,8 @@ int query_path_info(struct smb_work *smb_work)
 		ptr = (char *)&rsp->Pad + 1;
 		memset(ptr, 0, 4);
 		infos = (FILE_INFO_STANDARD *)(ptr + 4);
-		unix_to_dos_time(&st.ctime, &infos->CreationDate,
+		ts = cifs_NTtimeToUnix(cpu_to_le64(create_time));
+		unix_to_dos_time(&ts, &infos->CreationDate,
 						&infos->CreationTime);
 		unix_to_dos_time(&st.atime, &infos->LastAccessDate,
 						&infos->LastAccessTime);
@@ -3483,15 +3494,7 @@ int query_path_info(struct smb_work *smb_work)
 		ptr = (char *)&rsp->Pad + 1;
 		memset(ptr, 0, 4);
 		basic_info = (FILE_BASIC_INFO *)(ptr + 4);
-		basic_info->CreationTime = cpu_to_le64(min3(
-					cifs_UnixTimeToNT(st.ctime),
-					cifs_UnixTimeToNT(st.mtime),
-					cifs_UnixTimeToNT(st.atime)));
-
-		if (!le64_to_cpu(basic_info->CreationTime))
-			basic_info->CreationTime = cpu_to_le64(min(
-						cifs_UnixTimeToNT(st.ctime),
-						cifs_UnixTimeToNT(st.mtime)));
+		basic_info->CreationTime = cpu_to_le64(create_time);
 		basic_info->LastAccessTime =
 			cpu_to_le64(cifs_UnixTimeToNT(st.atime));
 		basic_info->LastWriteTime =
@@ -3557,7 +3560,7 @@ int query_path_info(struct smb_work *smb_work)
 		ptr = (char *)&rsp->Pad + 1;
 		memset(ptr, 0, 4);
 		ainfo = (FILE_ALL_INFO *) (ptr + 4);
-		ainfo->CreationTime = cpu_to_le64(cifs_UnixTimeToNT(st.ctime));
+		ainfo->CreationTime = cpu_to_le64(create_time);
 		ainfo->LastAccessTime =
 			cpu_to_le64(cifs_UnixTimeToNT(st.atime));
 		ainfo->LastWriteTime = cpu_to_le64(cifs_UnixTimeToNT(st.mtime));
@@ -4409,7 +4412,7 @@ int smb_posix_unlink(struct smb_work *smb_work)
 	if (IS_ERR(name))
 		return PTR_ERR(name);
 
-	rc = smb_vfs_unlink(name);
+	rc = smb_vfs_unlink(name, cifsd_tcon_stream_root(smb_work->tcon));
 	if (rc < 0)
 		goto out;
 
@@ -4822,8 +4825,12 @@ int smb_filldir(void *__buf, const char *name, int namlen,
 	struct smb_dirent *de = (void *)(buf->dirent + buf->used);
 	unsigned int reclen;
 
+	/* hide the sidecar stream store */
+	if (buf->hide_stream_dir && smb_is_stream_dir_name(name, namlen))
+		return 0;
+
 	reclen = ALIGN(sizeof(struct smb_dirent) + namlen, sizeof(u64));
-	if (buf->used + reclen > PAGE_SIZE) {
+	if (buf->used + reclen > buf->size) {
 		buf->full = 1;
 		return -EINVAL;
 	}
@@ -4840,61 +4847,50 @@ int smb_filldir(void *__buf, const char *name, int namlen,
 }
 
 /**
- * read_next_entry() - read next directory entry and return absolute name
+ * read_next_entry() - stat next directory entry and return its name
  * @kstat:	stat of next dirent
  * @de:		directory entry
- * @dirpath:	directory path name
+ * @dirp:	open directory the entry was read from
+ * @namebuf:	at least NAME_MAX + 1 bytes to return the name in
+ * @store_dos:	the share keeps creation times in xattrs
+ * @create_time:	creation time of the entry
  *
- * Return:      on success return absolute path of directory entry,
- *              otherwise NULL
+ * Return:      on success return name of directory entry in @namebuf,
+ *              otherwise error pointer
  */
 char *read_next_entry(struct kstat *kstat,
-		struct smb_dirent *de, char *dirpath)
+		struct smb_dirent *de, struct file *dirp, char *namebuf,
+		bool store_dos, __u64 *create_time)
 {
-	struct path path;
-	int rc, file_pathlen, dir_pathlen;
-	char *name;
-
-	dir_pathlen = strlen(dirpath);
-	/* 1 for '/'*/
-	file_pathlen = dir_pathlen +  de->namelen + 1;
-	name = kmalloc(file_pathlen + 1, GFP_KERNEL);
-	if (!name) {
-		cifsd_err("Name memory failed for length %d,"
-				" buf_name_len %d\n", dir_pathlen, de->namelen);
-		return ERR_PTR(-ENOMEM);
-	}
+	int rc;
 
-	memcpy(name, dirpath, dir_pathlen);
-	memset(name + dir_pathlen, '/', 1);
-	memcpy(name + dir_pathlen + 1, de->name, de->namelen);
-	name[file_pathlen] = '\0';
+	if (de->namelen > NAME_MAX)
+		return ERR_PTR(-ENAMETOOLONG);
 
-	rc = smb_kern_path(name, 0, &path, 1);
+	rc = smb_vfs_child_stat(dirp, de->name, de->namelen, kstat,
+			store_dos, create_time);
 	if (rc) {
-		cifsd_err("look up failed for (%s) with rc=%d\n", name, rc);
-		kfree(name);
+		cifsd_debug("look up failed for (%.*s) with rc=%d\n",
+				de->namelen, de->name, rc);
 		return ERR_PTR(rc);
 	}
 
-	generic_fillattr(path.dentry->d_inode, kstat);
-	memcpy(name, de->name, de->namelen);
-	name[de->namelen] = '\0';
-	path_put(&path);
-	return name;
+	memcpy(namebuf, de->name, de->namelen);
+	namebuf[de->namelen] = '\0';
+	return namebuf;
 }
 
 /**
  * fill_common_info() - convert unix stat information to smb stat format
  * @p:          destination buffer
  * @kstat:      file stat information
+ * @create_time: creation time from smb_get_create_time()
  */
-void *fill_common_info(char **p, struct kstat *kstat)
+void *fill_common_info(char **p, struct kstat *kstat, __u64 create_time)
 {
 	FILE_DIRECTORY_INFO *info = (FILE_DIRECTORY_INFO *)(*p);
 	info->FileIndex = 0;
-	info->CreationTime = cpu_to_le64(
-			cifs_UnixTimeToNT(kstat->ctime));
+	info->CreationTime = cpu_to_le64(create_time);
 	info->LastAccessTime = cpu_to_le64(
 			cifs_UnixTimeToNT(kstat->atime));
 	info->LastWriteTime = cpu_to_le64(
@@ -4919,6 +4915,8 @@ void *fill_common_info(char **p, struct kstat *kstat)
  * @next_entry_offset:  offset of dentry
  * @buf_len:            response buffer length
  * @data_count:         used response buffer size
+ * @alignment:          entry alignment mask
+ * @enc_buf:            buffer for the encoded name, see SRCH_SCRATCH_UNI()
  *
  * Return:      return error if next entry could not fit in current response
  *              buffer, otherwise return encode buffer.
@@ -4926,14 +4924,8 @@ void *fill_common_info(char **p, struct kstat *kstat)
 char *convname_updatenextoffset(char *namestr, int len, int size,
 		const struct nls_table *local_nls, int *name_len,
 		int *next_entry_offset, int *buf_len, int *data_count,
-		int alignment)
+		int alignment, char *enc_buf)
 {
-	char *enc_buf;
-
-	enc_buf = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!enc_buf)
-		return NULL;
-
 	*name_len = smbConvertToUTF16((__le16 *)enc_buf,
 			namestr, len, local_nls, 0);
 	(*name_len)++; /*for NULL character*/
@@ -4946,7 +4938,6 @@ char *convname_updatenextoffset(char *namestr, int len, int size,
 				" data_count : %d\n", *buf_len,
 				*next_entry_offset, *data_count);
 		*buf_len = -1;
-		kfree(enc_buf);
 		return NULL;
 	}
 	return enc_buf;
@@ -4962,8 +4953,10 @@ char *convname_updatenextoffset(char *namestr, int len, int size,
  * @buf_len:	response buffer length
  * @last_entry_offset:	offset of last entry in directory
  * @kstat:	dirent stat information
+ * @create_time:	dirent creation time
  * @data_count:	used buffer size
  * @num_entry:	number of dirents searched so far
+ * @scratch:	search handle scratch area from smb_srch_scratch()
  *
  * if directory has many entries, find first can't read it fully.
  * find next might be called multiple times to read remaining dir entries
@@ -4973,7 +4966,8 @@ char *convname_updatenextoffset(char *namestr, int len, int size,
 static int smb_populate_readdir_entry(struct tcp_server_info *server,
 		int info_level, char **p, int reclen, char *namestr,
 		int *buf_len, int *last_entry_offset, struct kstat *kstat,
-		int *data_count, int *num_entry)
+		__u64 create_time, int *data_count, int *num_entry,
+		char *scratch)
 {
 	int name_len;
 	int next_entry_offset;
@@ -4988,12 +4982,13 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 				sizeof(FILE_DIRECTORY_INFO),
 				server->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
+				buf_len, data_count, 3,
+				SRCH_SCRATCH_UNI(scratch));
 		if (!utfname)
 			break;
 
 		fdinfo = (FILE_DIRECTORY_INFO *)
-			fill_common_info(p, kstat);
+			fill_common_info(p, kstat, create_time);
 		fdinfo->FileNameLength = cpu_to_le32(name_len);
 		memcpy(fdinfo->FileName, utfname, name_len);
 		fdinfo->FileName[name_len - 2] = 0;
@@ -5013,12 +5008,13 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 				sizeof(FILE_FULL_DIRECTORY_INFO),
 				server->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
+				buf_len, data_count, 3,
+				SRCH_SCRATCH_UNI(scratch));
 		if (!utfname)
 			break;
 
 		ffdinfo = (FILE_FULL_DIRECTORY_INFO *)
-			fill_common_info(p, kstat);
+			fill_common_info(p, kstat, create_time);
 		ffdinfo->FileNameLength = cpu_to_le32(name_len);
 		ffdinfo->EaSize = 0;
 		memcpy(ffdinfo->FileName, utfname, name_len);
@@ -5040,12 +5036,13 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 				sizeof(FILE_BOTH_DIRECTORY_INFO),
 				server->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
+				buf_len, data_count, 3,
+				SRCH_SCRATCH_UNI(scratch));
 		if (!utfname)
 			break;
 
 		fbdinfo = (FILE_BOTH_DIRECTORY_INFO *)
-			fill_common_info(p, kstat);
+			fill_common_info(p, kstat, create_time);
 		fbdinfo->FileNameLength = cpu_to_le32(name_len);
 		fbdinfo->EaSize = 0;
 		fbdinfo->ShortNameLength = 0;
@@ -5070,12 +5067,13 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 				sizeof(SEARCH_ID_FULL_DIR_INFO),
 				server->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
+				buf_len, data_count, 3,
+				SRCH_SCRATCH_UNI(scratch));
 		if (!utfname)
 			break;
 
 		dinfo = (SEARCH_ID_FULL_DIR_INFO *)
-			fill_common_info(p, kstat);
+			fill_common_info(p, kstat, create_time);
 		dinfo->FileNameLength = cpu_to_le32(name_len);
 		dinfo->EaSize = 0;
 		dinfo->Reserved = 0;
@@ -5099,7 +5097,8 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 				sizeof(FILE_UNIX_INFO),
 				server->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
+				buf_len, data_count, 3,
+				SRCH_SCRATCH_UNI(scratch));
 		if (!utfname)
 			break;
 
@@ -5127,7 +5126,6 @@ static int smb_populate_readdir_entry(struct tcp_server_info *server,
 		*data_count += next_entry_offset;
 		*buf_len -= next_entry_offset;
 		(*num_entry)++;
-		kfree(utfname);
 	}
 
 	cifsd_debug("info_level : %d, buf_len :%d,"
@@ -5157,6 +5155,9 @@ int find_first(struct smb_work *smb_work)
 	struct smb_dirent *de;
 	struct cifsd_file *dir_fp = NULL;
 	struct kstat kstat;
+	__u64 create_time;
+	bool store_dos =
+		get_attr_store_dos(&smb_work->tcon->share->config.attr);
 	int params_count = sizeof(T2_FFIRST_RSP_PARMS);
 	int data_alignment_offset = 0;
 	int data_count = 0;
@@ -5170,18 +5171,13 @@ int find_first(struct smb_work *smb_work)
 	char *namestr = NULL;
 	char *dirpath = NULL;
 	char *srch_ptr = NULL;
+	char *scratch;
 	struct smb_readdir_data r_data = {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 		.ctx.actor = smb_filldir,
 #endif
-		.dirent = (void *)__get_free_page(GFP_KERNEL)
 	};
 
-	if (!r_data.dirent) {
-		rsp->hdr.Status.CifsError = NT_STATUS_NO_MEMORY;
-		return -ENOMEM;
-	}
-
 	req_params = (TRANSACTION2_FFIRST_REQ_PARAMS *)(smb_work->buf +
 			req->ParameterOffset + 4);
 	dirpath = smb_get_dir_name(req_params->FileName, PATH_MAX,
@@ -5217,7 +5213,18 @@ int find_first(struct smb_work *smb_work)
 		goto err_out;
 	}
 
-	dir_fp->readdir_data.dirent = r_data.dirent;
+	rc = smb_vfs_readdir_buf(&dir_fp->readdir_data, PAGE_SIZE);
+	scratch = smb_srch_scratch(dir_fp);
+	if (rc || !scratch) {
+		rsp->hdr.Status.CifsError = NT_STATUS_NO_MEMORY;
+		rc = -ENOMEM;
+		goto err_out;
+	}
+
+	r_data.dirent = dir_fp->readdir_data.dirent;
+	r_data.size = dir_fp->readdir_data.size;
+	r_data.hide_stream_dir = dir_fp->filp->f_path.dentry ==
+		smb_work->tcon->share_path.dentry;
 	dir_fp->readdir_data.used = 0;
 	dir_fp->readdir_data.full = 0;
 	dir_fp->dirent_offset = 0;
@@ -5249,9 +5256,7 @@ int find_first(struct smb_work *smb_work)
 			dir_fp->readdir_data.used = r_data.used;
 			dir_fp->readdir_data.full = r_data.full;
 			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
+				smb_vfs_readdir_buf_free(&dir_fp->readdir_data);
 				break;
 			}
 
@@ -5267,36 +5272,35 @@ int find_first(struct smb_work *smb_work)
 				sizeof(__le64));
 		dir_fp->dirent_offset += reclen;
 
-		namestr = read_next_entry(&kstat, de, dirpath);
-		if (IS_ERR(namestr)) {
-			rc = PTR_ERR(namestr);
-			cifsd_debug("Err while dirent read rc = %d\n", rc);
-			rc = 0;
-			continue;
-		}
-
-		cifsd_debug("filename string = %s\n", namestr);
 		if (srch_ptr) {
 			cifsd_debug("Single entry requested\n");
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 			if (strlen(srch_ptr) != de->namelen ||
 				strncasecmp(de->name, srch_ptr,
-					de->namelen)) {
+					de->namelen))
 #else
 			if (strlen(srch_ptr) != de->namelen ||
 					strnicmp(de->name, srch_ptr,
-						de->namelen)) {
+						de->namelen))
 #endif
-					kfree(namestr);
-					continue;
-			}
+				continue;
 		}
 
+		namestr = read_next_entry(&kstat, de, dir_fp->filp, scratch,
+				store_dos, &create_time);
+		if (IS_ERR(namestr)) {
+			rc = PTR_ERR(namestr);
+			cifsd_debug("Err while dirent read rc = %d\n", rc);
+			rc = 0;
+			continue;
+		}
+
+		cifsd_debug("filename string = %s\n", namestr);
 		rc = smb_populate_readdir_entry(server,
 				req_params->InformationLevel, &bufptr, reclen,
 				namestr, &out_buf_len, &last_entry_offset,
-				&kstat, &data_count, &num_entry);
-		kfree(namestr);
+				&kstat, create_time, &data_count, &num_entry,
+				scratch);
 		if (rc)
 			goto err_out;
 
@@ -5351,18 +5355,16 @@ int find_first(struct smb_work *smb_work)
 	memset((char *)rsp + sizeof(TRANSACTION2_RSP) + params_count, '\0', 2);
 	inc_rfc1001_len(rsp_hdr, (10 * 2 + data_count + params_count + 1 +
 				data_alignment_offset));
+	cifsd_fp_put(dir_fp);
 	kfree(srch_ptr);
 	smb_put_name(dirpath);
 	return 0;
 
 err_out:
-	if (dir_fp && dir_fp->readdir_data.dirent) {
+	if (dir_fp) {
 		path_put(&(dir_fp->filp->f_path));
 		close_id(sess, sid, 0);
-		if (dir_fp->readdir_data.dirent)  {
-			free_page((unsigned long)(dir_fp->readdir_data.dirent));
-			dir_fp->readdir_data.dirent = NULL;
-		}
+		cifsd_fp_put(dir_fp);
 	}
 
 	if (rsp->hdr.Status.CifsError == 0)
@@ -5395,6 +5397,9 @@ int find_next(struct smb_work *smb_work)
 	struct smb_dirent *de;
 	struct cifsd_file *dir_fp;
 	struct kstat kstat;
+	__u64 create_time;
+	bool store_dos =
+		get_attr_store_dos(&smb_work->tcon->share->config.attr);
 	int params_count = sizeof(T2_FNEXT_RSP_PARMS);
 	int data_alignment_offset = 0;
 	int data_count = 0;
@@ -5405,9 +5410,8 @@ int find_next(struct smb_work *smb_work)
 	__u16 sid;
 	char *bufptr = NULL;
 	char *namestr = NULL;
-	char *dirpath = NULL;
 	char *name = NULL;
-	char *pathname = NULL;
+	char *scratch;
 	struct smb_readdir_data r_data = {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 		.ctx.actor = smb_filldir,
@@ -5435,22 +5439,18 @@ int find_next(struct smb_work *smb_work)
 		goto err_out;
 	}
 
-	r_data.dirent = dir_fp->readdir_data.dirent;
-	pathname = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!pathname) {
-		cifsd_debug("Failed to allocate memory\n");
+	rc = smb_vfs_readdir_buf(&dir_fp->readdir_data, PAGE_SIZE);
+	scratch = smb_srch_scratch(dir_fp);
+	if (rc || !scratch) {
 		rsp->hdr.Status.CifsError = NT_STATUS_NO_MEMORY;
 		rc = -ENOMEM;
 		goto err_out;
 	}
 
-	dirpath = d_path(&(dir_fp->filp->f_path), pathname, PATH_MAX);
-	if (IS_ERR(dirpath)) {
-		rc = PTR_ERR(dirpath);
-		goto err_out;
-	}
-
-	cifsd_debug("dirpath = %s\n", dirpath);
+	r_data.dirent = dir_fp->readdir_data.dirent;
+	r_data.size = dir_fp->readdir_data.size;
+	r_data.hide_stream_dir = dir_fp->filp->f_path.dentry ==
+		smb_work->tcon->share_path.dentry;
 
 	if (params_count % 4)
 		data_alignment_offset = 4 - params_count % 4;
@@ -5479,9 +5479,7 @@ int find_next(struct smb_work *smb_work)
 			dir_fp->readdir_data.used = r_data.used;
 			dir_fp->readdir_data.full = r_data.full;
 			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
+				smb_vfs_readdir_buf_free(&dir_fp->readdir_data);
 				break;
 			}
 
@@ -5497,7 +5495,8 @@ int find_next(struct smb_work *smb_work)
 				sizeof(__le64));
 		dir_fp->dirent_offset += reclen;
 
-		namestr = read_next_entry(&kstat, de, dirpath);
+		namestr = read_next_entry(&kstat, de, dir_fp->filp, scratch,
+				store_dos, &create_time);
 		if (IS_ERR(namestr)) {
 			rc = PTR_ERR(namestr);
 			cifsd_debug("Err while dirent read rc = %d\n", rc);
@@ -5509,8 +5508,8 @@ int find_next(struct smb_work *smb_work)
 		rc = smb_populate_readdir_entry(server,
 				req_params->InformationLevel, &bufptr, reclen,
 				namestr, &out_buf_len, &last_entry_offset,
-				&kstat, &data_count, &num_entry);
-		kfree(namestr);
+				&kstat, create_time, &data_count, &num_entry,
+				scratch);
 		if (rc)
 			goto err_out;
 
@@ -5556,24 +5555,20 @@ int find_next(struct smb_work *smb_work)
 			cpu_to_le16(params_count), '\0', data_alignment_offset);
 	inc_rfc1001_len(rsp_hdr, (10 * 2 + data_count + params_count + 1 +
 				data_alignment_offset));
-	kfree(pathname);
+	cifsd_fp_put(dir_fp);
 	return 0;
 
 err_out:
-	if (dir_fp && dir_fp->readdir_data.dirent) {
-		if (dir_fp->readdir_data.dirent)  {
-			free_page((unsigned long)(dir_fp->readdir_data.dirent));
-			dir_fp->readdir_data.dirent = NULL;
-		}
+	if (dir_fp) {
 		path_put(&(dir_fp->filp->f_path));
 		close_id(sess, sid, 0);
+		cifsd_fp_put(dir_fp);
 	}
 
 	if (rsp->hdr.Status.CifsError == 0)
 		rsp->hdr.Status.CifsError =
 			NT_STATUS_UNEXPECTED_IO_ERROR;
 
-	kfree(pathname);
 	return 0;
 }
 
@@ -5818,11 +5813,13 @@ int smb_set_dispostion(struct smb_work *smb_work)
 	if (*disp_info) {
 		if (!fp->is_nt_open) {
 			rsp->hdr.Status.CifsError = NT_STATUS_ACCESS_DENIED;
+			cifsd_fp_put(fp);
 			return -EPERM;
 		}
 
 		if (!(fp->filp->f_path.dentry->d_inode->i_mode & S_IWUGO)) {
 			rsp->hdr.Status.CifsError = NT_STATUS_CANNOT_DELETE;
+			cifsd_fp_put(fp);
 			return -EPERM;
 		}
 
@@ -5830,10 +5827,12 @@ int smb_set_dispostion(struct smb_work *smb_work)
 				!is_dir_empty(fp)) {
 			rsp->hdr.Status.CifsError =
 				NT_STATUS_DIRECTORY_NOT_EMPTY;
+			cifsd_fp_put(fp);
 			return -ENOTEMPTY;
 		}
 		fp->delete_on_close = 1;
 	}
+	cifsd_fp_put(fp);
 
 	rsp->hdr.Status.CifsError = NT_STATUS_OK;
 	rsp->hdr.WordCount = 10;
@@ -6022,6 +6021,7 @@ int query_file_info(struct smb_work *smb_work)
 	TRANSACTION2_QFI_REQ_PARAMS *req_params;
 	struct cifsd_file *fp;
 	struct kstat st;
+	__u64 create_time;
 	struct file *filp;
 	FILE_STANDARD_INFO *standard_info;
 	FILE_BASIC_INFO *basic_info;
@@ -6059,6 +6059,10 @@ int query_file_info(struct smb_work *smb_work)
 		filp = fp->filp;
 
 	generic_fillattr(filp->f_path.dentry->d_inode, &st);
+	create_time = smb_get_create_time(&filp->f_path, &st,
+			get_attr_store_dos(&smb_work->tcon->share->config.attr),
+			false);
+	cifsd_fp_put(fp);
 
 	switch (req_params->InformationLevel) {
 
@@ -6111,8 +6115,7 @@ int query_file_info(struct smb_work *smb_work)
 		ptr = (char *)&rsp->Pad + 1;
 		memset(ptr, 0, 4);
 		basic_info = (FILE_BASIC_INFO *)(ptr + 4);
-		basic_info->CreationTime =
-			cpu_to_le64(cifs_UnixTimeToNT(st.ctime));
+		basic_info->CreationTime = cpu_to_le64(create_time);
 		basic_info->LastAccessTime =
 			cpu_to_le64(cifs_UnixTimeToNT(st.atime));
 		basic_info->LastWriteTime =
@@ -6194,7 +6197,7 @@ int query_file_info(struct smb_work *smb_work)
 		ptr = (char *)&rsp->Pad + 1;
 		memset(ptr, 0, 4);
 		ainfo = (FILE_ALL_INFO *)(ptr + 4);
-		ainfo->CreationTime = cpu_to_le64(cifs_UnixTimeToNT(st.ctime));
+		ainfo->CreationTime = cpu_to_le64(create_time);
 		ainfo->LastAccessTime =
 			cpu_to_le64(cifs_UnixTimeToNT(st.atime));
 		ainfo->LastWriteTime = cpu_to_le64(cifs_UnixTimeToNT(st.mtime));
@@ -6262,7 +6265,8 @@ int smb_fileinfo_rename(struct smb_work *smb_work)
 	}
 
 	cifsd_debug("rename fid %u -> %s\n", req->Fid, newname);
-	rc = smb_vfs_rename(smb_work->sess, NULL, newname, (uint64_t)req->Fid);
+	rc = smb_vfs_rename(smb_work->sess, NULL, newname, (uint64_t)req->Fid,
+			cifsd_tcon_stream_root(smb_work->tcon));
 	if (rc) {
 		rsp->hdr.Status.CifsError = NT_STATUS_UNEXPECTED_IO_ERROR;
 		goto out;
@@ -6593,7 +6597,7 @@ int smb_rmdir(struct smb_work *smb_work)
 	if (IS_ERR(name))
 		return PTR_ERR(name);
 
-	err = smb_vfs_unlink(name);
+	err = smb_vfs_unlink(name, cifsd_tcon_stream_root(smb_work->tcon));
 	if (err) {
 		if (err == -ENOTEMPTY)
 			rsp->hdr.Status.CifsError =
@@ -6628,7 +6632,7 @@ int smb_unlink(struct smb_work *smb_work)
 	if (IS_ERR(name))
 		return PTR_ERR(name);
 
-	err = smb_vfs_unlink(name);
+	err = smb_vfs_unlink(name, cifsd_tcon_stream_root(smb_work->tcon));
 	if (err) {
 		if (err == -EISDIR)
 			rsp->hdr.Status.CifsError =
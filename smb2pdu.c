@@ -24,11 +24,13 @@
 #include "smb2pdu.h"
 #include "smbfsctl.h"
 #include "oplock.h"
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+#include "notify.h"
+#endif
 
 #include <linux/inetdevice.h>
 #include <net/addrconf.h>
 #include <linux/syscalls.h>
-#include <linux/inotify.h>
 
 bool multi_channel_enable;
 
@@ -522,6 +524,8 @@ int smb2_allocate_rsp_buf(struct smb_work *smb_work)
 		case SMB2_IOCTL_HE:
 			/* fall through */
 		case SMB2_QUERY_DIRECTORY_HE:
+			/* fall through */
+		case SMB2_CHANGE_NOTIFY_HE:
 			need_large_buf = true;
 			break;
 		case SMB2_QUERY_INFO_HE:
@@ -848,6 +852,79 @@ void smb2_send_interim_resp(struct smb_work *smb_work)
 	smb_work->multiRsp = 0;
 }
 
+/**
+ * smb2_can_defer_io() - check if a request may complete asynchronously
+ * @smb_work:	smb work containing the request
+ *
+ * Compound requests are answered in one response buffer and are always
+ * processed synchronously.
+ *
+ * Return:	true if the request can be deferred to the I/O workqueue
+ */
+static inline bool smb2_can_defer_io(struct smb_work *smb_work)
+{
+	struct smb2_hdr *req_hdr = (struct smb2_hdr *)smb_work->buf;
+
+	return !smb_work->async_io && !smb_work->next_smb2_rcv_hdr_off &&
+		!req_hdr->NextCommand;
+}
+
+/**
+ * smb2_async_io() - blocking part of a deferred READ/WRITE request
+ * @smb_work:	smb work containing the request
+ *
+ * Runs on the cifsd I/O workqueue and builds the final response.
+ */
+static int smb2_async_io(struct smb_work *smb_work)
+{
+	struct smb2_hdr *req_hdr = (struct smb2_hdr *)smb_work->buf;
+	struct smb2_hdr *rsp_hdr = (struct smb2_hdr *)smb_work->rsp_buf;
+
+	if (smb_work->async->async_status == ASYNC_CANCEL) {
+		rsp_hdr->Status = NT_STATUS_CANCELLED;
+		smb2_set_err_rsp(smb_work);
+		return 0;
+	}
+
+	if (req_hdr->Command == SMB2_READ)
+		smb2_read(smb_work);
+	else
+		smb2_write(smb_work);
+	return 0;
+}
+
+/**
+ * smb2_defer_io() - complete a READ/WRITE from the cifsd I/O workqueue
+ * @smb_work:	smb work containing the request
+ *
+ * Send a STATUS_PENDING interim response and hand the request over to the
+ * I/O workqueue, so that the request worker does not sleep on storage.
+ *
+ * Return:	0 if the request was deferred, otherwise error and the caller
+ *		completes the request synchronously
+ */
+static int smb2_defer_io(struct smb_work *smb_work)
+{
+	struct smb2_hdr *rsp_hdr = (struct smb2_hdr *)smb_work->rsp_buf;
+	__be32 rsp_len = rsp_hdr->smb2_buf_length;
+	int err;
+
+	err = setup_async_work(smb_work);
+	if (err)
+		return err;
+
+	smb2_send_interim_resp(smb_work);
+
+	/* final response is built again on the same buffer */
+	rsp_hdr->smb2_buf_length = rsp_len;
+	rsp_hdr->Status = NT_STATUS_OK;
+
+	smb_async_io_arm(smb_work, 1);
+	smb_work->async_io = 1;
+	smb_work->async_io_fn = smb2_async_io;
+	return 0;
+}
+
 /**
  * smb2_get_dos_mode() - get file mode in dos format from unix mode
  * @stat:	kstat containing file mode
@@ -1179,13 +1256,12 @@ int smb2_sess_setup(struct smb_work *smb_work)
 		INIT_LIST_HEAD(&sess->cifsd_chann_list);
 		list_add(&sess->cifsd_ses_list, &server->cifsd_sess);
 		list_add(&sess->cifsd_ses_global_list, &cifsd_session_list);
-		hash_init(sess->notify_table);
 
 		INIT_LIST_HEAD(&sess->tcon_list);
 		sess->tcon_count = 0;
 		sess->valid = 1;
 		server->sess_count++;
-		rc = init_fidtable(&sess->fidtable);
+		rc = init_fidtable(&sess->fidtable, CIFSD_MAX_FID_SMB2, true);
 		if (rc < 0)
 			goto out_err;
 
@@ -1743,10 +1819,13 @@ int smb2_session_logoff(struct smb_work *smb_work)
 
 	/*
 	 * We cannot discard session in case some request are already running.
-	 * Need to wait for them to finish and update req_running.
+	 * Need to wait for them to finish and update req_running. Deferred
+	 * READ/WRITE and the parked requests destroy_fidtable() just woke up
+	 * still use the session and tree connection from the I/O workqueue.
 	 */
 	wait_event(server->req_running_q,
-			atomic_read(&server->req_running) == 1);
+			atomic_read(&server->req_running) == 1 &&
+			atomic_read(&server->async_io_running) == 0);
 
 	/* Free the tree connection to session */
 	list_for_each_safe(tmp, t, &sess->tcon_list) {
@@ -1861,7 +1940,7 @@ int smb2_open(struct smb_work *smb_work)
 	umode_t mode = 0;
 	bool file_present = true, islink = false;
 	int oplock, open_flags = 0, file_info = 0, len = 0;
-	int volatile_id = 0;
+	uint64_t volatile_id = 0;
 	uint64_t persistent_id = 0;
 	int rc = 0, sh_rc = 0;
 	char *name = NULL, *context_name, *lname = NULL, *pathname = NULL;
@@ -2141,23 +2220,47 @@ int smb2_open(struct smb_work *smb_work)
 		}
 	}
 
+	/* sidecar stream storage is not visible to clients */
+	if (smb_is_stream_dir_path(smb_work->tcon, name)) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+		rc = -EIO;
+		kfree(name);
+		goto err_out1;
+	}
+
 	if (le32_to_cpu(req->CreateOptions) & FILE_DELETE_ON_CLOSE_LE) {
 		/*
 		 * On delete request, instead of following up, need to
 		 * look the current entity
 		 */
-		rc = smb_kern_path(name, 0, &path, 1);
+		rc = smb_share_kern_path(smb_work->tcon, name, 0, &path, 1);
 	} else {
 		/*
 		* Use LOOKUP_FOLLOW to follow the path of
 		* symlink in path buildup
 		*/
-		rc = smb_kern_path(name, LOOKUP_FOLLOW, &path, 1);
+		rc = smb_share_kern_path(smb_work->tcon, name,
+				LOOKUP_FOLLOW, &path, 1);
 		if (rc) { /* Case for broken link ?*/
-			rc = smb_kern_path(name, 0, &path, 1);
+			rc = smb_share_kern_path(smb_work->tcon, name, 0,
+					&path, 1);
 		}
 	}
 
+	/* ".." escape or too deep, do not go on to create it */
+	if (rc == -EXDEV || rc == -ENAMETOOLONG) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_INVALID;
+		rc = -EIO;
+		kfree(name);
+		goto err_out1;
+	}
+
+	/* no search permission on a parent directory */
+	if (rc == -EACCES) {
+		kfree(name);
+		goto err_out1;
+	}
+
 	if (rc) {
 		file_present = false;
 		cifsd_debug("can not get linux path for %s, rc = %d\n",
@@ -2239,7 +2342,8 @@ int smb2_open(struct smb_work *smb_work)
 				}
 			}
 
-			rc = smb_kern_path(name, 0, &path, 0);
+			rc = smb_share_kern_path(smb_work->tcon, name, 0,
+					&path, 0);
 			if (rc) {
 				cifsd_err("cannot get linux path (%s), err = %d\n",
 						name, rc);
@@ -2287,6 +2391,10 @@ int smb2_open(struct smb_work *smb_work)
 				rc);
 			goto err_out;
 		}
+
+		if (!stream && cifsd_tcon_stream_root(smb_work->tcon))
+			smb_vfs_stream_purge(&smb_work->tcon->share_path,
+					path.dentry->d_inode);
 	}
 
 	filp = dentry_open(&path, open_flags | O_LARGEFILE, current_cred());
@@ -2388,8 +2496,8 @@ int smb2_open(struct smb_work *smb_work)
 
 reconnect:
 	if (durable_reconnect) {
-		rc = cifsd_durable_reconnect(sess, durable_state,
-			&filp);
+		rc = cifsd_durable_reconnect(sess, persistent_id,
+			durable_state, &filp);
 		if (rc < 0) {
 			rsp->hdr.Status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
 			goto err_out1;
@@ -2413,22 +2521,23 @@ reconnect:
 	}
 
 	/* Obtain Volatile-ID */
-	volatile_id = cifsd_get_unused_id(&sess->fidtable);
-	if (volatile_id < 0) {
+	rc = cifsd_get_unused_id(&sess->fidtable);
+	if (rc < 0) {
 		cifsd_err("failed to get unused volatile_id for file\n");
-		rc = volatile_id;
 		goto err_out;
 	}
 
-	cifsd_debug("volatile_id returned: %d\n", volatile_id);
 	fp = insert_id_in_fidtable(smb_work->sess, sess->sess_id,
-		le32_to_cpu(req->hdr.Id.SyncId.TreeId), volatile_id, filp);
+		le32_to_cpu(req->hdr.Id.SyncId.TreeId), rc, filp);
 	if (fp == NULL) {
 		cifsd_err("volatile_id insert failed\n");
-		cifsd_close_id(&sess->fidtable, volatile_id);
+		cifsd_close_id(&sess->fidtable, rc);
 		rc = -ENOMEM;
 		goto err_out;
 	}
+	volatile_id = fp->volatile_id;
+	rc = 0;
+	cifsd_debug("volatile_id returned: %llu\n", volatile_id);
 
 	if (S_ISDIR(stat.mode))
 		fp->readdir_data.dirent = NULL;
@@ -2442,20 +2551,28 @@ reconnect:
 	fp->coption = req->CreateOptions;
 	fp->fattr = req->FileAttributes;
 	INIT_LIST_HEAD(&fp->lock_list);
+	smb_vfs_init_cache_mode(fp, smb_work->tcon);
+	if (get_attr_stream_files(&smb_work->tcon->share->config.attr)) {
+		fp->stream_root = smb_work->tcon->share_path;
+		path_get(&fp->stream_root);
+		/* a reused inode number and generation may find stale streams */
+		if (file_info == FILE_CREATED)
+			smb_vfs_stream_purge(&fp->stream_root,
+					file_inode(filp));
+	}
 
 	if (islink) {
 		fp->lfilp = lfilp;
 		fp->islink = islink;
 	}
 
-	if (!S_ISDIR(file_inode(filp)->i_mode)) {
-		/* Create default stream in xattr */
-		smb_store_cont_xattr(&path, XATTR_NAME_STREAM, NULL, 0);
-	}
+	/* Create default stream in xattr */
+	if (!S_ISDIR(file_inode(filp)->i_mode))
+		smb_inode_meta_init_stream(&path);
 
 	if (stream) {
 		stream_size = strlen(stream);
-		stream_name = kmalloc(XATTR_NAME_STREAM_LEN + stream_size,
+		stream_name = kmalloc(XATTR_NAME_STREAM_LEN + stream_size + 1,
 				GFP_KERNEL);
 		memcpy(stream_name, XATTR_NAME_STREAM, XATTR_NAME_STREAM_LEN);
 
@@ -2467,7 +2584,32 @@ reconnect:
 		fp->is_stream = true;
 		fp->stream_name = stream_name;
 		fp->ssize = XATTR_NAME_STREAM_LEN + stream_size;
+	}
+
+	if (stream && stream_size && fp->stream_root.dentry) {
+		struct file *sfilp;
+		bool created = false;
+
+		sfilp = smb_vfs_stream_open(&fp->stream_root,
+				path.dentry->d_inode, stream,
+				open_flags & (O_ACCMODE | O_TRUNC),
+				fp->cdoption != FILE_OPEN_LE &&
+				smb_work->tcon->writeable, &created);
+		if (IS_ERR(sfilp)) {
+			rc = PTR_ERR(sfilp);
+			cifsd_err("failed to open stream file, rc : %d\n", rc);
+			if (rc == -ENOENT) {
+				rsp->hdr.Status =
+					NT_STATUS_OBJECT_NAME_NOT_FOUND;
+				rc = -EIO;
+			}
+			goto err_out;
+		}
 
+		fp->stream_filp = sfilp;
+		if (created)
+			file_info = FILE_CREATED;
+	} else if (stream) {
 		/* Check if there is stream prefix in xattr space */
 		rc = smb_find_cont_xattr(&path, stream_name,
 				stream_size + XATTR_NAME_STREAM_LEN, NULL, 0);
@@ -2587,31 +2729,9 @@ reconnect:
 	rsp->Reserved = 0;
 	rsp->CreateAction = file_info;
 
-	if (file_present) {
-
-		fp->create_time = cifs_UnixTimeToNT(stat.ctime);
-		if (get_attr_store_dos(&smb_work->tcon->share->config.attr)) {
-			char *create_time = NULL;
-
-			rc = smb_find_cont_xattr(&path,
-				XATTR_NAME_CREATION_TIME,
-				XATTR_NAME_CREATION_TIME_LEN, &create_time, 1);
-			if (rc > 0)
-				fp->create_time = *create_time;
-			kvfree(create_time);
-			rc = 0;
-		}
-	} else {
-		fp->create_time = cifs_UnixTimeToNT(stat.ctime);
-		if (get_attr_store_dos(&smb_work->tcon->share->config.attr)) {
-			rc = smb_store_cont_xattr(&path,
-				XATTR_NAME_CREATION_TIME,
-				(void *)&fp->create_time, CREATIOM_TIME_LEN);
-			if (rc)
-				cifsd_debug("failed to store creation time in EA\n");
-			rc = 0;
-		}
-	}
+	fp->create_time = smb_get_create_time(&path, &stat,
+			get_attr_store_dos(&smb_work->tcon->share->config.attr),
+			!file_present);
 
 	rsp->CreationTime = cpu_to_le64(fp->create_time);
 	rsp->LastAccessTime = cpu_to_le64(cifs_UnixTimeToNT(stat.atime));
@@ -2721,7 +2841,6 @@ err_out1:
 		if (fp != NULL) {
 			filp_close(filp, (struct files_struct *)filp);
 			delete_id_from_fidtable(sess, volatile_id);
-			cifsd_close_id(&sess->fidtable, volatile_id);
 		}
 		smb2_set_err_rsp(smb_work);
 	} else
@@ -2731,48 +2850,102 @@ err_out1:
 }
 
 /**
- * smb2_populate_readdir_entry() - encode directory entry in smb2 response buffer
+ * smb2_dir_info_size() - fixed size of a directory information class
+ * @info_level:	smb information level
+ *
+ * Return:	size of the entry without its name, otherwise error
+ */
+static int smb2_dir_info_size(int info_level)
+{
+	switch (info_level) {
+	case FILE_FULL_DIRECTORY_INFORMATION:
+		return sizeof(FILE_FULL_DIRECTORY_INFO);
+	case FILE_BOTH_DIRECTORY_INFORMATION:
+		return sizeof(FILE_BOTH_DIRECTORY_INFO);
+	case FILE_DIRECTORY_INFORMATION:
+		return sizeof(FILE_DIRECTORY_INFO);
+	case FILE_NAMES_INFORMATION:
+		return sizeof(FILE_NAMES_INFO);
+	case FILEID_FULL_DIRECTORY_INFORMATION:
+		return sizeof(SEARCH_ID_FULL_DIR_INFO);
+	case FILEID_BOTH_DIRECTORY_INFORMATION:
+		return sizeof(FILE_ID_BOTH_DIRECTORY_INFO);
+	}
+	return -EOPNOTSUPP;
+}
+
+/**
+ * smb2_dir_entry_advance() - account an encoded directory entry
+ * @p:		smb response buffer pointer, moved past the entry
+ * @next_entry_offset:	aligned size of the entry
+ * @buf_len:	response buffer length
+ * @last_entry_offset:	offset of last entry in directory
+ * @data_count:	used buffer size
+ */
+static void smb2_dir_entry_advance(char **p, int next_entry_offset,
+		int *buf_len, int *last_entry_offset, int *data_count)
+{
+	*last_entry_offset = *data_count;
+	*data_count += next_entry_offset;
+	*buf_len -= next_entry_offset;
+	*p =  (char *)(*p) + next_entry_offset;
+	cifsd_debug("buf_len :%d, next_offset : %d, data_count : %d\n",
+			*buf_len, next_entry_offset, *data_count);
+}
+
+/**
+ * smb2_encode_dir_entry() - encode directory entry with a UTF-16 name
  * @server:	TCP server instance of connection
  * @info_level:	smb information level
  * @p:		smb response buffer pointer
  * @namestr:	dirent name string
+ * @uni:	@namestr already encoded in UTF-16
+ * @uni_len:	length of @uni in bytes, without the terminator
  * @buf_len:	response buffer length
  * @last_entry_offset:	offset of last entry in directory
  * @kstat:	dirent stat information
  * @data_count:	used buffer size
  *
- * if directory has many entries, find first can't read it fully.
- * find next might be called multiple times to read remaining dir entries
+ * If the entry does not fit, @buf_len is set to -1 and nothing is written.
+ * @uni may already sit at the name offset of the entry being encoded.
  *
  * Return:	0 on success, otherwise error
  */
-static int smb2_populate_readdir_entry(struct tcp_server_info *server,
-	int info_level, char **p, char *namestr, int *buf_len,
-		int *last_entry_offset,	struct kstat *kstat, int *data_count)
+static int smb2_encode_dir_entry(struct tcp_server_info *server,
+	int info_level, char **p, char *namestr, __le16 *uni, int uni_len,
+	int *buf_len, int *last_entry_offset, struct kstat *kstat,
+	__u64 create_time, int *data_count)
 {
-	int name_len;
+	int name_len = uni_len + 2; /* for NULL character */
 	int next_entry_offset;
-	char *utfname = NULL;
+	int size;
+
+	size = smb2_dir_info_size(info_level);
+	if (size < 0) {
+		cifsd_err("%s: failed\n", __func__);
+		return -EOPNOTSUPP;
+	}
+
+	next_entry_offset = (size - 1 + name_len + 7) & ~7;
+	if (next_entry_offset > *buf_len) {
+		cifsd_debug("buf_len : %d next_entry_offset : %d"
+				" data_count : %d\n", *buf_len,
+				next_entry_offset, *data_count);
+		*buf_len = -1;
+		return 0;
+	}
 
 	switch (info_level) {
 	case FILE_FULL_DIRECTORY_INFORMATION:
 	{
 		FILE_FULL_DIRECTORY_INFO *ffdinfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(FILE_FULL_DIRECTORY_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
-
 		ffdinfo = (FILE_FULL_DIRECTORY_INFO *)
-				fill_common_info(p, kstat);
+				fill_common_info(p, kstat, create_time);
 		ffdinfo->FileNameLength = cpu_to_le32(name_len);
 		ffdinfo->EaSize = 0;
 
-		memcpy(ffdinfo->FileName, utfname, name_len);
+		memmove(ffdinfo->FileName, uni, uni_len);
 		ffdinfo->FileName[name_len - 2] = 0;
 		ffdinfo->FileName[name_len - 1] = 0;
 		ffdinfo->NextEntryOffset = next_entry_offset;
@@ -2782,21 +2955,14 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 	{
 		FILE_BOTH_DIRECTORY_INFO *fbdinfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(FILE_BOTH_DIRECTORY_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
 		fbdinfo = (FILE_BOTH_DIRECTORY_INFO *)
-				fill_common_info(p, kstat);
+				fill_common_info(p, kstat, create_time);
 		fbdinfo->FileNameLength = cpu_to_le32(name_len);
 		fbdinfo->EaSize = 0;
 		fbdinfo->ShortNameLength = 0;
 		fbdinfo->Reserved = 0;
 
-		memcpy(fbdinfo->FileName, utfname, name_len);
+		memmove(fbdinfo->FileName, uni, uni_len);
 		fbdinfo->FileName[name_len - 2] = 0;
 		fbdinfo->FileName[name_len - 1] = 0;
 		fbdinfo->NextEntryOffset = next_entry_offset;
@@ -2806,18 +2972,11 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 	{
 		FILE_DIRECTORY_INFO *fdinfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(FILE_DIRECTORY_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
-
-		fdinfo = (FILE_DIRECTORY_INFO *)fill_common_info(p, kstat);
+		fdinfo = (FILE_DIRECTORY_INFO *)fill_common_info(p, kstat,
+				create_time);
 		fdinfo->FileNameLength = cpu_to_le32(name_len);
 
-		memcpy(fdinfo->FileName, utfname, name_len);
+		memmove(fdinfo->FileName, uni, uni_len);
 		fdinfo->FileName[name_len - 2] = 0;
 		fdinfo->FileName[name_len - 1] = 0;
 		fdinfo->NextEntryOffset = next_entry_offset;
@@ -2827,18 +2986,12 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 	{
 		FILE_NAMES_INFO *fninfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(FILE_NAMES_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
-
-		fninfo = (FILE_NAMES_INFO *)fill_common_info(p, kstat);
+		/* too short for fill_common_info(), it would hit the name */
+		fninfo = (FILE_NAMES_INFO *)(*p);
+		fninfo->FileIndex = 0;
 		fninfo->FileNameLength = cpu_to_le32(name_len);
 
-		memcpy(fninfo->FileName, utfname, name_len);
+		memmove(fninfo->FileName, uni, uni_len);
 		fninfo->FileName[name_len - 2] = 0;
 		fninfo->FileName[name_len - 1] = 0;
 		fninfo->NextEntryOffset = next_entry_offset;
@@ -2848,21 +3001,14 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 	{
 		SEARCH_ID_FULL_DIR_INFO *dinfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(SEARCH_ID_FULL_DIR_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
-
-		dinfo = (SEARCH_ID_FULL_DIR_INFO *)fill_common_info(p, kstat);
+		dinfo = (SEARCH_ID_FULL_DIR_INFO *)fill_common_info(p, kstat,
+				create_time);
 		dinfo->FileNameLength = cpu_to_le32(name_len);
 		dinfo->EaSize = 0;
 		dinfo->Reserved = 0;
 		dinfo->UniqueId = cpu_to_le64(kstat->ino);
 
-		memcpy(dinfo->FileName, utfname, name_len);
+		memmove(dinfo->FileName, uni, uni_len);
 		dinfo->FileName[name_len - 2] = 0;
 		dinfo->FileName[name_len - 1] = 0;
 		dinfo->NextEntryOffset = next_entry_offset;
@@ -2872,16 +3018,8 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 	{
 		FILE_ID_BOTH_DIRECTORY_INFO *fibdinfo;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
-					sizeof(FILE_ID_BOTH_DIRECTORY_INFO),
-					server->local_nls, &name_len,
-					&next_entry_offset,
-					buf_len, data_count, 7);
-		if (!utfname)
-			break;
-
 		fibdinfo = (FILE_ID_BOTH_DIRECTORY_INFO *)
-			fill_common_info(p, kstat);
+			fill_common_info(p, kstat, create_time);
 		fibdinfo->FileNameLength = cpu_to_le32(name_len);
 		fibdinfo->EaSize = 0;
 		fibdinfo->UniqueId = cpu_to_le64(kstat->ino);
@@ -2891,32 +3029,263 @@ static int smb2_populate_readdir_entry(struct tcp_server_info *server,
 		fibdinfo->Reserved = 0;
 		fibdinfo->Reserved2 = cpu_to_le16(0);
 
-		memcpy(fibdinfo->FileName, utfname, name_len);
+		memmove(fibdinfo->FileName, uni, uni_len);
 		fibdinfo->FileName[name_len - 2] = 0;
 		fibdinfo->FileName[name_len - 1] = 0;
 		fibdinfo->NextEntryOffset = next_entry_offset;
 		break;
 	}
-	default:
+	}
+
+	smb2_dir_entry_advance(p, next_entry_offset, buf_len,
+			last_entry_offset, data_count);
+	return 0;
+}
+
+/**
+ * smb2_populate_readdir_entry() - encode directory entry in smb2 response buffer
+ * @server:	TCP server instance of connection
+ * @info_level:	smb information level
+ * @p:		smb response buffer pointer
+ * @namestr:	dirent name string
+ * @buf_len:	response buffer length
+ * @last_entry_offset:	offset of last entry in directory
+ * @kstat:	dirent stat information
+ * @create_time:	dirent creation time
+ * @data_count:	used buffer size
+ * @scratch:	search handle scratch area from smb_srch_scratch()
+ *
+ * if directory has many entries, find first can't read it fully.
+ * find next might be called multiple times to read remaining dir entries
+ *
+ * The name is encoded straight to its place in the response when even
+ * its longest UTF-16 form fits there, otherwise in @scratch first.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_populate_readdir_entry(struct tcp_server_info *server,
+	int info_level, char **p, char *namestr, int *buf_len,
+		int *last_entry_offset,	struct kstat *kstat, __u64 create_time,
+		int *data_count, char *scratch)
+{
+	int size = smb2_dir_info_size(info_level);
+	int worst = (strlen(namestr) + 1) * 2;
+	__le16 *uni;
+	int uni_len;
+
+	if (size > 0 && ((size - 1 + worst + 7) & ~7) <= *buf_len)
+		uni = (__le16 *)(*p + size - 1);
+	else
+		uni = (__le16 *)SRCH_SCRATCH_UNI(scratch);
+
+	uni_len = smbConvertToUTF16(uni, namestr, PATH_MAX,
+			server->local_nls, 0) * 2;
+	return smb2_encode_dir_entry(server, info_level, p, namestr, uni,
+			uni_len, buf_len, last_entry_offset, kstat, create_time,
+			data_count);
+}
+
+/**
+ * smb2_encode_snap_entry() - encode a directory snapshot entry
+ * @server:	TCP server instance of connection
+ * @dir_fp:	directory handle being searched
+ * @ent:	snapshot entry
+ * @dentry:	dentry of the entry
+ * @info_level:	smb information level
+ * @store_dos:	the share keeps creation times in xattrs
+ * @p:		smb response buffer pointer
+ * @buf_len:	response buffer length
+ * @last_entry_offset:	offset of last entry in directory
+ * @data_count:	used buffer size
+ *
+ * The fixed part of the record is copied from the snapshot while the
+ * child is unchanged since it was encoded. Otherwise it is built from a
+ * fresh stat and kept in the snapshot for the next enumeration.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_encode_snap_entry(struct tcp_server_info *server,
+		struct cifsd_file *dir_fp, struct cifsd_snap_ent *ent,
+		struct dentry *dentry, int info_level, bool store_dos,
+		char **p, int *buf_len, int *last_entry_offset,
+		int *data_count)
+{
+	struct inode *inode = dentry->d_inode;
+	struct path path = {
+		.mnt = dir_fp->filp->f_path.mnt,
+		.dentry = dentry
+	};
+	struct cifsd_snap_attr sample;
+	struct kstat kstat;
+	__u64 create_time;
+	char *rec = *p;
+	int size, next_entry_offset, rc;
+	bool settled;
+
+	size = smb2_dir_info_size(info_level);
+	if (size < 0) {
 		cifsd_err("%s: failed\n", __func__);
 		return -EOPNOTSUPP;
 	}
 
-	if (utfname) {
-		*last_entry_offset = *data_count;
-		*data_count += next_entry_offset;
-		*buf_len -= next_entry_offset;
-		*p =  (char *)(*p) + next_entry_offset;
-		kfree(utfname);
+	next_entry_offset = (size - 1 + ent->uni_len + 2 + 7) & ~7;
+	if (next_entry_offset <= *buf_len &&
+			smb_dir_snap_attr_get(dir_fp->dir_snap, ent, inode,
+				info_level, rec, size - 1)) {
+		memcpy(rec + size - 1, SNAP_ENT_UNI(ent), ent->uni_len);
+		rec[size - 1 + ent->uni_len] = 0;
+		rec[size + ent->uni_len] = 0;
+		smb2_dir_entry_advance(p, next_entry_offset, buf_len,
+				last_entry_offset, data_count);
+		return 0;
+	}
+
+	settled = smb_dir_snap_attr_sample(&sample, inode);
+	generic_fillattr(inode, &kstat);
+	create_time = smb_get_create_time(&path, &kstat, store_dos, false);
+	rc = smb2_encode_dir_entry(server, info_level, p, ent->name,
+			SNAP_ENT_UNI(ent), ent->uni_len, buf_len,
+			last_entry_offset, &kstat, create_time, data_count);
+	if (!rc && *buf_len >= 0 && settled)
+		smb_dir_snap_attr_set(dir_fp->dir_snap, ent, &sample,
+				info_level, rec, size - 1);
+	return rc;
+}
+
+/**
+ * smb2_query_dir_snap() - fill a query directory response from a snapshot
+ * @server:	TCP server instance of connection
+ * @dir_fp:	directory handle being searched
+ * @info_level:	requested file information class
+ * @single:	return at most one entry
+ * @hide_stream_dir:	leave out the sidecar stream store
+ * @store_dos:	the share keeps creation times in xattrs
+ * @bufptr:	response buffer pointer
+ * @out_buf_len:	response buffer length left
+ * @num_entry:	offset of the last entry in the response
+ * @data_count:	used response buffer size
+ *
+ * Names and their UTF-16 encoding come from the shared snapshot, and so
+ * do the records of entries unchanged since they were last encoded. The
+ * handle drops its snapshot reference once the end is reached.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_query_dir_snap(struct tcp_server_info *server,
+		struct cifsd_file *dir_fp, int info_level, bool single,
+		bool hide_stream_dir, bool store_dos, char **bufptr,
+		int *out_buf_len, int *num_entry, int *data_count)
+{
+	struct cifsd_snap_ent *ent;
+	struct dentry *dentry;
+	unsigned int pos = dir_fp->snap_pos;
+	int rc;
+
+	while ((ent = smb_dir_snap_next(dir_fp->dir_snap, &pos))) {
+		if ((hide_stream_dir &&
+			smb_is_stream_dir_name(ent->name, ent->namelen)) ||
+				!smb_srch_match(dir_fp->srch_pattern, ent->name,
+					ent->namelen)) {
+			dir_fp->snap_pos = pos;
+			continue;
+		}
+
+		dentry = smb_vfs_child_lookup(dir_fp->filp, ent->name,
+				ent->namelen);
+		if (IS_ERR(dentry)) {
+			dir_fp->snap_pos = pos;
+			continue;
+		}
+
+		rc = smb2_encode_snap_entry(server, dir_fp, ent, dentry,
+				info_level, store_dos, bufptr, out_buf_len,
+				num_entry, data_count);
+		dput(dentry);
+		if (rc)
+			return rc;
+		if (*out_buf_len < 0)
+			break;
+
+		dir_fp->snap_pos = pos;
+		if (single)
+			break;
 	}
-	cifsd_debug("info_level : %d, buf_len :%d,"
-			" next_offset : %d, data_count : %d\n",
-			info_level, *buf_len,
-			next_entry_offset, *data_count);
 
+	if (!ent) {
+		smb_dir_snap_put(dir_fp->dir_snap);
+		dir_fp->dir_snap = NULL;
+		dir_fp->srch_done = true;
+	}
 	return 0;
 }
 
+/**
+ * smb2_query_dir_exact() - check if a search can skip the directory scan
+ * @sp:		compiled search pattern
+ *
+ * Return:	true if @sp names a single child that a lookup can resolve
+ */
+static bool smb2_query_dir_exact(struct cifsd_srch_pattern *sp)
+{
+	return sp->type == CIFSD_SRCH_EXACT && strcmp(sp->pat, ".") &&
+		strcmp(sp->pat, "..");
+}
+
+/**
+ * smb2_query_dir_lookup() - answer an exact name search with a lookup
+ * @server:	TCP server instance of connection
+ * @dir_fp:	directory handle being searched
+ * @info_level:	requested file information class
+ * @hide_stream_dir:	leave out the sidecar stream store
+ * @store_dos:	the share keeps creation times in xattrs
+ * @bufptr:	response buffer pointer
+ * @out_buf_len:	response buffer length left
+ * @num_entry:	offset of the last entry in the response
+ * @data_count:	used response buffer size
+ *
+ * The child is resolved relative to the open directory, caselessly on a
+ * miss, instead of scanning the directory for it. It is returned once;
+ * later queries on the handle find nothing until the scan is restarted.
+ *
+ * Return:	0 on success or if the name does not exist, otherwise error
+ */
+static int smb2_query_dir_lookup(struct tcp_server_info *server,
+		struct cifsd_file *dir_fp, int info_level, bool hide_stream_dir,
+		bool store_dos, char **bufptr, int *out_buf_len,
+		int *num_entry, int *data_count)
+{
+	struct cifsd_srch_pattern *sp = dir_fp->srch_pattern;
+	char *name = dir_fp->srch_scratch;
+	struct kstat kstat;
+	__u64 create_time;
+	int rc;
+
+	if (dir_fp->srch_done)
+		return 0;
+
+	if (sp->len > NAME_MAX) {
+		dir_fp->srch_done = true;
+		return 0;
+	}
+
+	memcpy(name, sp->pat, sp->len + 1);
+	rc = smb_dir_lookup(dir_fp->filp, name, true, &kstat, store_dos,
+			&create_time);
+	if (rc || (hide_stream_dir &&
+			smb_is_stream_dir_name(name, strlen(name)))) {
+		cifsd_debug("%s not found in directory: %d\n", name, rc);
+		dir_fp->srch_done = true;
+		return 0;
+	}
+
+	rc = smb2_populate_readdir_entry(server, info_level, bufptr, name,
+			out_buf_len, num_entry, &kstat, create_time, data_count,
+			name);
+	if (!rc && *out_buf_len >= 0)
+		dir_fp->srch_done = true;
+	return rc;
+}
+
 /**
  * smb2_query_dir() - handler for smb2 readdir i.e. query dir command
  * @smb_work:	smb work containing query dir request buffer
@@ -2937,8 +3306,12 @@ int smb2_query_dir(struct smb_work *smb_work)
 	int rc = 0;
 	uint64_t id = -1;
 	struct kstat kstat;
-	char *dirpath, *bufptr, *namestr, *srch_ptr = NULL, *path = NULL;
+	__u64 create_time;
+	char *bufptr, *namestr, *srch_ptr = NULL;
 	unsigned char srch_flag;
+	bool new_scan = false;
+	bool store_dos =
+		get_attr_store_dos(&smb_work->tcon->share->config.attr);
 	struct smb_readdir_data r_data = {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 		.ctx.actor = smb_filldir,
@@ -3013,47 +3386,47 @@ int smb2_query_dir(struct smb_work *smb_work)
 	} else
 		cifsd_debug("Search pattern is %s\n", srch_ptr);
 
-	path = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!path) {
-		cifsd_err("Failed to allocate memory\n");
-		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
-		rc = -ENOMEM;
-		kfree(srch_ptr);
-		goto err_out2;
-	}
-
-	dirpath = d_path(&(dir_fp->filp->f_path), path, PATH_MAX);
-	if (IS_ERR(dirpath)) {
-		cifsd_err("Failed to get complete dir path\n");
-		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
-		rc = PTR_ERR(dirpath);
-		goto err_out;
-	}
-	cifsd_debug("Directory name is %s\n", dirpath);
+	/*
+	 * The pattern given with the first query of a handle, or with a
+	 * restart or reopen, is used until the next restart.
+	 */
+	if (!dir_fp->srch_pattern ||
+			srch_flag & (SMB2_RESTART_SCANS | SMB2_REOPEN)) {
+		struct cifsd_srch_pattern *sp;
 
-	if (!dir_fp->readdir_data.dirent) {
-		dir_fp->readdir_data.dirent =
-			(void *)__get_free_page(GFP_KERNEL);
-		if (!dir_fp->readdir_data.dirent) {
-			cifsd_err("Failed to allocate memory\n");
+		sp = smb_srch_compile(srch_ptr);
+		if (!sp) {
 			rsp->hdr.Status = NT_STATUS_NO_MEMORY;
 			rc = -ENOMEM;
-			goto err_out;
+			kfree(srch_ptr);
+			goto err_out2;
 		}
-		dir_fp->readdir_data.used = 0;
-		dir_fp->readdir_data.full = 0;
-		dir_fp->dirent_offset = 0;
+		kfree(dir_fp->srch_pattern);
+		dir_fp->srch_pattern = sp;
+		dir_fp->srch_done = false;
+		new_scan = true;
+	}
+
+	if (!smb_srch_scratch(dir_fp)) {
+		cifsd_err("Failed to allocate memory\n");
+		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
+		rc = -ENOMEM;
+		goto err_out;
 	}
 
 	if (srch_flag & SMB2_REOPEN) {
+		struct file *filp;
+
 		cifsd_debug("Reopen the directory\n");
-		filp_close(dir_fp->filp, NULL);
-		dir_fp->filp = filp_open(dirpath, O_RDONLY, 0666);
-		if (!dir_fp->filp) {
+		filp = dentry_open(&dir_fp->filp->f_path, O_RDONLY,
+				current_cred());
+		if (IS_ERR(filp)) {
 			cifsd_debug("Reopening dir failed\n");
-			rc = -EINVAL;
+			rc = PTR_ERR(filp);
 			goto err_out;
 		}
+		filp_close(dir_fp->filp, NULL);
+		dir_fp->filp = filp;
 		dir_fp->readdir_data.used = 0;
 		dir_fp->dirent_offset = 0;
 	}
@@ -3073,13 +3446,76 @@ int smb2_query_dir(struct smb_work *smb_work)
 		dir_fp->dirent_offset = le32_to_cpu(req->FileIndex);
 	}
 
-	r_data.dirent = dir_fp->readdir_data.dirent;
-	bufptr = (char *)rsp->Buffer;
-	out_buf_len = min_t(int,(SMBMaxBufSize + MAX_HEADER_SIZE(server) -
-			(get_rfc1002_length(rsp_org) + 4)),
-			le32_to_cpu(req->OutputBufferLength)) -
-		sizeof(struct smb2_query_directory_rsp);
-
+	/*
+	 * A new scan enumerates the shared snapshot of the directory if it
+	 * can be cached, a specified index only makes sense on the filp.
+	 */
+	if (new_scan || srch_flag & SMB2_INDEX_SPECIFIED) {
+		if (dir_fp->dir_snap) {
+			smb_dir_snap_put(dir_fp->dir_snap);
+			dir_fp->dir_snap = NULL;
+		}
+		dir_fp->snap_pos = 0;
+		if (!smb2_query_dir_exact(dir_fp->srch_pattern)) {
+			dir_fp->srch_done = false;
+			if (!(srch_flag & SMB2_INDEX_SPECIFIED))
+				dir_fp->dir_snap = smb_dir_snap_get(
+						dir_fp->filp,
+						server->local_nls);
+		}
+	}
+
+	/*
+	 * Size the staging buffer to the client's output buffer so that one
+	 * iterate_dir() pass stages at least a full response. Staged records
+	 * are smaller than the info levels built from them.
+	 */
+	if (!dir_fp->dir_snap && (!dir_fp->readdir_data.dirent ||
+			dir_fp->dirent_offset >= dir_fp->readdir_data.used)) {
+		rc = smb_vfs_readdir_buf(&dir_fp->readdir_data,
+				le32_to_cpu(req->OutputBufferLength));
+		if (rc) {
+			cifsd_err("Failed to allocate memory\n");
+			rsp->hdr.Status = NT_STATUS_NO_MEMORY;
+			goto err_out;
+		}
+	}
+
+	r_data.dirent = dir_fp->readdir_data.dirent;
+	r_data.size = dir_fp->readdir_data.size;
+	r_data.hide_stream_dir = dir_fp->filp->f_path.dentry ==
+		smb_work->tcon->share_path.dentry;
+	bufptr = (char *)rsp->Buffer;
+	out_buf_len = min_t(int,(SMBMaxBufSize + MAX_HEADER_SIZE(server) -
+			(get_rfc1002_length(rsp_org) + 4)),
+			le32_to_cpu(req->OutputBufferLength)) -
+		sizeof(struct smb2_query_directory_rsp);
+
+	if (smb2_query_dir_exact(dir_fp->srch_pattern)) {
+		rc = smb2_query_dir_lookup(server, dir_fp,
+				req->FileInformationClass,
+				r_data.hide_stream_dir, store_dos, &bufptr,
+				&out_buf_len, &num_entry, &data_count);
+		if (rc)
+			goto err_out;
+		goto out;
+	}
+
+	/* a snapshot enumeration already reached the end */
+	if (dir_fp->srch_done)
+		goto out;
+
+	if (dir_fp->dir_snap) {
+		rc = smb2_query_dir_snap(server, dir_fp,
+				req->FileInformationClass,
+				srch_flag & SMB2_RETURN_SINGLE_ENTRY,
+				r_data.hide_stream_dir, store_dos, &bufptr,
+				&out_buf_len, &num_entry, &data_count);
+		if (rc)
+			goto err_out;
+		goto out;
+	}
+
 	do {
 		if (dir_fp->dirent_offset >= dir_fp->readdir_data.used) {
 			dir_fp->dirent_offset = 0;
@@ -3095,9 +3531,7 @@ int smb2_query_dir(struct smb_work *smb_work)
 			dir_fp->readdir_data.used = r_data.used;
 			dir_fp->readdir_data.full = r_data.full;
 			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
+				smb_vfs_readdir_buf_free(&dir_fp->readdir_data);
 				break;
 			}
 
@@ -3113,7 +3547,12 @@ int smb2_query_dir(struct smb_work *smb_work)
 				sizeof(__le64));
 		dir_fp->dirent_offset += reclen;
 
-		namestr = read_next_entry(&kstat, de, dirpath);
+		if (!smb_srch_match(dir_fp->srch_pattern, de->name,
+					de->namelen))
+			continue;
+
+		namestr = read_next_entry(&kstat, de, dir_fp->filp,
+				dir_fp->srch_scratch, store_dos, &create_time);
 		if (IS_ERR(namestr)) {
 			rc = PTR_ERR(namestr);
 			cifsd_debug("Err while dirent read rc = %d\n", rc);
@@ -3121,29 +3560,11 @@ int smb2_query_dir(struct smb_work *smb_work)
 			continue;
 		}
 
-		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY) {
-			cifsd_debug("Single entry requested\n");
-#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
-			if (strncmp(srch_ptr, "*", 1) &&
-					(strlen(srch_ptr) != de->namelen ||
-					 strncasecmp(de->name, srch_ptr,
-						 de->namelen))) {
-#else
-			if (strncmp(srch_ptr, "*", 1) &&
-					(strlen(srch_ptr) != de->namelen ||
-					 strnicmp(de->name, srch_ptr,
-						 de->namelen))) {
-#endif
-					kfree(namestr);
-					continue;
-			}
-		}
-
 		rc = smb2_populate_readdir_entry(server,
 				req->FileInformationClass, &bufptr,
 				namestr, &out_buf_len, &num_entry,
-				&kstat, &data_count);
-		kfree(namestr);
+				&kstat, create_time, &data_count,
+				dir_fp->srch_scratch);
 		if (rc)
 			goto err_out;
 
@@ -3154,9 +3575,10 @@ int smb2_query_dir(struct smb_work *smb_work)
 	if (out_buf_len < 0)
 		dir_fp->dirent_offset -= reclen;
 
+out:
 	if (!data_count) {
-		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY
-				&& strncmp(srch_ptr, "*", 1))
+		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY &&
+				dir_fp->srch_pattern->type != CIFSD_SRCH_ALL)
 			rsp->hdr.Status = STATUS_OBJECT_NAME_NOT_FOUND;
 
 		if (smb_work->next_smb2_rcv_hdr_off)
@@ -3179,20 +3601,18 @@ int smb2_query_dir(struct smb_work *smb_work)
 		inc_rfc1001_len(rsp_org, 8 + data_count);
 	}
 
-	kfree(path);
+	cifsd_fp_put(dir_fp);
 	kfree(srch_ptr);
 	return 0;
 
 err_out:
 	cifsd_err("error while processing smb2 query dir rc = %d\n", rc);
-	kfree(path);
 	kfree(srch_ptr);
 
 err_out2:
-	if (dir_fp && dir_fp->readdir_data.dirent) {
-		free_page((unsigned long)
-				(dir_fp->readdir_data.dirent));
-		dir_fp->readdir_data.dirent = NULL;
+	if (dir_fp) {
+		smb_vfs_readdir_buf_free(&dir_fp->readdir_data);
+		cifsd_fp_put(dir_fp);
 	}
 
 	if (rsp->hdr.Status == 0)
@@ -3683,6 +4103,100 @@ int buffer_check_err(int reqOutputBufferLength, struct smb2_query_info_rsp *rsp,
 	return 0;
 }
 
+/**
+ * smb2_get_stream_files() - append sidecar streams to a stream info list
+ * @smb_work:	smb work containing query info request buffer
+ * @fp:		cifsd file pointer of the base file
+ * @buf:	FILE_STREAM_INFORMATION buffer
+ * @nbytes:	bytes already used in @buf
+ * @max:	size of @buf
+ * @last:	last entry in @buf, updated as entries are appended
+ *
+ * Return:	bytes used in @buf
+ */
+static int smb2_get_stream_files(struct smb_work *smb_work,
+		struct cifsd_file *fp, char *buf, int nbytes, int max,
+		struct smb2_file_stream_info **last)
+{
+	struct smb_readdir_data r_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+	};
+	struct smb2_file_stream_info *file_info;
+	struct smb_dirent *de;
+	struct file *dirp;
+	char *stream_buf;
+	loff_t size;
+	int i, streamlen, next;
+
+	dirp = smb_vfs_stream_dir_open(&fp->stream_root, GET_FP_INODE(fp));
+	if (IS_ERR(dirp))
+		return nbytes;
+
+	stream_buf = kmalloc(NAME_MAX + sizeof("::$DATA"), GFP_KERNEL);
+	r_data.dirent = (void *)__get_free_page(GFP_KERNEL);
+	r_data.size = PAGE_SIZE;
+	if (!stream_buf || !r_data.dirent)
+		goto out;
+
+	do {
+		r_data.used = 0;
+		r_data.full = 0;
+		r_data.dirent_count = 0;
+		smb_vfs_readdir(dirp, smb_filldir, &r_data);
+
+		de = (struct smb_dirent *)r_data.dirent;
+		for (i = 0; i < r_data.dirent_count; i++) {
+			if (de->namelen > NAME_MAX ||
+				(de->namelen == 1 && de->name[0] == '.') ||
+				(de->namelen == 2 && !memcmp(de->name, "..", 2)))
+				goto next;
+
+			size = smb_vfs_stream_size(dirp, de->name,
+					de->namelen);
+			if (size < 0)
+				goto next;
+
+			streamlen = snprintf(stream_buf,
+					NAME_MAX + sizeof("::$DATA"),
+					":%.*s:$DATA", de->namelen, de->name);
+			if (nbytes + sizeof(struct smb2_file_stream_info) +
+					streamlen * 2 > max)
+				goto out;
+
+			file_info = (struct smb2_file_stream_info *)
+				&buf[nbytes];
+			streamlen = smbConvertToUTF16(
+					(__le16 *)file_info->StreamName,
+					stream_buf, streamlen,
+					smb_work->server->local_nls, 0);
+			streamlen *= 2;
+
+			file_info->StreamNameLength = cpu_to_le32(streamlen);
+			file_info->StreamSize = cpu_to_le64(size);
+			file_info->StreamAllocationSize = cpu_to_le64(size);
+
+			next = sizeof(struct smb2_file_stream_info) +
+				streamlen;
+			file_info->NextEntryOffset = cpu_to_le32(next);
+			nbytes += next;
+			*last = file_info;
+next:
+			de = (struct smb_dirent *)((char *)de +
+				ALIGN(sizeof(struct smb_dirent) + de->namelen,
+					sizeof(u64)));
+		}
+	} while (r_data.full);
+
+out:
+	if (r_data.dirent)
+		free_page((unsigned long)r_data.dirent);
+	kfree(stream_buf);
+	fput(dirp);
+	return nbytes;
+}
+
 /**
  * smb2_info_file() - handler for smb2 query info command
  * @smb_work:	smb work containing query info request buffer
@@ -3738,11 +4252,17 @@ int smb2_info_file(struct smb_work *smb_work)
 			cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, req->PersistentFileId);
 			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-			return -ENOENT;
+			rc = -ENOENT;
+			goto out;
 		}
 
 		filp = fp->filp;
 		generic_fillattr(filp->f_path.dentry->d_inode, &stat);
+		if (fp->stream_filp) {
+			/* sizes of a named stream are those of its sidecar */
+			stat.size = i_size_read(file_inode(fp->stream_filp));
+			stat.blocks = file_inode(fp->stream_filp)->i_blocks;
+		}
 	}
 	fileinfoclass = req->FileInfoClass;
 
@@ -3769,7 +4289,8 @@ int smb2_info_file(struct smb_work *smb_work)
 			FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to read the attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 		basic_info = (struct smb2_file_all_info *)rsp->Buffer;
 
@@ -3835,7 +4356,8 @@ int smb2_info_file(struct smb_work *smb_work)
 			FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to read the attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		filename = (char *)filp->f_path.dentry->d_name.name;
@@ -3915,10 +4437,10 @@ int smb2_info_file(struct smb_work *smb_work)
 		xattr_list_len = smb_vfs_listxattr(path->dentry, &xattr_list,
 				XATTR_LIST_MAX);
 		if (xattr_list_len < 0) {
-			goto out;
+			goto stream_files;
 		} else if (!xattr_list_len) {
 			cifsd_debug("empty xattr in the file\n");
-			goto out;
+			goto stream_files;
 		}
 
 		for (stream_name = xattr_list;
@@ -3977,9 +4499,16 @@ int smb2_info_file(struct smb_work *smb_work)
 			file_info->NextEntryOffset = cpu_to_le32(next);
 		}
 
+stream_files:
+		if (fp->stream_root.dentry)
+			nbytes = smb2_get_stream_files(smb_work, fp,
+					rsp->Buffer, nbytes,
+					le32_to_cpu(req->OutputBufferLength),
+					&file_info);
+
 		/* last entry offset should be 0 */
-		file_info->NextEntryOffset = 0;
-out:
+		if (nbytes)
+			file_info->NextEntryOffset = 0;
 		if (xattr_list)
 			vfree(xattr_list);
 
@@ -4011,7 +4540,8 @@ out:
 			FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to read the attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		file_info = (struct smb2_file_ntwrk_info *)rsp->Buffer;
@@ -4053,13 +4583,14 @@ out:
 			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to read the extented attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		rc = smb2_get_ea(smb_work, &filp->f_path, req, rsp, rsp_org);
 		file_infoclass_size = FILE_FULL_EA_INFORMATION_SIZE;
 		if (rc < 0)
-			return rc;
+			goto out;
 		break;
 	case FILE_ALLOCATION_INFORMATION:
 	{
@@ -4136,10 +4667,13 @@ out:
 		cifsd_debug("fileinfoclass %d not supported yet\n",
 			fileinfoclass);
 		rsp->hdr.Status = NT_STATUS_NOT_SUPPORTED;
-		return -EOPNOTSUPP;
+		rc = -EOPNOTSUPP;
+		goto out;
 	}
 	rc = buffer_check_err(req->OutputBufferLength, rsp,
 					file_infoclass_size);
+out:
+	cifsd_fp_put(fp);
 	return rc;
 }
 
@@ -4464,6 +4998,12 @@ int smb2_create_link(struct smb_work *smb_work, struct file *filp)
 		goto out;
 	}
 
+	if (smb_is_stream_dir_path(smb_work->tcon, link_name)) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_INVALID;
+		rc = -EINVAL;
+		goto out;
+	}
+
 	cifsd_debug("link name is %s\n", link_name);
 	target_name = d_path(&filp->f_path, pathname, PATH_MAX);
 	if (IS_ERR(target_name)) {
@@ -4473,15 +5013,22 @@ int smb2_create_link(struct smb_work *smb_work, struct file *filp)
 	}
 
 	cifsd_debug("target name is %s\n", target_name);
-	rc = smb_kern_path(link_name, 0, &path, 0);
-	if (rc)
+	rc = smb_share_kern_path(smb_work->tcon, link_name, 0, &path, 0);
+	if (rc == -EXDEV || rc == -ENAMETOOLONG) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_INVALID;
+		goto out;
+	} else if (rc == -EACCES) {
+		rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+		goto out;
+	} else if (rc)
 		file_present = false;
 	else
 		path_put(&path);
 
 	if (file_info->ReplaceIfExists) {
 		if (file_present) {
-			rc = smb_vfs_unlink(link_name);
+			rc = smb_vfs_unlink(link_name,
+				cifsd_tcon_stream_root(smb_work->tcon));
 			if (rc) {
 				rsp->hdr.Status =
 					NT_STATUS_INVALID_PARAMETER;
@@ -4564,6 +5111,12 @@ int smb2_rename(struct smb_work *smb_work, struct file *filp, int old_fid)
 		goto out;
 	}
 
+	if (smb_is_stream_dir_path(smb_work->tcon, new_name)) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_INVALID;
+		rc = -EINVAL;
+		goto out;
+	}
+
 	tmp_name = kmalloc(PATH_MAX, GFP_NOFS);
 	if (!tmp_name) {
 		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
@@ -4572,15 +5125,22 @@ int smb2_rename(struct smb_work *smb_work, struct file *filp, int old_fid)
 	}
 	strncpy(tmp_name, new_name, strlen(new_name) + 1);
 	cifsd_debug("new name %s\n", new_name);
-	rc = smb_kern_path(tmp_name, 0, &path, 1);
-	if (rc)
+	rc = smb_share_kern_path(smb_work->tcon, tmp_name, 0, &path, 1);
+	if (rc == -EXDEV || rc == -ENAMETOOLONG) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_INVALID;
+		goto out;
+	} else if (rc == -EACCES) {
+		rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+		goto out;
+	} else if (rc)
 		file_present = false;
 	else
 		path_put(&path);
 
 	if (file_info->ReplaceIfExists) {
 		if (file_present) {
-			rc = smb_vfs_unlink(tmp_name);
+			rc = smb_vfs_unlink(tmp_name,
+				cifsd_tcon_stream_root(smb_work->tcon));
 			if (rc) {
 				if (rc == -ENOTEMPTY)
 					rsp->hdr.Status =
@@ -4605,7 +5165,8 @@ int smb2_rename(struct smb_work *smb_work, struct file *filp, int old_fid)
 		}
 	}
 
-	rc = smb_vfs_rename(smb_work->sess, NULL, new_name, old_fid);
+	rc = smb_vfs_rename(smb_work->sess, NULL, new_name, old_fid,
+			cifsd_tcon_stream_root(smb_work->tcon));
 	if (rc == -ESHARE)
 		rsp->hdr.Status = NT_STATUS_SHARING_VIOLATION;
 	else if (rc == -ENOTEMPTY)
@@ -4653,7 +5214,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, req->PersistentFileId);
 		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-		return -ENOENT;
+		rc = -ENOENT;
+		goto out;
 	}
 
 	filp = fp->filp;
@@ -4670,7 +5232,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 			FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to write the attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		file_info = (struct smb2_file_all_info *)req->Buffer;
@@ -4681,16 +5244,14 @@ int smb2_set_info_file(struct smb_work *smb_work)
 
 			fp->create_time = le64_to_cpu(file_info->CreationTime);
 			if (get_attr_store_dos(&share->config.attr)) {
-				rc = smb_store_cont_xattr(&fp->filp->f_path,
-					XATTR_NAME_CREATION_TIME,
-					(void *)&fp->create_time,
-					CREATIOM_TIME_LEN);
+				rc = smb_inode_meta_store_create_time(
+					&fp->filp->f_path, fp->create_time);
 				if (rc) {
 					cifsd_debug("failed to set creation time\n");
 					rsp->hdr.Status =
 						NT_STATUS_INVALID_PARAMETER;
 					smb2_set_err_rsp(smb_work);
-					return rc;
+					goto out;
 				}
 			}
 		}
@@ -4723,7 +5284,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 			if (IS_IMMUTABLE(inode) || IS_APPEND(inode)) {
 				rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
 				smb2_set_err_rsp(smb_work);
-				return -EPERM;
+				rc = -EPERM;
+				goto out;
 			}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 37)
@@ -4734,7 +5296,7 @@ int smb2_set_info_file(struct smb_work *smb_work)
 			if (rc) {
 				rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
 				smb2_set_err_rsp(smb_work);
-				return rc;
+				goto out;
 			}
 
 			setattr_copy(inode, &attrs);
@@ -4754,7 +5316,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 			FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to write data : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		file_eof_info = (struct smb2_file_eof_info *)req->Buffer;
@@ -4773,7 +5336,7 @@ int smb2_set_info_file(struct smb_work *smb_work)
 					rsp->hdr.Status =
 						NT_STATUS_INVALID_HANDLE;
 				smb2_set_err_rsp(smb_work);
-				return rc;
+				goto out;
 			}
 
 			if (oplocks_enable) {
@@ -4798,19 +5361,22 @@ int smb2_set_info_file(struct smb_work *smb_work)
 		if (!(fp->daccess & (FILE_DELETE_LE |
 			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to delete : 0x%x\n", fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		parent_fp = find_fp_in_hlist_using_inode(GET_PARENT_INO(fp));
 		if (parent_fp) {
 			if (parent_fp->daccess & FILE_DELETE_LE) {
 				cifsd_err("parent dir is opened with delete access\n");
-				return -ESHARE;
+				rc = -ESHARE;
+				goto out;
 			}
 
 			if (!(parent_fp->saccess & FILE_SHARE_DELETE_LE)) {
 				cifsd_err("parent dir is opened without share delete\n");
-				return -ESHARE;
+				rc = -ESHARE;
+				goto out;
 			}
 		}
 
@@ -4827,7 +5393,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 		if (!(fp->daccess & (FILE_DELETE_LE |
 			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to delete : 0x%x\n", fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		file_info = (struct smb2_file_disposition_info *)req->Buffer;
@@ -4849,7 +5416,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to write the extended attributes : 0x%x\n",
 				fp->daccess);
-			return -EACCES;
+			rc = -EACCES;
+			goto out;
 		}
 
 		req = (struct smb2_set_info_req *)smb_work->buf;
@@ -4864,6 +5432,8 @@ int smb2_set_info_file(struct smb_work *smb_work)
 		rc = -1;
 	}
 
+out:
+	cifsd_fp_put(fp);
 	return rc;
 }
 
@@ -4985,6 +5555,12 @@ int smb2_read(struct smb_work *smb_work)
 		length = CIFS_DEFAULT_IOSIZE;
 	}
 
+	/* page cache miss: don't block the request worker on storage */
+	if (smb2_can_defer_io(smb_work) &&
+		!smb_vfs_read_cached(smb_work->sess, id, offset, length) &&
+		!smb2_defer_io(smb_work))
+		return 0;
+
 	cifsd_debug("fid %llu, offset %lld, len %zu\n", id, offset, length);
 	nbytes = smb_vfs_read(smb_work->sess, id,
 			le64_to_cpu(req->PersistentFileId),
@@ -5197,6 +5773,19 @@ int smb2_write(struct smb_work *smb_work)
 	if (le32_to_cpu(req->Flags) & SMB2_WRITEFLAG_WRITE_THROUGH)
 		writethrough = true;
 
+	/* write-through waits for storage, finish it from the I/O worker */
+	if (smb2_can_defer_io(smb_work)) {
+		struct cifsd_file *fp;
+		bool sync;
+
+		fp = get_id_from_fidtable(smb_work->sess, id);
+		sync = fp && !fp->is_stream &&
+			(writethrough || fp->filp->f_flags & O_SYNC);
+		cifsd_fp_put(fp);
+		if (sync && !smb2_defer_io(smb_work))
+			return 0;
+	}
+
 	cifsd_debug("fid %llu, offset %lld, len %zu\n", id, offset, length);
 	err = smb_vfs_write(smb_work->sess, id,
 		le64_to_cpu(req->PersistentFileId), data_buf, length, &offset,
@@ -5301,9 +5890,11 @@ int smb2_cancel(struct smb_work *smb_work)
 				le64_to_cpu(hdr->Id.AsyncId)) {
 				cifsd_debug("smb2 with AsyncId %llu cancelled command = 0x%x\n",
 					hdr->Id.AsyncId, work_hdr->Command);
-				if (work->async->async_status == ASYNC_PROG)
+				if (work->async->async_status == ASYNC_PROG) {
 					work->async->async_status =
 						ASYNC_CANCEL;
+					smb_async_io_kick(work);
+				}
 				break;
 			}
 		}
@@ -5371,13 +5962,197 @@ static struct cifsd_lock *smb2_lock_init(struct file_lock *flock,
 	if (lock->start == lock->end)
 		lock->zero_len = 1;
 	INIT_LIST_HEAD(&lock->llist);
-	INIT_LIST_HEAD(&lock->glist);
 	INIT_LIST_HEAD(&lock->flist);
 	list_add_tail(&lock->llist, lock_list);
 
 	return lock;
 }
 
+/**
+ * smb2_lock_notify() - lock manager callback for a blocked SMB2 lock
+ * @flock:	blocked posix lock that may be granted now
+ *
+ * Called by the VFS, under its lock spinlocks, instead of waking up a
+ * sleeper when the conflicting lock goes away. Just kick the parked
+ * request, the retry runs on the cifsd I/O workqueue.
+ */
+static void smb2_lock_notify(struct file_lock *flock)
+{
+	struct cifsd_lock_tree *tree;
+	struct cifsd_lock *lock;
+
+	tree = cifsd_lock_tree_get(file_inode(flock->fl_file));
+	if (!tree)
+		return;
+
+	for (lock = cifsd_lock_first(tree, flock->fl_start, flock->fl_end);
+		lock; lock = cifsd_lock_next(lock, flock->fl_start,
+			flock->fl_end)) {
+		if (lock->fl == flock && lock->work) {
+			smb_async_io_kick(lock->work);
+			break;
+		}
+	}
+	cifsd_lock_tree_put(tree);
+}
+
+static const struct lock_manager_operations cifsd_lock_lmops = {
+	.lm_notify = smb2_lock_notify,
+};
+
+/**
+ * smb2_lock_done() - build the response of a single blocking lock request
+ * @smb_work:	smb work containing lock command buffer
+ * @smb_lock:	the lock, already in the lock index and not in any list
+ * @fp:		file the lock belongs to
+ * @err:	result of the lock attempt
+ */
+static void smb2_lock_done(struct smb_work *smb_work,
+	struct cifsd_lock *smb_lock, struct cifsd_file *fp, int err)
+{
+	struct smb2_lock_rsp *rsp = (struct smb2_lock_rsp *)smb_work->rsp_buf;
+
+	if (!err) {
+		smb_lock->work = NULL;
+		list_add(&smb_lock->flist, &fp->lock_list);
+		rsp->StructureSize = cpu_to_le16(4);
+		cifsd_debug("successful in taking lock\n");
+		rsp->hdr.Status = NT_STATUS_OK;
+		rsp->Reserved = 0;
+		inc_rfc1001_len(rsp, 4);
+		return;
+	}
+
+	cifsd_lock_index_del(smb_lock);
+	locks_free_lock(smb_lock->fl);
+	kfree(smb_lock);
+	cifsd_err("failed in taking lock(err : %d)\n", err);
+	rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
+	smb2_set_err_rsp(smb_work);
+}
+
+/**
+ * smb2_lock_resume() - retry a parked blocking lock
+ * @smb_work:	smb work containing lock command buffer
+ *
+ * Runs on the cifsd I/O workqueue when the blocking lock was woken up by
+ * the VFS, cancelled or its file was closed.
+ *
+ * Return:	0 when the response is ready, -EINPROGRESS if parked again
+ */
+static int smb2_lock_resume(struct smb_work *smb_work)
+{
+	struct tcp_server_info *server = smb_work->server;
+	struct smb2_lock_req *req = (struct smb2_lock_req *)smb_work->buf;
+	struct smb2_lock_rsp *rsp = (struct smb2_lock_rsp *)smb_work->rsp_buf;
+	struct async_info *async = smb_work->async;
+	struct cifsd_lock *smb_lock = async->blocked_lock;
+	struct file_lock *flock = smb_lock->fl;
+	struct cifsd_file *fp;
+	enum asyncEnum status;
+	int err;
+
+	spin_lock(&server->request_lock);
+	status = async->async_status;
+	spin_unlock(&server->request_lock);
+
+	if (status == ASYNC_CANCEL || status == ASYNC_CLOSE) {
+		posix_unblock_lock(flock);
+		cifsd_lock_index_del(smb_lock);
+		if (status == ASYNC_CANCEL) {
+			/* on close the file's lock list is gone already */
+			list_del(&smb_lock->flist);
+			rsp->hdr.Status = NT_STATUS_CANCELLED;
+		} else
+			rsp->hdr.Status = NT_STATUS_RANGE_NOT_LOCKED;
+		locks_free_lock(flock);
+		kfree(smb_lock);
+		smb2_set_err_rsp(smb_work);
+		return 0;
+	}
+
+	fp = get_id_from_fidtable(smb_work->sess,
+			le64_to_cpu(req->VolatileFileId));
+	if (!fp) {
+		posix_unblock_lock(flock);
+		cifsd_lock_index_del(smb_lock);
+		locks_free_lock(flock);
+		kfree(smb_lock);
+		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+		smb2_set_err_rsp(smb_work);
+		return 0;
+	}
+
+	smb_async_io_arm(smb_work, 2);
+	err = smb_vfs_lock(fp->filp, smb_lock->cmd, flock);
+	if (err == FILE_LOCK_DEFERRED) {
+		cifsd_fp_put(fp);
+		return -EINPROGRESS;
+	}
+
+	smb_async_io_disarm(smb_work);
+	list_del(&smb_lock->flist);
+	smb2_lock_done(smb_work, smb_lock, fp, err);
+	cifsd_fp_put(fp);
+	return 0;
+}
+
+/**
+ * smb2_lock_park() - take a single blocking lock without holding a worker
+ * @smb_work:	smb work containing lock command buffer
+ * @smb_lock:	the lock to take, not in any list
+ * @fp:		file the lock belongs to
+ *
+ * If the lock can't be granted right away, send an interim response and
+ * park the request. The VFS calls smb2_lock_notify() when the lock may be
+ * granted, SMB2_CANCEL and close kick it as well; the request then resumes
+ * in smb2_lock_resume() with no thread waiting or polling in between.
+ *
+ * Return:	0
+ */
+static int smb2_lock_park(struct smb_work *smb_work,
+	struct cifsd_lock *smb_lock, struct cifsd_file *fp)
+{
+	struct smb2_hdr *rsp_hdr = (struct smb2_hdr *)smb_work->rsp_buf;
+	struct file_lock *flock = smb_lock->fl;
+	__be32 rsp_len;
+	int err;
+
+	/* must be findable by smb2_lock_notify() before it can block */
+	smb_lock->work = smb_work;
+	err = cifsd_lock_index_add(smb_lock);
+	if (err) {
+		locks_free_lock(flock);
+		kfree(smb_lock);
+		rsp_hdr->Status = NT_STATUS_LOCK_NOT_GRANTED;
+		smb2_set_err_rsp(smb_work);
+		return 0;
+	}
+
+	flock->fl_lmops = &cifsd_lock_lmops;
+	smb_async_io_arm(smb_work, 2);
+	err = smb_vfs_lock(fp->filp, smb_lock->cmd, flock);
+	if (err != FILE_LOCK_DEFERRED) {
+		smb_async_io_disarm(smb_work);
+		smb2_lock_done(smb_work, smb_lock, fp, err);
+		return 0;
+	}
+
+	cifsd_debug("would have to wait for getting lock\n");
+	smb_work->async->blocked_lock = smb_lock;
+	/* a CLOSE racing with the interim response must find and kick it */
+	list_add(&smb_lock->flist, &fp->lock_list);
+
+	rsp_len = rsp_hdr->smb2_buf_length;
+	smb2_send_interim_resp(smb_work);
+	rsp_hdr->smb2_buf_length = rsp_len;
+	rsp_hdr->Status = NT_STATUS_OK;
+
+	smb_work->async_io = 1;
+	smb_work->async_io_fn = smb2_lock_resume;
+	return 0;
+}
+
 /**
  * smb2_lock() - handler for smb2 file lock command
  * @smb_work:	smb work containing lock command buffer
@@ -5391,7 +6166,7 @@ int smb2_lock(struct smb_work *smb_work)
 	struct smb2_lock_req *req;
 	struct smb2_lock_rsp *rsp;
 	struct smb2_lock_element *lock_ele;
-	struct cifsd_file *fp;
+	struct cifsd_file *fp = NULL;
 	struct file_lock *flock = NULL;
 	struct file *filp = NULL;
 	int lock_count;
@@ -5400,6 +6175,8 @@ int smb2_lock(struct smb_work *smb_work)
 	int err = 0, i;
 	uint64_t lock_length;
 	struct cifsd_lock *smb_lock = NULL, *cmp_lock, *tmp;
+	struct cifsd_lock *unlock_lock = NULL;
+	struct cifsd_lock_tree *tree;
 	int nolock = 0;
 	LIST_HEAD(lock_list);
 	LIST_HEAD(rollback_list);
@@ -5569,12 +6346,12 @@ int smb2_lock(struct smb_work *smb_work)
 			goto no_check_gl;
 
 		nolock = 1;
-		/* check locks in global list */
-		list_for_each_entry(cmp_lock, &global_lock_list, glist) {
-			if (file_inode(cmp_lock->fl->fl_file) !=
-				file_inode(smb_lock->fl->fl_file))
-				continue;
-
+		/* check locks of other opens overlapping this range */
+		tree = cifsd_lock_tree_get(file_inode(smb_lock->fl->fl_file));
+		for (cmp_lock = tree ? cifsd_lock_first(tree, smb_lock->start,
+					smb_lock->end) : NULL; cmp_lock;
+			cmp_lock = cifsd_lock_next(cmp_lock, smb_lock->start,
+					smb_lock->end)) {
 			if (smb_lock->fl->fl_type == F_UNLCK) {
 				if (cmp_lock->fl->fl_file ==
 					smb_lock->fl->fl_file &&
@@ -5582,10 +6359,7 @@ int smb2_lock(struct smb_work *smb_work)
 					cmp_lock->end == smb_lock->end &&
 					!cmp_lock->work) {
 					nolock = 0;
-					locks_free_lock(cmp_lock->fl);
-					list_del(&cmp_lock->glist);
-					list_del(&cmp_lock->flist);
-					kfree(cmp_lock);
+					unlock_lock = cmp_lock;
 					break;
 				}
 				continue;
@@ -5605,7 +6379,8 @@ int smb2_lock(struct smb_work *smb_work)
 				cmp_lock->start < smb_lock->end) {
 				cifsd_err("previous lock conflict with zero byte lock range\n");
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				cifsd_lock_tree_put(tree);
+				goto out;
 			}
 
 			if (smb_lock->zero_len && !cmp_lock->zero_len &&
@@ -5613,7 +6388,8 @@ int smb2_lock(struct smb_work *smb_work)
 				smb_lock->start < cmp_lock->end) {
 				cifsd_err("current lock conflict with zero byte lock range\n");
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				cifsd_lock_tree_put(tree);
+				goto out;
 			}
 
 			if (((cmp_lock->start <= smb_lock->start &&
@@ -5624,9 +6400,20 @@ int smb2_lock(struct smb_work *smb_work)
 				cifsd_err("Not allow lock operation on exclusive lock range\n");
 				rsp->hdr.Status =
 					NT_STATUS_LOCK_NOT_GRANTED;
+				cifsd_lock_tree_put(tree);
 				goto out;
 			}
 		}
+		if (tree)
+			cifsd_lock_tree_put(tree);
+
+		if (unlock_lock) {
+			cifsd_lock_index_del(unlock_lock);
+			locks_free_lock(unlock_lock->fl);
+			list_del(&unlock_lock->flist);
+			kfree(unlock_lock);
+			unlock_lock = NULL;
+		}
 
 		if (smb_lock->fl->fl_type == F_UNLCK && nolock) {
 			cifsd_err("Try to unlock nolocked range\n");
@@ -5642,6 +6429,14 @@ no_check_gl:
 
 		flock = smb_lock->fl;
 		list_del(&smb_lock->llist);
+
+		/* a lone blocking lock waits without holding a worker */
+		if (lock_count == 1 && smb_lock->cmd == F_SETLKW &&
+				smb2_can_defer_io(smb_work)) {
+			err = smb2_lock_park(smb_work, smb_lock, fp);
+			cifsd_fp_put(fp);
+			return err;
+		}
 retry:
 		err = smb_vfs_lock(filp, smb_lock->cmd, flock);
 skip:
@@ -5661,10 +6456,14 @@ skip:
 				cifsd_debug("would have to wait for getting"
 						" lock\n");
 				smb_lock->work = smb_work;
-				list_add_tail(&smb_lock->glist,
-					&global_lock_list);
 				list_add(&smb_lock->llist, &rollback_list);
 				list_add(&smb_lock->flist, &fp->lock_list);
+				if (cifsd_lock_index_add(smb_lock)) {
+					posix_unblock_lock(flock);
+					rsp->hdr.Status =
+						NT_STATUS_LOCK_NOT_GRANTED;
+					goto out;
+				}
 
 				smb2_send_interim_resp(smb_work);
 wait:
@@ -5676,7 +6475,7 @@ wait:
 					async->async_status == ASYNC_CLOSE) {
 					posix_unblock_lock(flock);
 					list_del(&smb_lock->llist);
-					list_del(&smb_lock->glist);
+					cifsd_lock_index_del(smb_lock);
 					locks_free_lock(flock);
 
 					if (async->async_status ==
@@ -5698,16 +6497,20 @@ wait:
 
 				if (err) {
 					list_del(&smb_lock->llist);
-					list_del(&smb_lock->glist);
+					cifsd_lock_index_del(smb_lock);
 					list_del(&smb_lock->flist);
 					goto retry;
 				} else
 					goto wait;
 			} else if (!err) {
-				list_add_tail(&smb_lock->glist,
-					&global_lock_list);
+				smb_lock->work = NULL;
 				list_add(&smb_lock->llist, &rollback_list);
 				list_add(&smb_lock->flist, &fp->lock_list);
+				if (cifsd_lock_index_add(smb_lock)) {
+					rsp->hdr.Status =
+						NT_STATUS_LOCK_NOT_GRANTED;
+					goto out;
+				}
 				cifsd_debug("successful in taking lock\n");
 			} else {
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
@@ -5722,6 +6525,7 @@ wait:
 	rsp->Reserved = 0;
 	inc_rfc1001_len(rsp, 4);
 
+	cifsd_fp_put(fp);
 	return err;
 
 out:
@@ -5743,7 +6547,7 @@ out:
 		if (err)
 			cifsd_err("rollback unlock fail : %d\n", err);
 		list_del(&smb_lock->llist);
-		list_del(&smb_lock->glist);
+		cifsd_lock_index_del(smb_lock);
 		list_del(&smb_lock->flist);
 		locks_free_lock(smb_lock->fl);
 		locks_free_lock(rlock);
@@ -5752,6 +6556,7 @@ out:
 out2:
 	cifsd_err("failed in taking lock(flags : %x)\n", flags);
 	smb2_set_err_rsp(smb_work);
+	cifsd_fp_put(fp);
 	return 0;
 }
 
@@ -6116,7 +6921,9 @@ int smb20_oplock_break(struct smb_work *smb_work)
 		goto err_out;
 	}
 
+	/* ofile_list_lock keeps the oplock state alive */
 	ofile = fp->ofile;
+	cifsd_fp_put(fp);
 	if (ofile == NULL) {
 		mutex_unlock(&ofile_list_lock);
 		cifsd_err("unexpected null ofile_info\n");
@@ -6363,48 +7170,94 @@ err_out:
 }
 
 #ifdef CONFIG_SMB2_NOTIFY_SUPPORT
-static unsigned int convert_inotify_mask(unsigned int mode)
+/**
+ * smb2_notify_done() - build the response of a change notify request
+ * @smb_work:	smb work containing notify command buffer
+ * @len:	length of the records in the response buffer, or the error
+ *		returned by cifsd_notify_take()
+ */
+static void smb2_notify_done(struct smb_work *smb_work, int len)
 {
-	unsigned int mask = 0;
-
-	if (mode & FILE_NOTIFY_CHANGE_NAME)
-		mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
-	if (mode & FILE_NOTIFY_CHANGE_ATTRIBUTES)
-		mask |= IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_MODIFY;
-	if (mode & (FILE_NOTIFY_CHANGE_LAST_WRITE |
-		FILE_NOTIFY_CHANGE_LAST_ACCESS | FILE_NOTIFY_CHANGE_EA |
-		FILE_NOTIFY_CHANGE_SECURITY))
-		mask |= IN_ATTRIB;
-
-	return mask;
+	struct smb2_notify_rsp *rsp =
+		(struct smb2_notify_rsp *)smb_work->rsp_buf;
+
+	if (len < 0) {
+		if (len == -ECANCELED)
+			rsp->hdr.Status = NT_STATUS_CANCELLED;
+		else if (len == -ENOSPC)
+			rsp->hdr.Status = NT_STATUS_NOTIFY_ENUM_DIR;
+		else
+			rsp->hdr.Status = NT_STATUS_NOTIFY_CLEANUP;
+		smb2_set_err_rsp(smb_work);
+		return;
+	}
+
+	rsp->hdr.Status = NT_STATUS_OK;
+	rsp->StructureSize = cpu_to_le16(9);
+	rsp->OutputBufferOffset = cpu_to_le16(72);
+	rsp->OutputBufferLength = cpu_to_le32(len);
+	inc_rfc1001_len(rsp, 8 + len);
+}
+
+/**
+ * smb2_notify_resume() - complete a parked change notify request
+ * @smb_work:	smb work containing notify command buffer
+ *
+ * Runs on the cifsd I/O workqueue when a change was recorded for the
+ * handle, the request was cancelled or the handle was closed.
+ *
+ * Return:	0 when the response is ready, -EINPROGRESS if parked again
+ */
+static int smb2_notify_resume(struct smb_work *smb_work)
+{
+	struct tcp_server_info *server = smb_work->server;
+	struct smb2_notify_req *req = (struct smb2_notify_req *)smb_work->buf;
+	struct smb2_notify_rsp *rsp =
+		(struct smb2_notify_rsp *)smb_work->rsp_buf;
+	struct async_info *async = smb_work->async;
+	enum asyncEnum status;
+	int len;
+
+	/* arm before looking, a kick from now on is not lost */
+	smb_async_io_arm(smb_work, 2);
+	spin_lock(&server->request_lock);
+	status = async->async_status;
+	spin_unlock(&server->request_lock);
+
+	len = cifsd_notify_take(async->notify, status == ASYNC_CANCEL,
+			rsp->Buffer, le32_to_cpu(req->OutputBufferLength));
+	if (len == -EINPROGRESS)
+		return -EINPROGRESS;
+
+	smb_async_io_disarm(smb_work);
+	kfree(async->notify);
+	async->notify = NULL;
+	smb2_notify_done(smb_work, len);
+	return 0;
 }
 
 /**
  * smb2_notify() - handler for smb2 notify request
  * @smb_work:	smb work containing notify command buffer
  *
+ * Changes recorded since the previous request on the handle are returned
+ * right away. Otherwise an interim response is sent and the request is
+ * parked on the handle until cifsd_notify_take() has something for it,
+ * see smb2_notify_resume().
+ *
  * Return:	0
  */
 int smb2_notify(struct smb_work *smb_work)
 {
 	struct smb2_notify_req *req;
-	struct smb2_notify_rsp *rsp, *rsp_org;
-	struct notification *notify_req;
-	struct cifsd_file *fp, *prev_fp;
-	struct inotify_event *event;
-	struct notification *request;
-	struct FileNotifyInformation *out_buf = NULL;
-	struct smb_work *work;
-	int fd, offset = 0, wd, byte, count = 1024, i = 0;
-	int filename_len, total_len, out_len;
-	int err = 0;
-	u32 mask;
-	char *p, *pbuf, *buf;
-	mm_segment_t cur_fs = get_fs();
+	struct smb2_notify_rsp *rsp;
+	struct notification *notify;
+	struct cifsd_file *fp = NULL;
+	__be32 rsp_len;
+	int len, err;
 
 	req = (struct smb2_notify_req *)smb_work->buf;
 	rsp = (struct smb2_notify_rsp *)smb_work->rsp_buf;
-	rsp_org = rsp;
 
 	if (smb_work->next_smb2_rcv_hdr_off) {
 		req = (struct smb2_notify_req *)((char *)req +
@@ -6419,8 +7272,8 @@ int smb2_notify(struct smb_work *smb_work)
 		return 0;
 	}
 
-	if (smb_work->next_smb2_rcv_hdr_off &&
-			le32_to_cpu(req->hdr.NextCommand)) {
+	/* a parked request can't be part of a compound response */
+	if (!smb2_can_defer_io(smb_work) || !smb_work->async) {
 		rsp->hdr.Status = NT_STATUS_INTERNAL_ERROR;
 		smb2_set_err_rsp(smb_work);
 		return 0;
@@ -6429,10 +7282,10 @@ int smb2_notify(struct smb_work *smb_work)
 	fp = get_id_from_fidtable(smb_work->sess,
 			le64_to_cpu(req->VolatileFileId));
 	if (!fp) {
-		cifsd_err("Invalid file id for lock : %llu\n",
+		cifsd_err("Invalid file id for notify : %llu\n",
 				le64_to_cpu(req->VolatileFileId));
 		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-		goto out3;
+		goto err_out;
 	}
 
 	if (fp->is_durable && fp->persistent_id !=
@@ -6440,188 +7293,65 @@ int smb2_notify(struct smb_work *smb_work)
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, req->PersistentFileId);
 		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-		goto out3;
+		goto err_out;
 	}
 
-	pbuf = kzalloc(PATH_MAX, GFP_KERNEL);
-	if (!pbuf)
-		goto out3;
-
-	p = d_path(&(fp->filp->f_path), pbuf, PATH_MAX);
-	if (IS_ERR(p)) {
-		kfree(pbuf);
-		goto out3;
+	if (!S_ISDIR(GET_FP_INODE(fp)->i_mode)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		goto err_out;
 	}
 
-	notify_req = kmalloc(sizeof(struct notification), GFP_KERNEL);
-	if (!notify_req)
-		goto out3;
-
-	notify_req->mode = le32_to_cpu(req->CompletionFileter);
-	cifsd_debug("CompletionFileter : 0x%x\n", notify_req->mode);
-
-	notify_req->work = smb_work;
-
-	hash_for_each_possible(smb_work->sess->notify_table, prev_fp, node,
-		(unsigned long)GET_FP_INODE(fp)) {
-		if (GET_FP_INODE(fp) == GET_FP_INODE(prev_fp)) {
-			list_add_tail(&notify_req->queuelist, &prev_fp->queue);
-			goto out2;
-		}
+	cifsd_debug("CompletionFileter : 0x%x, Flags : 0x%x\n",
+			le32_to_cpu(req->CompletionFileter),
+			le16_to_cpu(req->Flags));
+	err = cifsd_notify_attach(fp, le32_to_cpu(req->CompletionFileter),
+			le16_to_cpu(req->Flags) & SMB2_WATCH_TREE,
+			le32_to_cpu(req->OutputBufferLength),
+			smb_work->server->local_nls);
+	if (err) {
+		rsp->hdr.Status = err == -ENOMEM ? NT_STATUS_NO_MEMORY :
+			NT_STATUS_NOT_SUPPORTED;
+		goto err_out;
 	}
 
-	INIT_LIST_HEAD(&fp->queue);
-	list_add_tail(&notify_req->queuelist, &fp->queue);
-
-	fd = sys_inotify_init();
-
-start:
-	while (!list_empty(&fp->queue)) {
-		request = list_first_entry_or_null(&fp->queue,
-			struct notification, queuelist);
-		if (!request)
-			continue;
-		list_del_init(&request->queuelist);
-
-		work = request->work;
-
-		req = (struct smb2_notify_req *)work->buf;
-		rsp = (struct smb2_notify_rsp *)work->rsp_buf;
-		rsp_org = rsp;
-
-		out_len = le32_to_cpu(req->OutputBufferLength);
-
-		mask = convert_inotify_mask(request->mode);
-		if (!mask) {
-			list_add_tail(&request->queuelist, &fp->queue);
-			continue;
-		}
-
-		kfree(request);
-
-		set_fs(get_ds());
-		wd = sys_inotify_add_watch(fd, (__force char __user *)p, mask);
-		set_fs(cur_fs);
-
-		spin_lock(&work->server->request_lock);
-		if (work->async->async_status == ASYNC_CANCEL) {
-			spin_unlock(&work->server->request_lock);
-			sys_inotify_rm_watch(fd, wd);
-			continue;
-		}
-
-		work->async->async_status = ASYNC_PROG;
-
-		work->async->fd = fd;
-		work->async->wd = wd;
-		spin_unlock(&work->server->request_lock);
-
-		buf = kmalloc(1024 * (sizeof(struct inotify_event) + 16),
-			GFP_KERNEL);
-		if (!buf)
-			break;
-
-		rsp->hdr.Flags |= SMB2_FLAGS_ASYNC_COMMAND;
-		rsp->hdr.Id.AsyncId = cpu_to_le64(work->async->async_id);
-
-		/* Send interim Response to inform asynchronous request */
-		cifsd_debug("Send interim Response to inform asynchronous request id : %lld\n",
-			work->async->async_id);
-		smb2_set_err_rsp(work);
-		rsp->hdr.Status = NT_STATUS_PENDING;
-		work->multiRsp = 1;
-		smb_send_rsp(work);
-		work->multiRsp = 0;
-
-		cifsd_debug("watching filename : %s, mask : 0x%x\n", p, mask);
-		set_fs(get_ds());
-		byte = sys_read(fd, (__force char __user *)buf, count);
-		set_fs(cur_fs);
-		if (byte < 0) {
-			cifsd_err("event read failed : %d\n", byte);
-			sys_inotify_rm_watch(fd, wd);
-			continue;
-		}
-
-		i = 0;
-		total_len = 0;
-		while (i < byte) {
-			if (i >= out_len) {
-				cifsd_err("buffer length(%d) is greater than output's one (%d) of request\n",
-					i, out_len);
-				rsp->hdr.Status = NT_STATUS_NOTIFY_ENUM_DIR;
-				goto out;
-			}
-
-			out_buf = (struct FileNotifyInformation *)
-				&rsp->Buffer[offset];
-			event = (struct inotify_event *) &buf[i];
-			cifsd_debug("event->mask : 0x%x, event length : %d\n",
-				event->mask, event->len);
-
-			if (event->mask & (IN_IGNORED | IN_UNMOUNT |
-					IN_Q_OVERFLOW) || !event->len) {
-				rsp->hdr.Status = NT_STATUS_CANCELLED;
-				smb2_set_err_rsp(work);
-				smb_send_rsp(work);
-				remove_async_id(work->async->async_id);
-				goto start;
-			}
-
-			if (event->mask & IN_CREATE) {
-				cifsd_err("get file creation event\n");
-				out_buf->Action = FILE_ACTION_ADDED;
-			} else if (event->mask & (IN_DELETE | IN_DELETE_SELF)) {
-				cifsd_err("get file deletion event\n");
-				out_buf->Action = FILE_ACTION_REMOVED;
-			} else if (event->mask & (IN_ATTRIB | IN_MODIFY)) {
-				cifsd_err("get file modification event\n");
-				out_buf->Action = FILE_ACTION_MODIFIED;
-			} else if (event->mask & IN_MOVED_FROM) {
-				cifsd_err("get file rename(from old) event\n");
-				out_buf->Action = FILE_ACTION_RENAMED_OLD_NAME;
-			} else if (event->mask & IN_MOVED_TO) {
-				cifsd_err("get file rename(to new) event\n");
-				out_buf->Action = FILE_ACTION_RENAMED_NEW_NAME;
-			}
-			/* TODO : add named stream notify */
+	notify = kmalloc(sizeof(struct notification), GFP_KERNEL);
+	if (!notify) {
+		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
+		goto err_out;
+	}
 
-			i += sizeof(struct inotify_event) + event->len;
-			filename_len =
-				smbConvertToUTF16((__le16 *)out_buf->FileName,
-				event->name, event->len,
-				work->sess->server->local_nls, 0);
-			filename_len *= 2;
-			out_buf->FileNameLength = cpu_to_le32(filename_len);
-			offset = 12 + filename_len;
-			total_len += offset;
-			out_buf->NextEntryOffset = cpu_to_le32(offset);
-		}
+	INIT_LIST_HEAD(&notify->queuelist);
+	notify->work = smb_work;
+	notify->nh = fp->notify;
 
-		out_buf->NextEntryOffset = 0;
+	smb_async_io_arm(smb_work, 2);
+	len = cifsd_notify_take(notify, false, rsp->Buffer,
+			le32_to_cpu(req->OutputBufferLength));
+	if (len != -EINPROGRESS) {
+		smb_async_io_disarm(smb_work);
+		kfree(notify);
+		smb2_notify_done(smb_work, len);
+		cifsd_fp_put(fp);
+		return 0;
+	}
 
-		rsp->hdr.Status = NT_STATUS_OK;
-		rsp->StructureSize = cpu_to_le16(9);
-		rsp->OutputBufferOffset = cpu_to_le16(72);
-		rsp->OutputBufferLength = cpu_to_le32(total_len);
-		inc_rfc1001_len(rsp_org, 8 + total_len);
+	smb_work->async->notify = notify;
 
-out:
-		smb_send_rsp(work);
-		remove_async_id(work->async->async_id);
-		sys_inotify_rm_watch(fd, wd);
-	}
+	rsp_len = rsp->hdr.smb2_buf_length;
+	smb2_send_interim_resp(smb_work);
+	rsp->hdr.smb2_buf_length = rsp_len;
+	rsp->hdr.Status = NT_STATUS_OK;
 
-	kfree(pbuf);
-out2:
-	smb_work->send_no_response = 1;
+	/* the parked request refers to fp->notify, not to fp */
+	smb_work->async_io = 1;
+	smb_work->async_io_fn = smb2_notify_resume;
+	cifsd_fp_put(fp);
 	return 0;
 
-out3:
-	if (rsp->hdr.Status == 0)
-		rsp->hdr.Status = NT_STATUS_NOT_SUPPORTED;
+err_out:
 	smb2_set_err_rsp(smb_work);
-	return err;
+	cifsd_fp_put(fp);
+	return 0;
 }
 
 #else
@@ -27,6 +27,9 @@
 #include "smb2pdu.h"
 #endif
 #include "oplock.h"
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+#include "notify.h"
+#endif
 
 bool global_signing;
 unsigned long server_start_time;
@@ -57,10 +60,10 @@ static DEFINE_IDA(cifsd_ida);
 static LIST_HEAD(tcp_sess_list);
 static DEFINE_SPINLOCK(tcp_sess_list_lock);
 
-struct fidtable_desc global_fidtable;
+/* blocking part of deferred READ/WRITE requests runs here */
+static struct workqueue_struct *cifsd_io_wq;
 
 struct hlist_head global_name_table[1024];
-LIST_HEAD(global_lock_list);
 
 /* Default: allocation roundup size = 1048576, to disable set 0 in config */
 unsigned int alloc_roundup_size = 1048576;
@@ -260,12 +263,6 @@ uncork:
 
 out:
 	cifsd_debug("data sent = %d\n", total_len);
-
-#ifdef CONFIG_CIFS_SMB2_SERVER
-	if (server->tcp_status == CifsGood && IS_SMB2(server))
-		cifsd_update_durable_stat_info(work->sess);
-#endif
-
 	return 0;
 }
 
@@ -381,6 +378,118 @@ static void free_workitem_buffers(struct smb_work *smb_work)
 	kmem_cache_free(cifsd_work_cache, smb_work);
 }
 
+static void smb_async_io_work(struct work_struct *work);
+
+/**
+ * smb_async_io_release() - drop one hold on a deferred request
+ * @smb_work:	deferred smb work
+ *
+ * The deferred part is queued to the I/O workqueue when the last hold is
+ * dropped: one hold belongs to the worker that parks the request, and for
+ * requests waiting on an event one more belongs to the wake-up event.
+ */
+static void smb_async_io_release(struct smb_work *smb_work)
+{
+	if (atomic_dec_and_test(&smb_work->async_io_hold))
+		queue_work(cifsd_io_wq, &smb_work->work);
+}
+
+/**
+ * smb_async_io_arm() - prepare a request to be parked
+ * @smb_work:	smb work to be parked
+ * @holds:	1 to run as soon as it is parked, 2 to also wait for
+ *		smb_async_io_kick()
+ */
+void smb_async_io_arm(struct smb_work *smb_work, int holds)
+{
+	if (holds > 1)
+		clear_bit(SMB_WORK_KICKED, &smb_work->async_flags);
+	else
+		set_bit(SMB_WORK_KICKED, &smb_work->async_flags);
+	atomic_set(&smb_work->async_io_hold, holds);
+}
+
+/**
+ * smb_async_io_disarm() - consume the wake-up event of a request
+ * @smb_work:	armed smb work
+ *
+ * Used when the event a request was armed for is not needed anymore.
+ *
+ * Return:	true if nobody kicked the request in the meantime
+ */
+bool smb_async_io_disarm(struct smb_work *smb_work)
+{
+	return !test_and_set_bit(SMB_WORK_KICKED, &smb_work->async_flags);
+}
+
+/**
+ * smb_async_io_kick() - wake up a request parked on an event
+ * @smb_work:	parked smb work
+ *
+ * Safe to call from atomic context and more than once, only the first
+ * call after smb_async_io_arm() counts.
+ */
+void smb_async_io_kick(struct smb_work *smb_work)
+{
+	if (test_and_set_bit(SMB_WORK_KICKED, &smb_work->async_flags))
+		return;
+	smb_async_io_release(smb_work);
+}
+
+/**
+ * smb_async_io_work() - run a deferred request and send its final response
+ * @work:	work embedded in the deferred smb work
+ *
+ * The request worker has already sent the interim response and released
+ * the smb work; finish the command here, sign and send the response, then
+ * free the work and drop the server reference taken at queueing time.
+ */
+static void smb_async_io_work(struct work_struct *work)
+{
+	struct smb_work *smb_work = container_of(work, struct smb_work, work);
+	struct tcp_server_info *server = smb_work->server;
+	unsigned int command;
+
+	if (smb_work->async_io_fn(smb_work) == -EINPROGRESS) {
+		/* parked again, runs once more on the next event */
+		smb_async_io_release(smb_work);
+		return;
+	}
+
+	mutex_lock(&server->srv_mutex);
+	command = server->ops->get_cmd_val(smb_work);
+	if (server->tcp_status == CifsGood && !smb_work->send_no_response) {
+		if (is_smb2_rsp(smb_work))
+			server->ops->set_rsp_credits(smb_work);
+
+		if (smb_work->sess && smb_work->sess->sign &&
+			server->ops->is_sign_req &&
+			server->ops->is_sign_req(smb_work, command))
+			server->ops->set_sign_rsp(smb_work);
+
+		smb_send_rsp(smb_work);
+	} else {
+		spin_lock(&server->request_lock);
+		if (smb_work->added_in_request_list) {
+			list_del_init(&smb_work->request_entry);
+			smb_work->added_in_request_list = 0;
+		}
+		spin_unlock(&server->request_lock);
+	}
+	mutex_unlock(&server->srv_mutex);
+
+	if (smb_work->async) {
+		remove_async_id(smb_work->async->async_id);
+		kfree(smb_work->async);
+	}
+	free_workitem_buffers(smb_work);
+
+	atomic_dec(&server->async_io_running);
+	if (waitqueue_active(&server->req_running_q))
+		wake_up_all(&server->req_running_q);
+	atomic_dec(&server->r_count);
+}
+
 /**
  * handle_smb_work() - process pending smb work requests
  * @smb_work:	smb work containing request command buffer
@@ -507,6 +616,23 @@ again:
 		goto nosend;
 	}
 
+	if (smb_work->async_io) {
+		/*
+		 * Interim response is already out, the I/O worker sends the
+		 * final response, frees the work and drops the server ref.
+		 * Until then the request is counted in async_io_running.
+		 */
+		mutex_unlock(&server->srv_mutex);
+		atomic_inc(&server->async_io_running);
+		atomic_dec(&server->req_running);
+		if (waitqueue_active(&server->req_running_q))
+			wake_up_all(&server->req_running_q);
+
+		INIT_WORK(&smb_work->work, smb_async_io_work);
+		smb_async_io_release(smb_work);
+		return;
+	}
+
 send:
 	if (is_chained_smb2_message(smb_work))
 		goto chained;
@@ -581,6 +707,7 @@ int init_tcp_server(struct tcp_server_info *server, struct socket *sock)
 	server->sock = sock;
 	server->local_nls = load_nls_default();
 	atomic_set(&server->req_running, 0);
+	atomic_set(&server->async_io_running, 0);
 	atomic_set(&server->r_count, 0);
 	server->max_credits = 0;
 	server->credits_granted = 0;
@@ -749,6 +876,11 @@ static int tcp_sess_kthread(void *p)
 		list_for_each_safe(tmp, t, &server->cifsd_sess) {
 			sess = list_entry(tmp, struct cifsd_sess,
 							cifsd_ses_list);
+#ifdef CONFIG_CIFS_SMB2_SERVER
+			/* snapshot durable handles for a later reconnect */
+			if (IS_SMB2(server))
+				cifsd_update_durable_stat_info(sess);
+#endif
 			free_channel_list(sess);
 			list_del(&sess->cifsd_ses_list);
 			/* SESSION Global list cifsd_ses_global_list is
@@ -973,6 +1105,8 @@ void smb_free_mempools(void)
 	kmem_cache_destroy(cifsd_sm_rsp_cachep);
 
 	kmem_cache_destroy(cifsd_work_cache);
+	/* files are freed after a grace period, see cifsd_fp_free() */
+	rcu_barrier();
 	kmem_cache_destroy(cifsd_filp_cache);
 }
 
@@ -995,12 +1129,19 @@ static int __init init_smb_server(void)
 	if (rc)
 		return rc;
 
+	cifsd_io_wq = alloc_workqueue("cifsd-io", WQ_UNBOUND | WQ_MEM_RECLAIM,
+			0);
+	if (!cifsd_io_wq) {
+		rc = -ENOMEM;
+		goto err0;
+	}
+
 	rc = cifsd_export_init();
 	if (rc)
 		goto err1;
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
-	rc = init_fidtable(&global_fidtable);
+	rc = init_global_fidtable();
 	if (rc)
 		goto err2;
 #endif
@@ -1008,8 +1149,22 @@ static int __init init_smb_server(void)
 	rc = cifsd_net_init();
 	if (rc)
 		goto err3;
+
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+	rc = cifsd_notify_init();
+	if (rc)
+		goto err4;
+#endif
+
+	smb_init_inode_caches();
+	cifsd_name_index_init();
+	cifsd_dir_snap_init();
 	return 0;
 
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+err4:
+	cifsd_net_exit();
+#endif
 err3:
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
@@ -1018,6 +1173,8 @@ err2:
 #endif
 	cifsd_export_exit();
 err1:
+	destroy_workqueue(cifsd_io_wq);
+err0:
 	smb_free_mempools();
 	return rc;
 }
@@ -1030,11 +1187,18 @@ static void __exit exit_smb_server(void)
 	cifsd_net_exit();
 
 	cifsd_stop_forker_thread();
+	destroy_workqueue(cifsd_io_wq);
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	destroy_global_fidtable();
 #endif
 	cifsd_export_exit();
 	dispose_ofile_list();
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+	cifsd_notify_exit();
+#endif
+	cifsd_dir_snap_exit();
+	cifsd_name_index_exit();
+	smb_free_inode_caches();
 	smb_free_mempools();
 }
 
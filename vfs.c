@@ -21,6 +21,7 @@
 
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/pagemap.h>
 #include <linux/uaccess.h>
 #include <linux/backing-dev.h>
 #include <linux/writeback.h>
@@ -29,11 +30,51 @@
 #include <linux/xattr.h>
 #endif
 #include <linux/falloc.h>
+#include <linux/hashtable.h>
 
 #include "export.h"
 #include "glob.h"
 #include "oplock.h"
 
+/* sequential run length after which "auto" drop-behind kicks in */
+#define CIFSD_DROP_BEHIND_MIN_RUN	(16 << 20)
+/* page cache behind a streaming reader is dropped in these chunks */
+#define CIFSD_DROP_BEHIND_WINDOW	(2 << 20)
+
+/* sequential write window pushed to writeback once complete */
+#define CIFSD_WRITE_BEHIND_WINDOW	(4 << 20)
+/* smaller abandoned windows are left to the flusher threads */
+#define CIFSD_WRITE_BEHIND_MIN		(512 << 10)
+/* dirty bytes a session or a share may build up before early writeback */
+#define CIFSD_SESS_DIRTY_BUDGET		(64L << 20)
+#define CIFSD_SHARE_DIRTY_BUDGET	(256L << 20)
+
+/*
+ * Flush coalescing: one in-flight fsync per inode. A flush is satisfied by
+ * the first fsync started after it arrived, so all flushers that queue up
+ * behind a running fsync share the next one.
+ */
+struct cifsd_flush {
+	struct hlist_node node;
+	struct inode *inode;
+	int refcount;
+	bool running;
+	unsigned long start_seq;	/* seq of the last started fsync */
+	struct list_head waiters;	/* cifsd_flush_waiter not yet done */
+	wait_queue_head_t wait;
+};
+
+/* a flusher, done with the result of the fsync of seq that covers it */
+struct cifsd_flush_waiter {
+	struct list_head list;
+	unsigned long seq;
+	bool done;
+	int err;
+};
+
+static DEFINE_HASHTABLE(flush_table, 8);
+static DEFINE_SPINLOCK(flush_lock);
+
 /**
  * smb_vfs_create() - vfs helper for smb create file
  * @name:	file name
@@ -58,6 +99,8 @@ int smb_vfs_create(const char *name, umode_t mode)
 	err = vfs_create(path.dentry->d_inode, dentry, mode, true);
 	if (err)
 		cifsd_err("File(%s): creation failed (err:%d)\n", name, err);
+	else
+		smb_dir_cache_invalidate(path.dentry->d_inode);
 
 	done_path_create(&path, dentry);
 
@@ -90,12 +133,151 @@ int smb_vfs_mkdir(const char *name, umode_t mode)
 	err = vfs_mkdir(path.dentry->d_inode, dentry, mode);
 	if (err)
 		cifsd_err("mkdir(%s): creation failed (err:%d)\n", name, err);
+	else
+		smb_dir_cache_invalidate(path.dentry->d_inode);
 
 	done_path_create(&path, dentry);
 
 	return err;
 }
 
+/**
+ * smb_vfs_drop_behind() - drop page cache behind a streaming reader
+ * @fp:		cifsd file pointer
+ * @offset:	offset the last read started at
+ * @nbytes:	number of bytes returned by the last read
+ *
+ * Track the current sequential run of reads on the handle. Once drop-behind
+ * applies (always on "yes" shares, after a long one-pass run on "auto"
+ * shares), clean pages of the range already sent to the client are
+ * invalidated, the same way POSIX_FADV_DONTNEED does, so that a streaming
+ * reader does not evict the working set of other clients. Dirty, mapped or
+ * locked pages are left alone by invalidate_mapping_pages().
+ */
+static void smb_vfs_drop_behind(struct cifsd_file *fp, loff_t offset,
+		ssize_t nbytes)
+{
+	struct address_space *mapping = fp->filp->f_mapping;
+	pgoff_t start, end;
+
+	if (fp->drop_behind == DISABLE || nbytes <= 0)
+		return;
+
+	if (offset != fp->seq_next) {
+		/* seek: start a new sequential run */
+		fp->seq_start = offset;
+		fp->drop_pos = offset;
+	}
+	fp->seq_next = offset + nbytes;
+
+	if (fp->drop_behind == AUTO &&
+			fp->seq_next - fp->seq_start < CIFSD_DROP_BEHIND_MIN_RUN)
+		return;
+
+	if (fp->seq_next - fp->drop_pos < CIFSD_DROP_BEHIND_WINDOW)
+		return;
+
+	/* keep the partial page at the tail, next read will touch it */
+	start = fp->drop_pos >> PAGE_SHIFT;
+	end = fp->seq_next >> PAGE_SHIFT;
+	if (end > start)
+		invalidate_mapping_pages(mapping, start, end - 1);
+	fp->drop_pos = (loff_t)end << PAGE_SHIFT;
+}
+
+/**
+ * smb_vfs_fsync_coalesced() - fsync a file, sharing the fsync with others
+ * @filp:	file to sync
+ *
+ * Concurrent flushes of the same inode, from any handle or client, are
+ * merged: while an fsync is in flight new flushers wait for it and then
+ * one of them issues a single fsync on behalf of all of them (group
+ * commit). Every caller still returns only after an fsync that started
+ * after its call has completed, so durability is unchanged. A caller gets
+ * the result of that fsync, not of a later one, and writeback errors are
+ * checked against its own file, as a plain fsync on it would.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb_vfs_fsync_coalesced(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+	struct cifsd_flush *flush, *new;
+	struct cifsd_flush_waiter waiter, *w;
+	unsigned long run_seq;
+	bool ran = false;
+	int err;
+
+	new = kzalloc(sizeof(struct cifsd_flush), GFP_KERNEL);
+	if (!new)
+		return vfs_fsync(filp, 0);
+
+	spin_lock(&flush_lock);
+	hash_for_each_possible(flush_table, flush, node, (unsigned long)inode)
+		if (flush->inode == inode)
+			break;
+
+	if (!flush) {
+		flush = new;
+		new = NULL;
+		flush->inode = inode;
+		INIT_LIST_HEAD(&flush->waiters);
+		init_waitqueue_head(&flush->wait);
+		hash_add(flush_table, &flush->node, (unsigned long)inode);
+	}
+	flush->refcount++;
+	waiter.seq = flush->start_seq + 1;
+	waiter.done = false;
+	waiter.err = 0;
+	list_add_tail(&waiter.list, &flush->waiters);
+
+	while (!waiter.done) {
+		if (flush->running) {
+			spin_unlock(&flush_lock);
+			wait_event(flush->wait, !flush->running);
+			spin_lock(&flush_lock);
+			continue;
+		}
+
+		flush->running = true;
+		run_seq = ++flush->start_seq;
+		spin_unlock(&flush_lock);
+
+		err = vfs_fsync(filp, 0);
+		ran = true;
+
+		spin_lock(&flush_lock);
+		flush->running = false;
+		list_for_each_entry(w, &flush->waiters, list) {
+			if (!w->done && !time_after(w->seq, run_seq)) {
+				w->done = true;
+				w->err = err;
+			}
+		}
+		wake_up_all(&flush->wait);
+	}
+
+	list_del(&waiter.list);
+	if (--flush->refcount == 0) {
+		hash_del(&flush->node);
+		kfree(flush);
+	}
+	spin_unlock(&flush_lock);
+
+	kfree(new);
+	err = waiter.err;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	/* the fsync ran on another file, report errors this file has not seen */
+	if (!ran) {
+		int wb_err = file_check_and_advance_wb_err(filp);
+
+		if (!err)
+			err = wb_err;
+	}
+#endif
+	return err;
+}
+
 /**
  * smb_vfs_read() - vfs helper for smb file read
  * @sess:	TCP server session
@@ -111,6 +293,7 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 {
 	struct file *filp;
 	ssize_t nbytes;
+	loff_t offset = *pos;
 	mm_segment_t old_fs;
 	struct cifsd_file *fp;
 	char *rbuf, *name;
@@ -126,17 +309,22 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 
 	filp = fp->filp;
 	inode = filp->f_path.dentry->d_inode;
-	if (S_ISDIR(inode->i_mode))
-		return -EISDIR;
+	if (S_ISDIR(inode->i_mode)) {
+		nbytes = -EISDIR;
+		goto out;
+	}
 
-	if (unlikely(count == 0))
-		return 0;
+	if (unlikely(count == 0)) {
+		nbytes = 0;
+		goto out;
+	}
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	if (fp->is_durable && fp->persistent_id != p_id) {
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, p_id);
-		return -ENOENT;
+		nbytes = -ENOENT;
+		goto out;
 	}
 
 	if (sess->server->connection_type) {
@@ -144,16 +332,21 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		    FILE_GENERIC_READ_LE | FILE_MAXIMAL_ACCESS_LE |
 		    FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to read(%llu)\n", fid);
-			return -EACCES;
+			nbytes = -EACCES;
+			goto out;
 		}
 	}
 #endif
 
 	rbuf = alloc_data_mem(count);
-	if (!rbuf)
-		return -ENOMEM;
+	if (!rbuf) {
+		nbytes = -ENOMEM;
+		goto out;
+	}
 
-	if (fp->is_stream) {
+	if (fp->stream_filp) {
+		filp = fp->stream_filp;
+	} else if (fp->is_stream) {
 		ssize_t v_len;
 		char *stream_buf = NULL;
 
@@ -165,13 +358,15 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		if (v_len < 0) {
 			cifsd_err("not found stream in xattr : %zd\n", v_len);
 			kvfree(rbuf);
-			return -ENOENT;
+			nbytes = -ENOENT;
+			goto out;
 		}
 
 		memcpy(rbuf, &stream_buf[*pos], count);
 
 		*buf = rbuf;
-		return v_len > count ? count : v_len;
+		nbytes = v_len > count ? count : v_len;
+		goto out;
 	}
 
 	ret = check_lock_range(filp, *pos, *pos + count - 1,
@@ -180,7 +375,8 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		cifsd_err("%s: unable to read due to lock\n",
 				__func__);
 		kvfree(rbuf);
-		return -EAGAIN;
+		nbytes = -EAGAIN;
+		goto out;
 	}
 
 	old_fs = get_fs();
@@ -198,11 +394,121 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 	} else {
 		*buf = rbuf;
 		filp->f_pos = *pos;
+		if (!fp->is_stream)
+			smb_vfs_drop_behind(fp, offset, nbytes);
 	}
 
+out:
+	cifsd_fp_put(fp);
 	return nbytes;
 }
 
+/**
+ * smb_vfs_uncharge_write_behind() - give a window back to the dirty budgets
+ * @fp:		cifsd file pointer
+ * @len:	length of the window, taken off the handle under wb_lock
+ */
+static void smb_vfs_uncharge_write_behind(struct cifsd_file *fp, loff_t len)
+{
+	if (len <= 0)
+		return;
+
+	atomic_long_sub(len, &fp->sess->dirty_bytes);
+	if (fp->share)
+		atomic_long_sub(len, &fp->share->dirty_bytes);
+}
+
+/**
+ * smb_vfs_kick_writeback() - start writeback of a taken window
+ * @fp:		cifsd file pointer
+ * @start:	start of the window
+ * @len:	length of the window, taken off the handle under wb_lock
+ *
+ * Equivalent of sync_file_range(SYNC_FILE_RANGE_WRITE): start async
+ * writeback of the window without waiting for it, and give the bytes
+ * back to the session and share dirty budgets. A window below
+ * CIFSD_WRITE_BEHIND_MIN is not worth a writeback pass of its own, it is
+ * only uncharged and left to the flusher threads.
+ */
+static void smb_vfs_kick_writeback(struct cifsd_file *fp, loff_t start,
+		loff_t len)
+{
+	if (len >= CIFSD_WRITE_BEHIND_MIN)
+		__filemap_fdatawrite_range(fp->filp->f_mapping, start,
+				start + len - 1, WB_SYNC_NONE);
+
+	smb_vfs_uncharge_write_behind(fp, len);
+}
+
+/**
+ * smb_vfs_write_behind() - account a write and push writeback early
+ * @fp:		cifsd file pointer
+ * @offset:	offset the write started at
+ * @written:	number of bytes written
+ *
+ * Writes are accounted against the session owning the handle and the
+ * share. A handle's window is pushed to writeback once it is complete,
+ * or once it is at least CIFSD_WRITE_BEHIND_MIN while the session or
+ * share is over its dirty budget, so a single large writer does not build
+ * up dirty pages until balance_dirty_pages() throttles every client of
+ * the server. Small random writes only ever get uncharged.
+ */
+static void smb_vfs_write_behind(struct cifsd_file *fp, loff_t offset,
+		ssize_t written)
+{
+	loff_t start = 0, len = 0, kick_start = 0, kick_len = 0;
+	long sess_dirty, share_dirty = 0;
+
+	if (written <= 0)
+		return;
+
+	sess_dirty = atomic_long_add_return(written, &fp->sess->dirty_bytes);
+	if (fp->share)
+		share_dirty = atomic_long_add_return(written,
+				&fp->share->dirty_bytes);
+
+	spin_lock(&fp->wb_lock);
+	/* non-sequential write: give up what is pending and restart */
+	if (offset != fp->wb_next) {
+		start = fp->wb_start;
+		len = fp->wb_next - fp->wb_start;
+		fp->wb_start = offset;
+	}
+	fp->wb_next = offset + written;
+
+	if (fp->wb_next - fp->wb_start >= CIFSD_WRITE_BEHIND_WINDOW ||
+			(fp->wb_next - fp->wb_start >= CIFSD_WRITE_BEHIND_MIN &&
+			 (sess_dirty > CIFSD_SESS_DIRTY_BUDGET ||
+			  share_dirty > CIFSD_SHARE_DIRTY_BUDGET))) {
+		kick_start = fp->wb_start;
+		kick_len = fp->wb_next - fp->wb_start;
+		fp->wb_start = fp->wb_next;
+	}
+	spin_unlock(&fp->wb_lock);
+
+	smb_vfs_kick_writeback(fp, start, len);
+	smb_vfs_kick_writeback(fp, kick_start, kick_len);
+}
+
+/**
+ * smb_vfs_release_write_behind() - drop dirty accounting of a closing handle
+ * @fp:		cifsd file pointer
+ *
+ * The pending window is given back to the budgets of the session that
+ * owns the handle, the one smb_vfs_write_behind() charged.
+ */
+void smb_vfs_release_write_behind(struct cifsd_file *fp)
+{
+	loff_t pending;
+
+	spin_lock(&fp->wb_lock);
+	pending = fp->wb_next - fp->wb_start;
+	fp->wb_start = fp->wb_next;
+	spin_unlock(&fp->wb_lock);
+
+	smb_vfs_uncharge_write_behind(fp, pending);
+}
+
 /**
  * smb_vfs_write() - vfs helper for smb file write
  * @sess:	TCP server session
@@ -235,7 +541,8 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 	if (fp->is_durable && fp->persistent_id != p_id) {
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 			fp->persistent_id, p_id);
-		return -ENOENT;
+		err = -ENOENT;
+		goto out;
 	}
 
 	if (sess->server->connection_type) {
@@ -243,14 +550,17 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		   FILE_GENERIC_WRITE_LE | FILE_MAXIMAL_ACCESS_LE |
 		   FILE_GENERIC_ALL_LE))) {
 			cifsd_err("no right to write(%llu)\n", fid);
-			return -EACCES;
+			err = -EACCES;
+			goto out;
 		}
 	}
 #endif
 
 	filp = fp->filp;
 
-	if (fp->is_stream) {
+	if (fp->stream_filp) {
+		filp = fp->stream_filp;
+	} else if (fp->is_stream) {
 		char *stream_buf = NULL, *wbuf;
 		size_t size, v_len;
 
@@ -268,14 +578,16 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		if (v_len < 0) {
 			cifsd_err("not found stream in xattr : %zd\n", v_len);
 			kvfree(stream_buf);
-			return -ENOENT;
+			err = -ENOENT;
+			goto out;
 		}
 
 		if (v_len < size) {
 			wbuf = alloc_data_mem(size);
 			if (!wbuf) {
 				kvfree(stream_buf);
-				return -ENOMEM;
+				err = -ENOMEM;
+				goto out;
 			}
 
 			if (v_len > 0) {
@@ -290,12 +602,13 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		err = smb_store_cont_xattr(&filp->f_path, fp->stream_name,
 			(void *)stream_buf, size);
 		if (err < 0)
-			return err;
+			goto out;
 
 		kvfree(stream_buf);
 		filp->f_pos = *pos;
 		*written = count;
-		return 0;
+		err = 0;
+		goto out;
 	}
 
 	err = check_lock_range(filp, *pos, *pos + count - 1,
@@ -303,7 +616,8 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 	if (err) {
 		cifsd_err("%s: unable to write due to lock\n",
 				__func__);
-		return -EAGAIN;
+		err = -EAGAIN;
+		goto out;
 	}
 
 	old_fs = get_fs();
@@ -320,19 +634,24 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 	set_fs(old_fs);
 	if (err < 0) {
 		cifsd_debug("smb write failed, err = %d\n", err);
-		return err;
+		goto out;
 	}
 
 	filp->f_pos = *pos;
 	*written = err;
 	err = 0;
 	if (sync) {
+		/* write-through only needs the written range on disk */
 		err = vfs_fsync_range(filp, offset, offset + *written, 0);
 		if (err < 0)
 			cifsd_err("fsync failed for fid %llu, err = %d\n",
 					fid, err);
+	} else if (!fp->is_stream) {
+		smb_vfs_write_behind(fp, offset, *written);
 	}
 
+out:
+	cifsd_fp_put(fp);
 	return err;
 }
 
@@ -386,7 +705,7 @@ int smb_vfs_setattr(struct cifsd_sess *sess, const char *name,
 	struct path path;
 	bool update_size = false;
 	int err = 0;
-	struct cifsd_file *fp;
+	struct cifsd_file *fp = NULL;
 
 	if (name) {
 		err = kern_path(name, 0, &path);
@@ -455,12 +774,15 @@ int smb_vfs_setattr(struct cifsd_sess *sess, const char *name,
 
 	if (!err) {
 		sync_inode_metadata(inode, 1);
+		smb_inode_meta_invalidate(inode);
 		cifsd_debug("fid %llu, setattr done\n", fid);
 	}
 
 out:
 	if (name)
 		path_put(&path);
+	else
+		cifsd_fp_put(fp);
 	return err;
 }
 
@@ -489,9 +811,38 @@ int smb_vfs_getattr(struct cifsd_sess *sess, uint64_t fid,
 	err = vfs_getattr(&filp->f_path, stat);
 	if (err)
 		cifsd_err("getattr failed for fid %llu, err %d\n", fid, err);
+	cifsd_fp_put(fp);
 	return err;
 }
 
+/**
+ * smb_vfs_birth_time() - get the creation time tracked by the filesystem
+ * @path:	path of the file
+ * @create_time:	creation time in NT format, set on success
+ *
+ * Return:	0 on success, -EOPNOTSUPP if the filesystem or kernel does
+ *		not report a birth time, otherwise error
+ */
+int smb_vfs_birth_time(struct path *path, __u64 *create_time)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	struct kstat stat;
+	int err;
+
+	err = vfs_getattr(path, &stat, STATX_BTIME, AT_STATX_SYNC_AS_STAT);
+	if (err)
+		return err;
+
+	if (!(stat.result_mask & STATX_BTIME))
+		return -EOPNOTSUPP;
+
+	*create_time = cifs_UnixTimeToNT(stat.btime);
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 /**
  * smb_vfs_fsync() - vfs helper for smb fsync
  * @sess:	TCP server session
@@ -513,26 +864,34 @@ int smb_vfs_fsync(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id)
 	if (fp->is_durable && fp->persistent_id != p_id) {
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, p_id);
+		cifsd_fp_put(fp);
 		return -ENOENT;
 	}
 
-	err = vfs_fsync(fp->filp, 0);
+	err = smb_vfs_fsync_coalesced(fp->stream_filp ? fp->stream_filp :
+			fp->filp);
 	if (err < 0)
 		cifsd_err("smb fsync failed, err = %d\n", err);
 
+	cifsd_fp_put(fp);
 	return err;
 }
 
 /**
  * smb_vfs_unlink() - vfs helper for smb rmdir or unlink
  * @name:	absolute directory or file name
+ * @stream_root:	share root of the sidecar stream store, may be NULL
+ *
+ * If the last link of the inode goes away its sidecar streams are
+ * removed as well.
  *
  * Return:	0 on success, otherwise error
  */
-int smb_vfs_unlink(char *name)
+int smb_vfs_unlink(char *name, struct path *stream_root)
 {
 	struct path parent;
 	struct dentry *dir, *dentry;
+	struct inode *inode = NULL;
 	char *last;
 	int err = -ENOENT;
 
@@ -574,6 +933,11 @@ int smb_vfs_unlink(char *name)
 		goto out_err;
 	}
 
+	if (stream_root) {
+		inode = dentry->d_inode;
+		ihold(inode);
+	}
+
 	if (S_ISDIR(dentry->d_inode->i_mode)) {
 		err = vfs_rmdir(dir->d_inode, dentry);
 		if (err && err != -ENOTEMPTY)
@@ -587,6 +951,8 @@ int smb_vfs_unlink(char *name)
 		if (err)
 			cifsd_debug("%s: unlink failed, err %d\n", name, err);
 	}
+	if (!err)
+		smb_dir_cache_invalidate(dir->d_inode);
 
 	dput(dentry);
 out_err:
@@ -595,6 +961,11 @@ out_err:
 #else
 	mutex_unlock(&dir->d_inode->i_mutex);
 #endif
+	if (inode) {
+		if (!err && !inode->i_nlink)
+			smb_vfs_stream_purge(stream_root, inode);
+		iput(inode);
+	}
 out:
 	path_put(&parent);
 	return err;
@@ -641,6 +1012,8 @@ int smb_vfs_link(const char *oldname, const char *newname)
 #endif
 	if (err)
 		cifsd_debug("vfs_link failed err %d\n", err);
+	else
+		smb_dir_cache_invalidate(newpath.dentry->d_inode);
 
 out3:
 	done_path_create(&newpath, dentry);
@@ -674,6 +1047,8 @@ int smb_vfs_symlink(const char *name, const char *symname)
 	err = vfs_symlink(dentry->d_parent->d_inode, dentry, name);
 	if (err && (err != -EEXIST || err != -ENOSPC))
 		cifsd_debug("failed to create symlink, err %d\n", err);
+	else if (!err)
+		smb_dir_cache_invalidate(path.dentry->d_inode);
 
 	done_path_create(&path, dentry);
 
@@ -717,14 +1092,19 @@ int smb_vfs_readlink(struct path *path, char *buf, int lenp)
  * @abs_oldname:	old filename
  * @abs_newname:	new filename
  * @oldfid:		file id of old file
+ * @stream_root:	share root of the sidecar stream store, may be NULL
+ *
+ * A target that is replaced and loses its last link has its sidecar
+ * streams removed.
  *
  * Return:	0 on success, otherwise error
  */
 int smb_vfs_rename(struct cifsd_sess *sess, char *abs_oldname,
-		char *abs_newname, uint64_t oldfid)
+		char *abs_newname, uint64_t oldfid, struct path *stream_root)
 {
 	struct path oldpath_p, newpath_p;
 	struct dentry *dold, *dnew, *dold_p, *dnew_p, *trap, *child_de;
+	struct inode *victim = NULL;
 	char *oldname = NULL, *newname = NULL;
 	struct file *filp = NULL;
 	struct cifsd_file *fp = NULL;
@@ -791,6 +1171,7 @@ int smb_vfs_rename(struct cifsd_sess *sess, char *abs_oldname,
 		else {
 			cifsd_err("can't get last component in path %s\n",
 					abs_newname);
+			cifsd_fp_put(fp);
 			return -ENOMEM;
 		}
 
@@ -799,6 +1180,7 @@ int smb_vfs_rename(struct cifsd_sess *sess, char *abs_oldname,
 		if (err) {
 			cifsd_err("cannot get linux path for %s, err = %d\n",
 					abs_newname, err);
+			cifsd_fp_put(fp);
 			return err;
 		}
 		dnew_p = newpath_p.dentry;
@@ -852,13 +1234,23 @@ int smb_vfs_rename(struct cifsd_sess *sess, char *abs_oldname,
 	if (dnew == trap)
 		goto out4;
 
+	if (stream_root && dnew->d_inode && dnew->d_inode != dold->d_inode) {
+		victim = dnew->d_inode;
+		ihold(victim);
+	}
+
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 	err = vfs_rename(dold_p->d_inode, dold, dnew_p->d_inode, dnew, NULL, 0);
 #else
 	err = vfs_rename(dold_p->d_inode, dold, dnew_p->d_inode, dnew);
 #endif
-	if (err)
+	if (err) {
 		cifsd_err("vfs_rename failed err %d\n", err);
+	} else {
+		smb_dir_cache_invalidate(dnew_p->d_inode);
+		if (dold_p != dnew_p)
+			smb_dir_cache_invalidate(dold_p->d_inode);
+	}
 
 out4:
 	dput(dnew);
@@ -866,10 +1258,17 @@ out3:
 	dput(dold);
 out2:
 	unlock_rename(dold_p, dnew_p);
+	if (victim) {
+		if (!err && !victim->i_nlink)
+			smb_vfs_stream_purge(stream_root, victim);
+		iput(victim);
+	}
 	path_put(&newpath_p);
 out1:
 	if (abs_oldname)
 		path_put(&oldpath_p);
+	else
+		cifsd_fp_put(fp);
 	return err;
 }
 
@@ -910,7 +1309,7 @@ int smb_vfs_truncate(struct cifsd_sess *sess, const char *name,
 			return -ENOENT;
 		}
 
-		filp = fp->filp;
+		filp = fp->stream_filp ? fp->stream_filp : fp->filp;
 		if (oplocks_enable) {
 			/* Do we need to break any of a levelII oplock? */
 			mutex_lock(&ofile_list_lock);
@@ -928,6 +1327,7 @@ int smb_vfs_truncate(struct cifsd_sess *sess, const char *name,
 
 			if (err) {
 				cifsd_err("failed due to lock\n");
+				cifsd_fp_put(fp);
 				return -EAGAIN;
 			}
 		}
@@ -935,6 +1335,7 @@ int smb_vfs_truncate(struct cifsd_sess *sess, const char *name,
 		if (err)
 			cifsd_err("truncate failed for fid %llu err %d\n",
 					fid, err);
+		cifsd_fp_put(fp);
 	}
 
 	return err;
@@ -1035,11 +1436,13 @@ int smb_vfs_setxattr(const char *filename, struct path *fpath, const char *name,
 		err = vfs_setxattr(path.dentry, name, value, size, flags);
 		if (err)
 			cifsd_debug("setxattr failed, err %d\n", err);
+		smb_xattr_index_invalidate(path.dentry->d_inode);
 		path_put(&path);
 	} else {
 		err = vfs_setxattr(fpath->dentry, name, value, size, flags);
 		if (err)
 			cifsd_debug("setxattr failed, err %d\n", err);
+		smb_xattr_index_invalidate(fpath->dentry->d_inode);
 	}
 
 	return err;
@@ -1068,6 +1471,7 @@ int smb_vfs_truncate_xattr(struct dentry *dentry)
 		if (err)
 			cifsd_err("remove xattr failed : %s\n", name);
 	}
+	smb_xattr_index_invalidate(dentry->d_inode);
 out:
 	if (xattr_list)
 		vfree(xattr_list);
@@ -1075,6 +1479,454 @@ out:
 	return err;
 }
 
+/*
+ * Stream sidecar files: on shares with "streams in files = yes" a named
+ * stream is a regular file
+ * <share>/.cifsd-streams/<dev>-<ino>-<generation>/<name> rather than an
+ * xattr, so stream I/O is ranged page cache I/O and is not capped at
+ * XATTR_SIZE_MAX. Keying on device, inode number and generation keeps the
+ * streams attached to the file across renames and hard links, and apart
+ * from files of other filesystems mounted below the share.
+ */
+#define CIFSD_STREAM_KEY_LEN	48
+
+static void smb_vfs_stream_key(struct inode *inode, char *key)
+{
+	snprintf(key, CIFSD_STREAM_KEY_LEN, "%u-%lu-%u",
+			new_encode_dev(inode->i_sb->s_dev), inode->i_ino,
+			inode->i_generation);
+}
+
+/**
+ * smb_vfs_lookup_one() - look up a name in a directory, creating it if asked
+ * @dir:	parent directory dentry
+ * @name:	name to look up
+ * @mode:	file type and mode used if the name has to be created
+ * @create:	create the name if it does not exist
+ * @created:	set to true if the name was created, may be NULL
+ *
+ * Return:	positive dentry on success, otherwise error pointer
+ */
+static struct dentry *smb_vfs_lookup_one(struct dentry *dir, const char *name,
+		umode_t mode, bool create, bool *created)
+{
+	struct dentry *dentry;
+	int err = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_lock_nested(dir->d_inode, I_MUTEX_PARENT);
+#else
+	mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+#endif
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry))
+		goto out;
+
+	if (!dentry->d_inode) {
+		if (!create)
+			err = -ENOENT;
+		else if (S_ISDIR(mode))
+			err = vfs_mkdir(dir->d_inode, dentry, mode);
+		else
+			err = vfs_create(dir->d_inode, dentry, mode, true);
+
+		if (!err && !dentry->d_inode)
+			err = -ENOENT;
+		if (!err && created)
+			*created = true;
+	} else if ((dentry->d_inode->i_mode & S_IFMT) != (mode & S_IFMT)) {
+		err = -EINVAL;
+	}
+
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+	}
+out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_unlock(dir->d_inode);
+#else
+	mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+	return dentry;
+}
+
+/**
+ * smb_vfs_stream_dir() - get the sidecar directory holding an inode's streams
+ * @root:	share root path
+ * @inode:	inode of the base file
+ * @create:	create the directory if it does not exist
+ *
+ * Return:	dentry of the directory on success, otherwise error pointer
+ */
+static struct dentry *smb_vfs_stream_dir(struct path *root,
+		struct inode *inode, bool create)
+{
+	struct dentry *top, *dir;
+	char key[CIFSD_STREAM_KEY_LEN];
+
+	top = smb_vfs_lookup_one(root->dentry, CIFSD_STREAM_DIR,
+			S_IFDIR | S_IRWXU, create, NULL);
+	if (IS_ERR(top))
+		return top;
+
+	smb_vfs_stream_key(inode, key);
+	dir = smb_vfs_lookup_one(top, key, S_IFDIR | S_IRWXU, create, NULL);
+	dput(top);
+	return dir;
+}
+
+/**
+ * smb_vfs_stream_name() - resolve a stream name in a sidecar directory
+ * @root:	share root path
+ * @dir:	sidecar directory of the base file
+ * @stream:	stream name as sent by the client
+ * @name:	NAME_MAX + 1 buffer, set to the name to use on disk
+ *
+ * Stream names are case insensitive like file names. A name without an
+ * exact match is matched caselessly against the existing streams, a new
+ * stream keeps the case the client gave it.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb_vfs_stream_name(struct path *root, struct dentry *dir,
+		const char *stream, char *name)
+{
+	struct path dir_path = { .mnt = root->mnt, .dentry = dir };
+	struct dentry *dentry;
+	int len = strlen(stream);
+
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	memcpy(name, stream, len + 1);
+
+	dentry = smb_vfs_lookup_one(dir, name, S_IFREG, false, NULL);
+	if (!IS_ERR(dentry)) {
+		dput(dentry);
+		return 0;
+	}
+	if (PTR_ERR(dentry) != -ENOENT)
+		return PTR_ERR(dentry);
+
+	/* on a miss the client's spelling stays in @name */
+	smb_search_dir_at(&dir_path, name, len);
+	return 0;
+}
+
+/**
+ * smb_vfs_stream_open() - open the sidecar file of a named stream
+ * @root:	share root path
+ * @inode:	inode of the base file
+ * @stream:	stream name, without prefix and type
+ * @flags:	open flags
+ * @create:	create the stream if it does not exist
+ * @created:	set to true if the stream was created
+ *
+ * Return:	opened file on success, otherwise error pointer
+ */
+struct file *smb_vfs_stream_open(struct path *root, struct inode *inode,
+		const char *stream, int flags, bool create, bool *created)
+{
+	struct dentry *dir, *dentry;
+	struct path path;
+	struct file *filp;
+	char name[NAME_MAX + 1];
+	int err;
+
+	if (!*stream || !strcmp(stream, ".") || !strcmp(stream, "..") ||
+			!strcmp(stream, CIFSD_STREAM_DIR))
+		return ERR_PTR(-EINVAL);
+
+	if (create) {
+		err = mnt_want_write(root->mnt);
+		if (err)
+			return ERR_PTR(err);
+	}
+
+	dir = smb_vfs_stream_dir(root, inode, create);
+	if (IS_ERR(dir)) {
+		dentry = dir;
+		goto out;
+	}
+
+	err = smb_vfs_stream_name(root, dir, stream, name);
+	if (err)
+		dentry = ERR_PTR(err);
+	else
+		dentry = smb_vfs_lookup_one(dir, name,
+				S_IFREG | S_IRUSR | S_IWUSR, create, created);
+	dput(dir);
+out:
+	if (create)
+		mnt_drop_write(root->mnt);
+	if (IS_ERR(dentry))
+		return ERR_CAST(dentry);
+
+	path.mnt = root->mnt;
+	path.dentry = dentry;
+	filp = dentry_open(&path, flags | O_LARGEFILE, current_cred());
+	dput(dentry);
+	return filp;
+}
+
+/**
+ * smb_vfs_stream_dir_open() - open an inode's sidecar directory for readdir
+ * @root:	share root path
+ * @inode:	inode of the base file
+ *
+ * Return:	opened directory on success, -ENOENT if the inode has no
+ *		sidecar streams, otherwise error pointer
+ */
+struct file *smb_vfs_stream_dir_open(struct path *root, struct inode *inode)
+{
+	struct dentry *dir;
+	struct path path;
+	struct file *filp;
+
+	dir = smb_vfs_stream_dir(root, inode, false);
+	if (IS_ERR(dir))
+		return ERR_CAST(dir);
+
+	path.mnt = root->mnt;
+	path.dentry = dir;
+	filp = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+	dput(dir);
+	return filp;
+}
+
+/**
+ * smb_vfs_stream_size() - size of a stream listed in a sidecar directory
+ * @dirp:	sidecar directory opened by smb_vfs_stream_dir_open()
+ * @name:	stream name
+ * @namelen:	stream name length
+ *
+ * Return:	stream size on success, otherwise error
+ */
+loff_t smb_vfs_stream_size(struct file *dirp, const char *name, int namelen)
+{
+	struct dentry *dir = dirp->f_path.dentry, *dentry;
+	loff_t size = -ENOENT;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_lock(dir->d_inode);
+#else
+	mutex_lock(&dir->d_inode->i_mutex);
+#endif
+	dentry = lookup_one_len(name, dir, namelen);
+	if (IS_ERR(dentry)) {
+		size = PTR_ERR(dentry);
+	} else {
+		if (dentry->d_inode)
+			size = i_size_read(dentry->d_inode);
+		dput(dentry);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_unlock(dir->d_inode);
+#else
+	mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+	return size;
+}
+
+/**
+ * smb_vfs_stream_unlink() - remove the sidecar file of a named stream
+ * @root:	share root path
+ * @inode:	inode of the base file
+ * @stream:	stream name, without prefix and type
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_vfs_stream_unlink(struct path *root, struct inode *inode,
+		const char *stream)
+{
+	struct dentry *dir, *dentry;
+	char name[NAME_MAX + 1];
+	int err;
+
+	dir = smb_vfs_stream_dir(root, inode, false);
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+
+	err = smb_vfs_stream_name(root, dir, stream, name);
+	if (err)
+		goto out;
+
+	err = mnt_want_write(root->mnt);
+	if (err)
+		goto out;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_lock_nested(dir->d_inode, I_MUTEX_PARENT);
+#else
+	mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+#endif
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+	} else {
+		if (!dentry->d_inode)
+			err = -ENOENT;
+		else
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+			err = vfs_unlink(dir->d_inode, dentry, NULL);
+#else
+			err = vfs_unlink(dir->d_inode, dentry);
+#endif
+		dput(dentry);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_unlock(dir->d_inode);
+#else
+	mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+	mnt_drop_write(root->mnt);
+out:
+	dput(dir);
+	return err;
+}
+
+/**
+ * smb_vfs_stream_purge() - remove every sidecar stream of an inode
+ * @root:	share root path
+ * @inode:	inode of the base file
+ *
+ * Called when the base file is deleted or overwritten. The directory is
+ * re-read from the start after each batch since entries are being removed
+ * under the readdir cursor.
+ */
+void smb_vfs_stream_purge(struct path *root, struct inode *inode)
+{
+	struct smb_readdir_data r_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+	};
+	struct smb_dirent *de;
+	struct file *dirp;
+	struct dentry *sdir, *dir;
+	char name[NAME_MAX + 1];
+	int removed, i;
+
+	dirp = smb_vfs_stream_dir_open(root, inode);
+	if (IS_ERR(dirp))
+		return;
+
+	r_data.dirent = (void *)__get_free_page(GFP_KERNEL);
+	r_data.size = PAGE_SIZE;
+	if (!r_data.dirent)
+		goto out;
+
+	do {
+		removed = 0;
+		r_data.used = 0;
+		r_data.full = 0;
+		r_data.dirent_count = 0;
+		vfs_llseek(dirp, 0, SEEK_SET);
+		smb_vfs_readdir(dirp, smb_filldir, &r_data);
+
+		de = (struct smb_dirent *)r_data.dirent;
+		for (i = 0; i < r_data.dirent_count; i++) {
+			if (de->namelen > NAME_MAX)
+				goto next;
+			memcpy(name, de->name, de->namelen);
+			name[de->namelen] = '\0';
+			if (strcmp(name, ".") && strcmp(name, "..") &&
+				!smb_vfs_stream_unlink(root, inode, name))
+				removed++;
+next:
+			de = (struct smb_dirent *)((char *)de +
+				ALIGN(sizeof(struct smb_dirent) + de->namelen,
+					sizeof(u64)));
+		}
+	} while (removed && r_data.full);
+
+	free_page((unsigned long)r_data.dirent);
+out:
+	fput(dirp);
+
+	sdir = smb_vfs_stream_dir(root, inode, false);
+	if (IS_ERR(sdir))
+		return;
+	dir = dget_parent(sdir);
+	if (mnt_want_write(root->mnt) == 0) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		inode_lock_nested(dir->d_inode, I_MUTEX_PARENT);
+#else
+		mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+#endif
+		if (sdir->d_parent == dir && sdir->d_inode)
+			vfs_rmdir(dir->d_inode, sdir);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		inode_unlock(dir->d_inode);
+#else
+		mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+		mnt_drop_write(root->mnt);
+	}
+	dput(dir);
+	dput(sdir);
+}
+
+/**
+ * smb_vfs_read_cached() - check if a read can be served from page cache
+ * @sess:	TCP server session
+ * @fid:	file id of open file
+ * @pos:	file pos
+ * @count:	read byte count
+ *
+ * Used to decide whether a read should be deferred to the I/O workqueue.
+ * Invalid handles and streams report cached so that the caller takes the
+ * synchronous path, which does the error handling.
+ *
+ * Return:	true if every page of the range is cached and uptodate
+ */
+bool smb_vfs_read_cached(struct cifsd_sess *sess, uint64_t fid,
+		loff_t pos, size_t count)
+{
+	struct cifsd_file *fp;
+	struct address_space *mapping;
+	struct page *page;
+	pgoff_t index, last;
+	loff_t size;
+	bool uptodate = true;
+
+	fp = get_id_from_fidtable(sess, fid);
+	if (!fp)
+		return true;
+	if (fp->is_stream || !count)
+		goto out;
+
+	mapping = fp->filp->f_mapping;
+	size = i_size_read(file_inode(fp->filp));
+	if (pos >= size)
+		goto out;
+
+	if (pos + count > size)
+		count = size - pos;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for (index = pos >> PAGE_SHIFT; index <= last; index++) {
+		page = find_get_page(mapping, index);
+		if (!page) {
+			uptodate = false;
+			break;
+		}
+
+		uptodate = PageUptodate(page);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+		put_page(page);
+#else
+		page_cache_release(page);
+#endif
+		if (!uptodate)
+			break;
+	}
+
+out:
+	cifsd_fp_put(fp);
+	return uptodate;
+}
+
 /**
  * smb_vfs_set_fadvise() - convert smb IO caching options to linux options
  * @filp:	file pointer for IO
@@ -1124,6 +1976,22 @@ void smb_vfs_set_fadvise(struct file *filp, int option)
 	}
 }
 
+/**
+ * smb_vfs_init_cache_mode() - set page cache behaviour of a new open
+ * @fp:		cifsd file pointer
+ * @tcon:	tree connect the file is opened on
+ */
+void smb_vfs_init_cache_mode(struct cifsd_file *fp, struct cifsd_tcon *tcon)
+{
+	if (!tcon || S_ISDIR(file_inode(fp->filp)->i_mode))
+		return;
+
+	fp->share = tcon->share;
+	fp->drop_behind = tcon->share->config.drop_behind;
+	fp->seq_start = fp->seq_next = fp->drop_pos = 0;
+	fp->wb_start = fp->wb_next = 0;
+}
+
 /**
  * smb_vfs_lock() - vfs helper for smb file locking
  * @filp:	the file to apply the lock to
@@ -1151,33 +2019,68 @@ int smb_vfs_lock(struct file *filp, int cmd,
 int check_lock_range(struct file *filp, loff_t start, loff_t end,
 		unsigned char type)
 {
-	struct file_lock *flock;
 	struct file_lock_context *ctx = file_inode(filp)->i_flctx;
+	struct cifsd_lock_tree *tree;
+	struct cifsd_lock *lock;
+	struct file_lock fl;
 	int error = 0;
 
+	/* no byte-range locks on the inode at all, the common case */
 	if (!ctx || list_empty_careful(&ctx->flc_posix))
 		return 0;
 
-	list_for_each_entry(flock, &ctx->flc_posix, fl_list) {
+	tree = cifsd_lock_tree_get(file_inode(filp));
+	if (!tree)
+		goto posix;
+
+	for (lock = cifsd_lock_first(tree, start, end); lock;
+			lock = cifsd_lock_next(lock, start, end)) {
+		/* waiters and zero byte locks don't cover any data */
+		if (lock->work || lock->zero_len)
+			continue;
+
 		/* check conflict locks */
-		if (flock->fl_end >= start && end >= flock->fl_start) {
-			if (flock->fl_type == F_RDLCK) {
-				if (type == WRITE) {
-					cifsd_err("not allow write by shared lock\n");
-					error = 1;
-					goto out;
-				}
-			} else if (flock->fl_type == F_WRLCK) {
-				/* check owner in lock */
-				if (flock->fl_file != filp) {
-					error = 1;
-					cifsd_err("not allow rw access by exclusive lock from other opens\n");
-					goto out;
-				}
+		if (lock->fl->fl_type == F_RDLCK) {
+			if (type == WRITE) {
+				cifsd_err("not allow write by shared lock\n");
+				error = 1;
+				goto out;
+			}
+		} else if (lock->fl->fl_type == F_WRLCK) {
+			/* check owner in lock */
+			if (lock->fl->fl_file != filp) {
+				error = 1;
+				cifsd_err("not allow rw access by exclusive lock from other opens\n");
+				goto out;
 			}
 		}
 	}
 out:
+	cifsd_lock_tree_put(tree);
+	if (error)
+		return error;
+
+posix:
+	/*
+	 * Locks of local processes, NFS and other lock owners. SMB locks
+	 * passed the lock index above, a lock conflicting with the handle
+	 * as its owner is one the index does not know about.
+	 */
+	locks_init_lock(&fl);
+	fl.fl_owner = filp;
+	fl.fl_pid = current->tgid;
+	fl.fl_file = filp;
+	fl.fl_flags = FL_POSIX;
+	fl.fl_type = type == WRITE ? F_WRLCK : F_RDLCK;
+	fl.fl_start = start;
+	fl.fl_end = end;
+	error = vfs_test_lock(filp, &fl);
+	if (!error && fl.fl_type != F_UNLCK) {
+		cifsd_err("not allow rw access by lock of other owner\n");
+		error = 1;
+	}
+	if (fl.fl_ops && fl.fl_ops->fl_release_private)
+		fl.fl_ops->fl_release_private(&fl);
 	return error;
 }
 
@@ -1195,7 +2098,125 @@ int smb_vfs_readdir(struct file *file, filldir_t filler,
 	return err;
 }
 
+/**
+ * smb_vfs_readdir_buf() - size the readdir staging buffer of a handle
+ * @rdata:	readdir data of the search handle
+ * @size:	wanted buffer size
+ *
+ * The buffer only grows, up to CIFSD_READDIR_BUF_MAX, and callers only
+ * ask for it once every staged entry has been consumed.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_vfs_readdir_buf(struct smb_readdir_data *rdata, unsigned int size)
+{
+	size = clamp_t(unsigned int, PAGE_ALIGN(size), PAGE_SIZE,
+			CIFSD_READDIR_BUF_MAX);
+	if (rdata->dirent && rdata->size >= size)
+		return 0;
+
+	smb_vfs_readdir_buf_free(rdata);
+	rdata->dirent = alloc_data_mem(size);
+	if (!rdata->dirent)
+		return -ENOMEM;
+
+	rdata->size = size;
+	rdata->used = 0;
+	rdata->full = 0;
+	return 0;
+}
+
+/**
+ * smb_vfs_readdir_buf_free() - free the readdir staging buffer of a handle
+ * @rdata:	readdir data of the search handle
+ */
+void smb_vfs_readdir_buf_free(struct smb_readdir_data *rdata)
+{
+	kvfree(rdata->dirent);
+	rdata->dirent = NULL;
+	rdata->size = 0;
+}
+
+/**
+ * smb_vfs_child_lookup() - look up a child of an open directory
+ * @dirp:	open directory
+ * @name:	child name
+ * @namelen:	child name length
+ *
+ * Resolve the child relative to the open directory rather than walking
+ * its absolute path. Children of a directory being listed are normally
+ * hot in the dcache, so the lockless hash probe serves most entries and
+ * only misses take the directory lock for a real lookup.
+ *
+ * Return:	referenced positive dentry on success, otherwise error pointer
+ */
+struct dentry *smb_vfs_child_lookup(struct file *dirp, const char *name,
+		int namelen)
+{
+	struct dentry *dir = dirp->f_path.dentry, *dentry;
+	struct qstr q = QSTR_INIT(name, namelen);
+
+	dentry = d_hash_and_lookup(dir, &q);
+	if (IS_ERR(dentry))
+		return dentry;
+
+	if (!dentry || !dentry->d_inode) {
+		dput(dentry);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		inode_lock(dir->d_inode);
+#else
+		mutex_lock(&dir->d_inode->i_mutex);
+#endif
+		dentry = lookup_one_len(name, dir, namelen);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		inode_unlock(dir->d_inode);
+#else
+		mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+		if (IS_ERR(dentry))
+			return dentry;
+	}
+
+	if (!dentry->d_inode) {
+		dput(dentry);
+		return ERR_PTR(-ENOENT);
+	}
+	return dentry;
+}
+
+/**
+ * smb_vfs_child_stat() - stat a child of an open directory
+ * @dirp:	open directory
+ * @name:	child name
+ * @namelen:	child name length
+ * @stat:	stat of the child
+ * @store_dos:	the share keeps creation times in xattrs
+ * @create_time:	creation time of the child, may be NULL
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_vfs_child_stat(struct file *dirp, const char *name, int namelen,
+		struct kstat *stat, bool store_dos, __u64 *create_time)
+{
+	struct dentry *dentry;
+
+	dentry = smb_vfs_child_lookup(dirp, name, namelen);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	generic_fillattr(dentry->d_inode, stat);
+	if (create_time) {
+		struct path path = {
+			.mnt = dirp->f_path.mnt,
+			.dentry = dentry
+		};
 
+		*create_time = smb_get_create_time(&path, stat, store_dos,
+				false);
+	}
+	dput(dentry);
+	return 0;
+}
 
 int smb_vfs_alloc_size(struct file *filp, loff_t len)
 {